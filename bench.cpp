@@ -0,0 +1,628 @@
+// Headless benchmark of the raster and history kernels in canvas.h.
+//
+//   g++ -O2 -std=c++17 -pthread bench.cpp -o bench -lz
+//   ./bench [max_side] [max_threads]
+//
+// Canvas sides go from 512 up to max_side (16384 by default). Every kernel
+// prints its throughput in pixels/s and the p50/p90/p99 latency of one call.
+// Undo is then timed on a 4096^2 history the background worker has packed.
+// The layer compositor is measured next, on a 2048^2 stack of 1, 8 and 32
+// layers, with every span kernel the CPU has, followed by the sRGB <-> linear
+// span conversions against plain powf, then the mip and resampling kernels.
+// The jobs that run on the worker pool are then timed with 1, 2, 4... up to
+// max_threads threads (one per hardware thread by default), checking that
+// every count paints the same image.
+// Last, an 8192^2 two-layer document is saved, saved again after a stroke,
+// opened back, composited and exported to PNG, in bench.pdoc/bench.png.
+
+#include "canvas.h"
+#include "document.h"
+#include "oplog.h"
+#include "mipmap.h"
+
+struct Samples {
+	std::vector<double> latencies;
+	double pixels;
+};
+
+double percentile(std::vector<double> &v, double p) {
+	size_t i = (size_t)(p * (v.size() - 1));
+	return v[i];
+}
+
+void report(const char *name, int side, int radius, Samples &s) {
+	if (s.latencies.empty()) return;
+	std::sort(s.latencies.begin(), s.latencies.end());
+	double total = 0;
+	for (double t : s.latencies) total += t;
+	char label[64];
+	if (radius >= 0) snprintf(label, sizeof(label), "%s r=%d", name, radius);
+	else snprintf(label, sizeof(label), "%s", name);
+	printf("%-14s %6d^2  %10.1f Mpx/s  p50 %9.3f us  p90 %9.3f us  p99 %9.3f us  (%zu runs)\n",
+			label, side, s.pixels/total/1e6,
+			percentile(s.latencies, 0.50)*1e6,
+			percentile(s.latencies, 0.90)*1e6,
+			percentile(s.latencies, 0.99)*1e6,
+			s.latencies.size());
+}
+
+int dab_area(int radius) {
+	const std::vector<int> &half = brush_span_table(radius);
+	int area = 2*half[0] + 1;
+	for (int d = 1; d <= radius; d++) area += 2*(2*half[d] + 1);
+	return area;
+}
+
+Vec2i random_point(int side) {
+	return { rand() % side, rand() % side };
+}
+
+void bench_dabs(int side, int radius, uint32_t color) {
+	Samples s = { {}, 0 };
+	int area = dab_area(radius);
+	for (int i = 0; i < 2000; i++) {
+		Vec2i p = random_point(side);
+		double start = now_seconds();
+		stroke_segment(p, p, radius, color);
+		s.latencies.push_back(now_seconds() - start);
+		s.pixels += area;
+	}
+	report("dab", side, radius, s);
+}
+
+void bench_lines(int side, int radius, uint32_t color) {
+	Samples s = { {}, 0 };
+	for (int i = 0; i < 500; i++) {
+		Vec2i a = random_point(side);
+		Vec2i b = { clamp(a.x + rand() % 129 - 64, 0, side - 1), clamp(a.y + rand() % 129 - 64, 0, side - 1) };
+		double len = sqrt((double)(b.x - a.x)*(b.x - a.x) + (double)(b.y - a.y)*(b.y - a.y));
+		double start = now_seconds();
+		stroke_segment(a, b, radius, color);
+		s.latencies.push_back(now_seconds() - start);
+		s.pixels += len*(2*radius + 1) + dab_area(radius);
+	}
+	report("line", side, radius, s);
+}
+
+void bench_fill(int side, uint32_t color) {
+	Samples s = { {}, 0 };
+	for (int i = 0; i < 3; i++) {
+		clear_canvas(true);
+		double start = now_seconds();
+		boundary_fill(side/2, side/2, color);
+		s.latencies.push_back(now_seconds() - start);
+		s.pixels += (double)side*side;
+	}
+	report("fill", side, -1, s);
+}
+
+void bench_clear(int side) {
+	Samples s = { {}, 0 };
+	for (int i = 0; i < 3; i++) {
+		double start = now_seconds();
+		clear_canvas(true);
+		s.latencies.push_back(now_seconds() - start);
+		s.pixels += (double)side*side;
+	}
+	report("clear", side, -1, s);
+}
+
+void bench_history(int side, int radius, uint32_t color) {
+	Samples commit = { {}, 0 }, undos = { {}, 0 }, redos = { {}, 0 };
+	clear_canvas(true);
+	int steps = 100;
+	for (int i = 0; i < steps; i++) {
+		Vec2i a = random_point(side);
+		Vec2i b = random_point(side);
+		b = { (a.x + b.x)/2, (a.y + b.y)/2 };
+		stroke_segment(a, b, radius, color);
+		size_t touched = canvas.history.touched_list.size();
+		double start = now_seconds();
+		commit_history();
+		commit.latencies.push_back(now_seconds() - start);
+		commit.pixels += (double)touched * TILE_SIZE * TILE_SIZE;
+	}
+	while (canvas.history.cursor > 0) {
+		size_t tiles = canvas.history.entries[canvas.history.cursor - 1].changes.size();
+		double start = now_seconds();
+		undo();
+		undos.latencies.push_back(now_seconds() - start);
+		undos.pixels += (double)tiles * TILE_SIZE * TILE_SIZE;
+	}
+	while (canvas.history.cursor < (int)canvas.history.entries.size()) {
+		size_t tiles = canvas.history.entries[canvas.history.cursor].changes.size();
+		double start = now_seconds();
+		redo();
+		redos.latencies.push_back(now_seconds() - start);
+		redos.pixels += (double)tiles * TILE_SIZE * TILE_SIZE;
+	}
+	report("commit", side, radius, commit);
+	report("undo", side, radius, undos);
+	report("redo", side, radius, redos);
+}
+
+// Paints every layer with random strokes, mixing blend modes and opacities
+void build_layer_stack(int side, int layers) {
+	create_canvas(side, side);
+	stroke_antialias = true;
+	for (int l = 0; l < layers; l++) {
+		if (l) add_layer();
+		active_layer().blend = l % BLEND_MODES;
+		active_layer().opacity = 128 + rand() % 128;
+		for (int i = 0; i < 24; i++) {
+			Vec3 rgb = { rand() % 256 / 255.0f, rand() % 256 / 255.0f, rand() % 256 / 255.0f };
+			stroke_segment(random_point(side), random_point(side), 20 + rand() % 40, pack_color(rgb));
+		}
+	}
+	stroke_antialias = false;
+	commit_history();
+	reset_history();
+}
+
+void time_composite(const char *name, int side, Samples &s) {
+	Rect all = { { 0, 0 }, { canvas.tiles_count.x - 1, canvas.tiles_count.y - 1 } };
+	for (int i = 0; i < 5; i++) {
+		double start = now_seconds();
+		composite_tiles(all);
+		s.latencies.push_back(now_seconds() - start);
+		s.pixels += (double)side*side;
+	}
+	report(name, side, -1, s);
+}
+
+// "flatten" composites the whole stack from scratch, with the bottom layer
+// active; "repaint" is the per-frame cost while painting on the top layer,
+// once the layers under it are cached
+void bench_composite(int side, int layers) {
+	build_layer_stack(side, layers);
+	printf("-- %d layers, %zu painted tiles\n", layers, layer_tiles_resident());
+	struct { const char *name; CompositeSpan kernel; } kernels[] = {
+		{ "scalar", composite_span_scalar },
+#ifdef COMPOSITE_X86
+		{ "sse2", composite_span_sse2 },
+		{ "avx2", __builtin_cpu_supports("avx2") ? composite_span_avx2 : NULL },
+#endif
+	};
+	CompositeSpan selected = composite_span;
+	for (auto &k : kernels) {
+		if (!k.kernel) continue;
+		composite_span = k.kernel;
+		char label[64];
+		Samples flatten = { {}, 0 }, repaint = { {}, 0 };
+		select_layer(0);
+		snprintf(label, sizeof(label), "flatten %s", k.name);
+		time_composite(label, side, flatten);
+		select_layer(layers - 1);
+		Rect all = { { 0, 0 }, { canvas.tiles_count.x - 1, canvas.tiles_count.y - 1 } };
+		composite_tiles(all);
+		snprintf(label, sizeof(label), "repaint %s", k.name);
+		time_composite(label, side, repaint);
+	}
+	composite_span = selected;
+}
+
+// Reference for the conversion tables: the same round trip with powf
+void decode_span_powf(const uint32_t *src, float *dst, int n) {
+	for (int i = 0; i < n; i++, dst += 4) {
+		float a = (float)(src[i] >> 24);
+		for (int c = 0; c < 3; c++) {
+			float v = a > 0 ? ((src[i] >> 8*c) & 255) / a : 0;
+			dst[c] = srgb_to_linear_exact(v) * a / 255;
+		}
+		dst[3] = a / 255;
+	}
+}
+
+void encode_span_powf(const float *src, uint32_t *dst, int n) {
+	for (int i = 0; i < n; i++, src += 4) {
+		float a = src[3];
+		uint32_t pixel = (uint32_t)(a * 255 + 0.5f) << 24;
+		for (int c = 0; c < 3; c++) {
+			float v = a > 0 ? linear_to_srgb_exact(src[c] / a) * a : 0;
+			pixel |= (uint32_t)(v * 255 + 0.5f) << 8*c;
+		}
+		dst[i] = pixel;
+	}
+}
+
+void bench_color() {
+	const int n = 1 << 16;
+	std::vector<uint32_t> pixels(n), out(n);
+	std::vector<float> linear(4*n);
+	for (uint32_t &p : pixels) {
+		unsigned a = rand() % 2 ? 255 : rand() % 256;
+		p = a << 24;
+		for (int c = 0; c < 3; c++) p |= (a ? rand() % (a + 1) : 0) << 8*c;
+	}
+	struct { const char *name; DecodeSpan decode; EncodeSpan encode; } paths[] = {
+		{ "powf", decode_span_powf, encode_span_powf },
+		{ "lut", decode_span_scalar, encode_span_scalar },
+#ifdef COLOR_X86
+		{ "sse2", decode_span_sse2, encode_span_sse2 },
+		{ "avx2", __builtin_cpu_supports("avx2") ? decode_span_avx2 : NULL, encode_span_avx2 },
+#endif
+	};
+	for (auto &p : paths) {
+		if (!p.decode) continue;
+		Samples decode = { {}, 0 }, encode = { {}, 0 };
+		for (int i = 0; i < 20; i++) {
+			double start = now_seconds();
+			p.decode(pixels.data(), linear.data(), n);
+			decode.latencies.push_back(now_seconds() - start);
+			decode.pixels += n;
+			start = now_seconds();
+			p.encode(linear.data(), out.data(), n);
+			encode.latencies.push_back(now_seconds() - start);
+			encode.pixels += n;
+		}
+		char label[64];
+		snprintf(label, sizeof(label), "decode %s", p.name);
+		report(label, 256, -1, decode);
+		snprintf(label, sizeof(label), "encode %s", p.name);
+		report(label, 256, -1, encode);
+	}
+}
+
+// The mip levels of one tile per run, which is what a dab costs the display
+// at a zoom below 1:1; the kernels have to agree bit for bit
+void bench_mips() {
+	std::vector<uint32_t> tile(TILE_SIZE*TILE_SIZE), expected(mip_chain_pixels(TILE_SIZE)), chain(expected.size());
+	for (uint32_t &p : tile) p = rand() % 2 ? 0 : (uint32_t)rand() | 0xff000000u;
+	build_mip_chain(tile.data(), TILE_SIZE, expected.data(), mip_reduce_scalar);
+	struct { const char *name; MipReduce reduce; } paths[] = {
+		{ "mips scalar", mip_reduce_scalar },
+#ifdef MIPMAP_X86
+		{ "mips sse2", mip_reduce_sse2 },
+#endif
+	};
+	for (auto &p : paths) {
+		Samples s = { {}, 0 };
+		for (int i = 0; i < 1000; i++) {
+			double start = now_seconds();
+			build_mip_chain(tile.data(), TILE_SIZE, chain.data(), p.reduce);
+			s.latencies.push_back(now_seconds() - start);
+			s.pixels += TILE_SIZE*TILE_SIZE;
+		}
+		report(p.name, TILE_SIZE, -1, s);
+		if (chain != expected) printf("%s differs from scalar\n", p.name);
+	}
+}
+
+// Rows of a 1024^2 source drawn rotated by 30 degrees and scaled 1.3x, the
+// inner loop of putting a selection down; then a whole 1024^2 selection
+// stamped back onto a 4096^2 canvas. The kernels have to agree bit for bit.
+void bench_resample() {
+	int side = 1024;
+	std::vector<uint32_t> pixels((size_t)side*side);
+	for (uint32_t &p : pixels) {
+		uint32_t a = rand() & 0xff, c = rand();
+		p = a << 24 | ((c & 0xff)*a/255) << 16 | ((c >> 8 & 0xff)*a/255) << 8 | (c >> 16 & 0xff)*a/255;
+	}
+	ResampleSource src = { pixels.data(), side, side };
+	float c = cosf(0.52f) / 1.3f, sn = sinf(0.52f) / 1.3f;
+	int32_t dx = c*RESAMPLE_ONE, dy = -sn*RESAMPLE_ONE;
+	std::vector<uint32_t> row(side), expected(side);
+	for (int filter = 0; filter < RESAMPLE_FILTERS; filter++) {
+		struct { const char *name; ResampleRow row; } paths[] = {
+			{ "", filter == RESAMPLE_NEAREST ? resample_nearest_scalar : filter == RESAMPLE_BILINEAR ? resample_bilinear_scalar : resample_bicubic_scalar },
+#ifdef RESAMPLE_X86
+			{ " sse2", filter == RESAMPLE_NEAREST ? resample_nearest_sse2 : filter == RESAMPLE_BILINEAR ? resample_bilinear_sse2 : resample_bicubic_sse2 },
+#endif
+		};
+		bool same = true;
+		for (auto &p : paths) {
+			Samples s = { {}, 0 };
+			for (int y = 0; y < side; y++) {
+				int32_t x0 = (int32_t)(side/4*RESAMPLE_ONE) + y*(int32_t)(sn*RESAMPLE_ONE), y0 = (int32_t)(y*c*RESAMPLE_ONE);
+				double start = now_seconds();
+				p.row(row.data(), src, x0, y0, dx, dy, side);
+				s.latencies.push_back(now_seconds() - start);
+				s.pixels += side;
+				if (p.row == paths[0].row) continue;
+				paths[0].row(expected.data(), src, x0, y0, dx, dy, side);
+				if (expected != row) same = false;
+			}
+			char name[32];
+			snprintf(name, sizeof(name), "%s%s", resample_filter_names[filter], p.name);
+			report(name, side, -1, s);
+		}
+		if (!same) printf("%s sse2 differs from scalar\n", resample_filter_names[filter]);
+	}
+
+	create_canvas(4096, 4096);
+	stroke_segment({ 512, 512 }, { 1536, 1536 }, 200, pack_color({ 0.2f, 0.5f, 0.9f }));
+	FloatingPixels lifted;
+	lift_selection({ { 512, 512 }, { 512 + side - 1, 512 + side - 1 } }, lifted);
+	SelectionTransform t = { { 2048, 2048 }, { 1.3f, 1.3f }, 0.52f };
+	for (int filter = 0; filter < RESAMPLE_FILTERS; filter++) {
+		double start = now_seconds();
+		std::vector<int> written = stamp_selection(lifted, t, filter);
+		printf("stamp %-8s %5d^2  %8.2f ms  %zu tiles\n", resample_filter_names[filter], side, (now_seconds() - start)*1e3, written.size());
+	}
+}
+
+struct ScalingRun {
+	double strokes, fill, commit, composite;
+	uint64_t hash;
+};
+
+ScalingRun run_pool_jobs(int side) {
+	ScalingRun run;
+	srand(7);
+	create_canvas(side, side);
+	uint32_t color = pack_color({ 0.2f, 0.5f, 0.9f });
+	for (int i = 0; i < 256; i++) {
+		Vec2i a = random_point(side);
+		Vec2i b = { clamp(a.x + rand() % 1025 - 512, 0, side - 1), clamp(a.y + rand() % 1025 - 512, 0, side - 1) };
+		input.segments.push_back({ a, b, 100, color });
+	}
+	double start = now_seconds();
+	flush_strokes();
+	run.strokes = now_seconds() - start;
+
+	start = now_seconds();
+	boundary_fill(0, 0, pack_color({ 1, 1, 0 }));
+	run.fill = now_seconds() - start;
+
+	start = now_seconds();
+	commit_history();
+	run.commit = now_seconds() - start;
+
+	add_layer();
+	active_layer().blend = BLEND_MULTIPLY;
+	active_layer().opacity = 160;
+	stroke_segment({ 0, 0 }, { side - 1, side - 1 }, std::min(side/8, MAX_BRUSH_R), color);
+	select_layer(0);
+	Rect all = { { 0, 0 }, { canvas.tiles_count.x - 1, canvas.tiles_count.y - 1 } };
+	start = now_seconds();
+	composite_tiles(all);
+	run.composite = now_seconds() - start;
+
+	run.hash = canvas_hash();
+	for (Tile *tile : canvas.tiles) {
+		if (tile) hash_bytes(&run.hash, tile, sizeof(Tile));
+	}
+	return run;
+}
+
+void bench_scaling(int side, int max_threads) {
+	printf("-- worker pool, %d^2: 256 strokes r=100, full fill, its commit, composite of 2 layers\n", side);
+	ScalingRun base = {};
+	for (int threads = 1; threads <= max_threads; threads *= 2) {
+		pool_start(threads);
+		pool.steals = 0;
+		ScalingRun run = run_pool_jobs(side);
+		if (threads == 1) base = run;
+		printf("threads %3d  strokes %8.2f ms (x%4.2f)  fill %8.2f ms (x%4.2f)  commit %8.2f ms (x%4.2f)  composite %8.2f ms (x%4.2f)  steals %lu  %s\n",
+				threads, run.strokes*1e3, base.strokes/run.strokes, run.fill*1e3, base.fill/run.fill,
+				run.commit*1e3, base.commit/run.commit, run.composite*1e3, base.composite/run.composite,
+				pool.steals.load(), run.hash == base.hash ? "same image" : "IMAGE DIFFERS");
+		if (threads < max_threads && threads*2 > max_threads) threads = max_threads/2;
+	}
+	pool_start(1);
+}
+
+// Full canvas fills between rounds of antialiased strokes, at the default
+// thread count; undo has to stay under a frame at 60 Hz once it decodes
+void bench_packed_history(int side) {
+	printf("-- packed history, %d^2: 4 full fills, each followed by 64 antialiased strokes\n", side);
+	create_canvas(side, side);
+	size_t budget = canvas.history.budget;
+	canvas.history.budget = (size_t)1 << 40; // keep every step, packed or not
+	stroke_antialias = true;
+	Samples commit = { {}, 0 }, undos = { {}, 0 };
+	for (int i = 0; i < 4; i++) {
+		boundary_fill(0, 0, pack_color({ i/4.0f, 0.5f, 1 - i/4.0f }));
+		commit_history();
+		for (int s = 0; s < 64; s++) {
+			Vec2i a = random_point(side);
+			Vec2i b = random_point(side);
+			stroke_segment(a, { (a.x + b.x)/2, (a.y + b.y)/2 }, 40, pack_color({ 1, i/4.0f, 0 }));
+			size_t touched = canvas.history.touched_list.size();
+			double start = now_seconds();
+			commit_history();
+			commit.latencies.push_back(now_seconds() - start);
+			commit.pixels += (double)touched * TILE_SIZE * TILE_SIZE;
+		}
+	}
+	double start = now_seconds();
+	history_worker_wait();
+	double wait = now_seconds() - start;
+	size_t stored = 0, unpacked = 0;
+	for (HistoryEntry &entry : canvas.history.entries) stored += entry_bytes(entry, &unpacked);
+	printf("stored         %6d^2  %zu MiB of %zu MiB unpacked (%.1fx), packing finished %.1f ms after the last commit\n",
+			side, stored >> 20, unpacked >> 20, (double)unpacked/stored, wait*1e3);
+
+	double worst = 0;
+	while (canvas.history.cursor > 0) {
+		size_t tiles = canvas.history.entries[canvas.history.cursor - 1].changes.size();
+		start = now_seconds();
+		undo();
+		double t = now_seconds() - start;
+		undos.latencies.push_back(t);
+		undos.pixels += (double)tiles * TILE_SIZE * TILE_SIZE;
+		worst = std::max(worst, t);
+	}
+	report("commit", side, 40, commit);
+	report("packed undo", side, -1, undos);
+	printf("slowest undo   %6d^2  %.3f ms (%s a 16.7 ms frame)  cache hits %lu  misses %lu\n",
+			side, worst*1e3, worst < 1/60.0 ? "within" : "OVER", history_worker.hits, history_worker.misses);
+	stroke_antialias = false;
+	canvas.history.budget = budget;
+}
+
+void bench_document(int side) {
+	const char *path = "bench.pdoc", *png = "bench.png";
+	printf("-- document, %d^2: 2 layers of 128 antialiased strokes r=100 over a fill\n", side);
+	create_canvas(side, side);
+	stroke_antialias = true;
+	boundary_fill(0, 0, pack_color({ 0.9f, 0.9f, 0.8f }));
+	for (int layer = 0; layer < 2; layer++) {
+		if (layer) add_layer();
+		for (int i = 0; i < 128; i++) {
+			stroke_segment(random_point(side), random_point(side), 100, pack_color({ i/128.0f, 0.3f, 1 - i/128.0f }));
+		}
+	}
+	active_layer().blend = BLEND_MULTIPLY;
+
+	double start = now_seconds();
+	save_document(path);
+	double full = now_seconds() - start;
+	uint64_t size = document.end;
+
+	stroke_segment({ side/2, side/2 }, { side/2 + 200, side/2 }, 20, pack_color({ 0, 0, 0 }));
+	start = now_seconds();
+	save_document(path);
+	double incremental = now_seconds() - start;
+	unsigned long written = document.written;
+	uint64_t hash = canvas_hash();
+
+	start = now_seconds();
+	open_document(document, path);
+	double open = now_seconds() - start;
+	Rect all = { { 0, 0 }, { canvas.tiles_count.x - 1, canvas.tiles_count.y - 1 } };
+	start = now_seconds();
+	composite_tiles(all);
+	double composite = now_seconds() - start;
+	bool same = canvas_hash() == hash;
+
+	start = now_seconds();
+	export_png(png);
+	double handoff = now_seconds() - start;
+	export_png_wait();
+	double exported = now_seconds() - start;
+
+	printf("save           %6d^2  %8.2f ms  %llu MiB on disk\n", side, full*1e3, (unsigned long long)(size >> 20));
+	printf("save again     %6d^2  %8.2f ms  %lu tiles written\n", side, incremental*1e3, written);
+	printf("open           %6d^2  %8.2f ms  then %8.2f ms to decode and composite it all  %s\n",
+			side, open*1e3, composite*1e3, same ? "same image" : "IMAGE DIFFERS");
+	printf("export png     %6d^2  %8.2f ms on the calling thread, %8.2f ms in the background\n", side, handoff*1e3, exported*1e3);
+	stroke_antialias = false;
+	unlink(path);
+	unlink(png);
+}
+
+double thread_seconds() {
+	timespec t;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+	return t.tv_sec + t.tv_nsec*1e-9;
+}
+
+// Paints the same random walk with and without the log. The difference in
+// the painting thread's own time is what the hot path pays for it, the one
+// in wall time adds the writer's share of the cores.
+double paint_walk(int side, int ops, uint32_t seed, double *wall) {
+	srand(seed);
+	Vec2i p = random_point(side);
+	double start = thread_seconds();
+	*wall = now_seconds();
+	for (int i = 0; i < ops; i++) {
+		Vec2i q = { clamp(p.x + rand() % 17 - 8, 0, side - 1), clamp(p.y + rand() % 17 - 8, 0, side - 1) };
+		input.segments.push_back({ p, q, 2, pack_color({ (i >> 10 & 255)/255.0f, 0.5f, 0.5f }) });
+		p = q;
+		if (input.segments.size() == 100) flush_strokes();
+		if (i % 1000 == 999) commit_history();
+	}
+	flush_strokes();
+	commit_history();
+	*wall = now_seconds() - *wall;
+	return thread_seconds() - start;
+}
+
+void bench_oplog(int side, int ops) {
+	const char *base = "bench-autosave";
+	printf("-- autosave, %d^2: %d logged segments r=2, committed every 1000\n", side, ops);
+	size_t budget = canvas.history.budget;
+	canvas.history.budget = 0;
+	create_canvas(side, side);
+	double plain_wall, logged_wall;
+	double plain = paint_walk(side, ops, 7, &plain_wall);
+
+	create_canvas(side, side);
+	oplog_start(base);
+	double logged = paint_walk(side, ops, 7, &logged_wall);
+	uint64_t hash = canvas_hash();
+	double start = now_seconds();
+	oplog_stop(false); // as if the session died once the last batch was synced
+	double drain = now_seconds() - start;
+	struct stat st;
+	stat((std::string(base) + ".oplog").c_str(), &st);
+
+	create_canvas(side, side);
+	start = now_seconds();
+	oplog_recover(base);
+	double recover = now_seconds() - start;
+	bool same = canvas_hash() == hash;
+
+	printf("log            %6d^2  %8.2f ns per op on the painting thread, %8.2f ns in wall time  %lu waits for the writer\n",
+			side, (logged - plain)*1e9/ops, (logged_wall - plain_wall)*1e9/ops, oplog.waits);
+	printf("drain          %6d^2  %8.2f ms  %llu MiB logged, %llu syncs\n",
+			side, drain*1e3, (unsigned long long)(st.st_size >> 20), (unsigned long long)oplog.syncs);
+	printf("recover        %6d^2  %8.2f ms for %d ops  %s\n", side, recover*1e3, ops, same ? "same image" : "IMAGE DIFFERS");
+	unlink((std::string(base) + ".oplog").c_str());
+	unlink((std::string(base) + ".pdoc").c_str());
+	canvas.history.budget = budget;
+}
+
+// Cost of one timed scope, drained every 1000 like a frame would; built
+// with -DPAINT_NO_PROFILE it is the bare loop
+void bench_profile(int scopes) {
+	volatile int sink = 0;
+	double start = now_seconds();
+	for (int i = 0; i < scopes; i++) {
+		PROFILE_SCOPE("bench");
+		sink = sink + 1;
+		if (i % 1000 == 999) profile_frame();
+	}
+	double elapsed = now_seconds() - start;
+	printf("profile scope  %8.2f ns per scope over %d\n", elapsed*1e9/scopes, scopes);
+}
+
+int main(int argc, char **argv) {
+	int max_side = argc > 1 ? atoi(argv[1]) : 16384;
+	int max_threads = argc > 2 ? atoi(argv[2]) : std::max(1u, std::thread::hardware_concurrency());
+	int sides[] = { 512, 2048, 8192, 16384 };
+	int radii[] = { 1, 5, 25, 100, 400 };
+	uint32_t color = pack_color({ 0.9f, 0.2f, 0.1f });
+	srand(1);
+
+	for (int side : sides) {
+		if (side > max_side) break;
+		create_canvas(side, side);
+		for (int antialias = 0; antialias <= 1; antialias++) {
+			stroke_antialias = antialias;
+			if (antialias) printf("-- antialiased\n");
+			for (int radius : radii) bench_dabs(side, radius, color);
+			for (int radius : radii) bench_lines(side, radius, color);
+		}
+		printf("-- antialiased, linear light\n");
+		linear_blending = true;
+		for (int radius : radii) bench_lines(side, radius, color);
+		linear_blending = false;
+		stroke_antialias = false;
+		size_t painted = layer_tiles_resident();
+		printf("resident       %6d^2  %zu of %zu tiles, %zu MiB\n", side, painted, canvas.tiles.size(), painted*sizeof(Tile) >> 20);
+		bench_fill(side, color);
+		bench_clear(side);
+		bench_history(side, 25, color);
+		printf("\n");
+	}
+
+	bench_packed_history(std::min(max_side, 4096));
+	printf("\n");
+
+	int layer_counts[] = { 1, 8, 32 };
+	for (int layers : layer_counts) bench_composite(2048, layers);
+	printf("\n");
+	bench_color();
+	bench_mips();
+	bench_resample();
+	printf("\n");
+	bench_scaling(std::min(max_side, 8192), max_threads);
+	printf("\n");
+	bench_document(std::min(max_side, 8192));
+	bench_oplog(std::min(max_side, 2048), 1000000);
+	bench_profile(10000000);
+	history_worker_stop();
+	return 0;
+}
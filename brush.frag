@@ -0,0 +1,24 @@
+#version 330 core
+
+flat in vec4 brush_segment;
+flat in float brush_radius;
+flat in vec4 brush_color;
+
+out vec4 frag_color;
+
+uniform vec2 tile_origin;
+uniform bool antialias;
+
+// A pixel is painted when it lies within radius + 0.5 of the segment, like
+// the band of stroke_segment; the caps are true circles instead of the
+// midpoint table, so dabs can differ from the CPU ones by a pixel
+void main() {
+	vec2 p = floor(gl_FragCoord.xy) + tile_origin;
+	vec2 a = brush_segment.xy, d = brush_segment.zw - a;
+	float len2 = dot(d, d);
+	float t = len2 > 0.0 ? clamp(dot(p - a, d)/len2, 0.0, 1.0) : 0.0;
+	float coverage = brush_radius + 0.5 - length(p - (a + t*d));
+	if (coverage < 0.0) discard;
+	frag_color = brush_color;
+	if (antialias) frag_color.a *= min(coverage, 1.0);
+}
@@ -0,0 +1,26 @@
+#version 330 core
+
+// One instance per stroke segment, drawn as the quad around its capsule in
+// the coordinates of the tile currently bound as render target
+
+layout (location = 0) in vec4 segment; // a.xy, b.xy in canvas pixels
+layout (location = 1) in float radius;
+layout (location = 2) in vec4 color;
+
+flat out vec4 brush_segment;
+flat out float brush_radius;
+flat out vec4 brush_color;
+
+uniform vec2 tile_origin;
+uniform float tile_size;
+
+void main() {
+	vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1);
+	vec2 lo = min(segment.xy, segment.zw) - radius - 1.0;
+	vec2 hi = max(segment.xy, segment.zw) + radius + 2.0;
+	vec2 pixel = mix(lo, hi, corner);
+	gl_Position = vec4((pixel - tile_origin)/tile_size*2.0 - 1.0, 0.0, 1.0);
+	brush_segment = segment;
+	brush_radius = radius;
+	brush_color = color;
+}
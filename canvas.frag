@@ -0,0 +1,33 @@
+#version 330 core
+
+in vec2 tex_coord;
+
+out vec4 frag_color;
+
+uniform sampler2DArray canvas;
+uniform isampler2D canvas_pages;
+uniform vec2 canvas_size;
+uniform float tile_size;
+
+// The canvas is stored as one array layer per painted tile; the page table
+// gives the layer of every tile, or -1 if it was never painted
+vec4 sample_canvas(vec2 uv) {
+	vec2 p = uv * canvas_size;
+	ivec2 pages = textureSize(canvas_pages, 0);
+	ivec2 tile = clamp(ivec2(p / tile_size), ivec2(0), pages - 1);
+	int layer = texelFetch(canvas_pages, tile, 0).r;
+	if (layer < 0) return vec4(0.0);
+	vec2 local = (p - vec2(tile) * tile_size) / tile_size;
+	return textureGrad(canvas, vec3(local, layer), dFdx(p) / tile_size, dFdy(p) / tile_size);
+}
+
+void main() {
+	vec2 pos = vec2(gl_FragCoord.xy/8); // 8
+	float dis = int(pos.x) % 2 - int(pos.y) % 2;
+	float c = 0.15 * (1 + dis) * (1 - dis);
+	c += 0.8;
+	vec4 pattern = vec4(c, c, c, 1.0);
+	vec4 canvas_color = sample_canvas(tex_coord);
+	// premultiplied, like the tiles
+	frag_color = pattern * (1.0 - canvas_color.a) + canvas_color;
+}
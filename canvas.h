@@ -0,0 +1,1369 @@
+#ifndef CANVAS_H
+#define CANVAS_H
+
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <climits>
+#include <list>
+#include <unordered_map>
+#include <cstring>
+#include <cmath>
+#include "composite.h"
+#include "pool.h"
+#include "resample.h"
+#include "rle.h"
+
+// Canvas, raster and history engine. Nothing in here touches GL or GLFW, so
+// it can be driven headless (see bench.cpp); main.cpp owns the texture and
+// pushes canvas.dirty to it.
+//
+// Pixels live in TILE_SIZE square tiles that are only allocated the first
+// time something is written to them; a tile that was never painted (or was
+// cleared) has no storage and reads as transparent, so memory follows the
+// painted area instead of the canvas size.
+//
+// The image is a stack of layers, each with its own tiles, opacity and blend
+// mode. Painting, fills and history only touch the active layer; the tiles
+// main.cpp uploads are the flattened stack, recomposited per dirty tile.
+// Pixels are premultiplied RGBA8 everywhere.
+
+#define MAX_BRUSH_R 400
+
+#define TILE_SIZE 64
+#define HISTORY_BUDGET_MB 64
+#define HISTORY_CACHE_TILES 256 // decoded snapshots kept around for undo/redo
+
+union Vec2 {
+	struct { float x, y; };
+	struct { float width, height; };
+};
+
+union Vec2i {
+	struct { int x, y; };
+	struct { int width, height; };
+};
+
+union Vec3 {
+	struct { float x, y, z; };
+	struct { float r, g, b; };
+	struct { float h, s, v; };
+};
+
+struct Vec4uc {
+	unsigned char r, g, b, a;
+};
+
+#include "color.h"
+
+// Damage rectangle in canvas pixels, inclusive; empty while max < min
+struct Rect {
+	Vec2i min, max;
+};
+
+bool stroke_antialias = false;
+bool linear_blending = false; // antialiased edges blend in linear light
+
+struct Tile {
+	Vec4uc colors[TILE_SIZE * TILE_SIZE];
+};
+
+// A tile as committed to history. It starts out as a raw copy, which the
+// history worker packs with RLE in the background and then drops; reads
+// decode the packed form on demand (see read_snapshot). Tiles of an opened
+// document start out packed, pointing into the mapped file.
+struct TileSnapshot {
+	std::mutex lock; // held while the raw copy is read or dropped
+	std::unique_ptr<Tile> raw;
+	std::shared_ptr<const uint32_t> packed; // immutable once raw is gone
+	uint32_t words;
+	std::atomic<uint32_t> bytes;  // whichever of the two is held
+};
+
+// Snapshots never change once taken and are shared between history entries;
+// a null reference stands for a fully transparent tile
+typedef std::shared_ptr<TileSnapshot> TileRef;
+
+struct TileChange {
+	int layer, index;
+	TileRef before, after;
+};
+
+struct HistoryEntry {
+	std::vector<TileChange> changes;
+};
+
+struct CanvasHistory {
+	std::vector<HistoryEntry> entries;
+	int cursor; // entries below the cursor are applied, the rest can be redone
+	size_t bytes, budget; // bytes as stored, so packed snapshots count packed
+	std::vector<unsigned char> touched; // tiles of the active layer
+	std::vector<int> touched_list;
+	Vec2i coords[3];
+};
+
+struct Layer {
+	std::vector<Tile *> tiles;      // row major, null while transparent
+	std::vector<TileRef> committed; // state of every tile at the last commit
+	std::vector<unsigned char> unloaded; // only in committed yet, see load_tile
+	size_t resident;
+	int opacity;                    // 0..255
+	int blend;
+	bool visible;
+};
+
+struct Canvas {
+	Vec2i size;
+	float scale;
+	Vec2i tiles_count;
+	std::vector<Layer> layers;  // bottom first
+	int layer;                  // the active one
+	std::vector<Tile *> tiles;  // flattened image, null while transparent
+	size_t resident;
+	// The layers under the active one flattened, per tile, so recompositing
+	// while painting doesn't walk them again; invalid until first needed
+	std::vector<Tile *> below;
+	std::vector<unsigned char> below_valid;
+	size_t below_resident;
+	unsigned int texture;
+	Rect dirty;
+
+	CanvasHistory history;
+};
+
+Canvas canvas = {
+	.size = { 512, 512 },
+	.scale = 1.0,
+	.dirty = { { 0, 0 }, { -1, -1 } },
+	.history = { .cursor = 0, .bytes = 0, .budget = (size_t)HISTORY_BUDGET_MB << 20 }
+};
+
+struct StrokeSegment {
+	Vec2i a, b;
+	int radius;
+	uint32_t color;
+};
+
+// Segments queued by the callbacks and drained once per frame
+struct InputQueue {
+	std::vector<StrokeSegment> segments;
+	unsigned long events, frames;
+	double raster_time, report_time;
+	bool reporting; // print the counts once a second, see report_input_stats
+};
+
+InputQueue input = {};
+
+// A backend that paints somewhere else than the tiles (the GPU brush in
+// main.cpp) takes the queued segments in raster_hook, and brings the tiles
+// back up to date in sync_hook, which runs before anything reads them
+void (*raster_hook)(std::vector<StrokeSegment> &segments) = NULL;
+void (*sync_hook)() = NULL;
+
+// Changes to the document as they are applied, for the operation log
+// (oplog.h). Strokes are reported when they are drained, with the flags
+// they are drawn with; undo and redo as the tiles they restored.
+enum CanvasOpType {
+	OP_SEGMENT,      // v: a.x, a.y, b.x, b.y, radius
+	OP_FILL,         // v: row, column
+	OP_CLEAR,        // flags: OP_RESET
+	OP_COMMIT,
+	OP_TILE,         // v: layer, index; the tile, null if transparent
+	OP_ADD_LAYER,
+	OP_SELECT_LAYER, // v: layer
+	OP_LAYER,        // v: layer, opacity, blend, visible
+	OP_TYPES
+};
+
+#define OP_ANTIALIAS 1
+#define OP_LINEAR 2
+#define OP_RESET 4
+
+struct CanvasOp {
+	int type, flags;
+	int v[5];
+	uint32_t color;
+	TileRef tile;
+};
+
+void (*op_hook)(const CanvasOp &op) = NULL;
+
+void sync_canvas() {
+	if (sync_hook) sync_hook();
+}
+
+double now_seconds() {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Bookkeeping of one job of parallel_raster. Jobs own disjoint tiles, but
+// the dirty rect, the touched list and the resident counts are shared, so
+// each job keeps its own and they are merged once all of them are done.
+struct RasterJob {
+	Rect dirty;
+	std::vector<int> touched;
+	std::vector<std::pair<size_t *, int>> counts;
+};
+
+thread_local RasterJob *raster_job = nullptr;
+
+void mark_dirty(int row, int column) {
+	Rect &d = raster_job ? raster_job->dirty : canvas.dirty;
+	if (d.max.x < d.min.x) {
+		d = { { column, row }, { column, row } };
+		return;
+	}
+	if (column < d.min.x) d.min.x = column;
+	if (column > d.max.x) d.max.x = column;
+	if (row < d.min.y) d.min.y = row;
+	if (row > d.max.y) d.max.y = row;
+}
+
+void mark_canvas_dirty() {
+	canvas.dirty = { { 0, 0 }, { canvas.size.width - 1, canvas.size.height - 1 } };
+}
+
+void touch_tile(int row, int column) {
+	CanvasHistory &h = canvas.history;
+	int index = (row / TILE_SIZE)*canvas.tiles_count.x + column / TILE_SIZE;
+	if (!h.touched[index]) {
+		h.touched[index] = 1;
+		(raster_job ? raster_job->touched : h.touched_list).push_back(index);
+	}
+}
+
+void touch_tiles(Rect r) {
+	for (int ty = r.min.y / TILE_SIZE; ty <= r.max.y / TILE_SIZE; ty++) {
+		for (int tx = r.min.x / TILE_SIZE; tx <= r.max.x / TILE_SIZE; tx++) {
+			touch_tile(ty * TILE_SIZE, tx * TILE_SIZE);
+		}
+	}
+}
+
+Rect tile_rect(int index) {
+	int tx = index % canvas.tiles_count.x;
+	int ty = index / canvas.tiles_count.x;
+	Rect r = { { tx * TILE_SIZE, ty * TILE_SIZE }, { (tx + 1) * TILE_SIZE - 1, (ty + 1) * TILE_SIZE - 1 } };
+	if (r.max.x >= canvas.size.width) r.max.x = canvas.size.width - 1;
+	if (r.max.y >= canvas.size.height) r.max.y = canvas.size.height - 1;
+	return r;
+}
+
+void count_tiles(size_t *resident, int delta) {
+	if (raster_job) raster_job->counts.push_back({ resident, delta });
+	else *resident += delta;
+}
+
+Tile *allocate_tile(Tile *&tile, size_t *resident) {
+	if (!tile) {
+		tile = new Tile();
+		count_tiles(resident, 1);
+	}
+	return tile;
+}
+
+void release_tile(Tile *&tile, size_t *resident) {
+	if (!tile) return;
+	delete tile;
+	tile = nullptr;
+	count_tiles(resident, -1);
+}
+
+// Runs job(i) for every i in [0, count) on the pool. Jobs must write
+// disjoint tiles; their bookkeeping is merged in index order, so the result
+// doesn't depend on how they were scheduled.
+void parallel_raster(int count, const std::function<void(int)> &job) {
+	std::vector<RasterJob> jobs(count, { { { 0, 0 }, { -1, -1 } }, {}, {} });
+	parallel_for(count, [&](int i) {
+		raster_job = &jobs[i];
+		job(i);
+		raster_job = nullptr;
+	});
+	for (RasterJob &j : jobs) {
+		if (j.dirty.max.x >= j.dirty.min.x) {
+			mark_dirty(j.dirty.min.y, j.dirty.min.x);
+			mark_dirty(j.dirty.max.y, j.dirty.max.x);
+		}
+		canvas.history.touched_list.insert(canvas.history.touched_list.end(), j.touched.begin(), j.touched.end());
+		for (std::pair<size_t *, int> &c : j.counts) *c.first += c.second;
+	}
+}
+
+// Packs the snapshots of new history entries on a thread of its own, so
+// committing a stroke only costs the copy. Decoded snapshots go to a small
+// cache, most recently used first, as undo and redo tend to go back and forth.
+struct HistoryWorker {
+	std::thread thread;
+	std::mutex lock;
+	std::condition_variable wake, idle;
+	std::deque<TileRef> queue;
+	int busy; // queued or being packed
+	bool stop;
+	std::atomic<unsigned long> packed;
+	std::mutex cache_lock;
+	std::list<std::pair<TileRef, std::unique_ptr<Tile>>> cache;
+	std::unordered_map<const TileSnapshot *, decltype(cache)::iterator> cached;
+	unsigned long hits, misses;
+};
+
+HistoryWorker history_worker = {};
+
+void pack_snapshot(TileSnapshot &snapshot, std::vector<uint32_t> &packed) {
+	PROFILE_SCOPE("pack");
+	rle_encode((const uint32_t *)snapshot.raw->colors, TILE_SIZE*TILE_SIZE, packed);
+	if (packed.size()*sizeof(uint32_t) >= sizeof(Tile)) return; // noise, keep it raw
+	std::unique_ptr<Tile> raw;
+	{
+		std::lock_guard<std::mutex> guard(snapshot.lock);
+		uint32_t *words = new uint32_t[packed.size()];
+		std::copy(packed.begin(), packed.end(), words);
+		snapshot.packed.reset(words, std::default_delete<uint32_t[]>());
+		snapshot.words = packed.size();
+		snapshot.bytes = packed.size()*sizeof(uint32_t);
+		raw = std::move(snapshot.raw);
+	}
+	history_worker.packed++;
+}
+
+void history_worker_run() {
+	PROFILE_THREAD("history");
+	HistoryWorker &w = history_worker;
+	std::vector<uint32_t> packed;
+	while (true) {
+		TileRef snapshot;
+		{
+			std::unique_lock<std::mutex> guard(w.lock);
+			w.wake.wait(guard, [&] { return w.stop || !w.queue.empty(); });
+			if (w.stop) return;
+			snapshot = std::move(w.queue.front());
+			w.queue.pop_front();
+		}
+		// only the queue still holds it when its step was already dropped
+		if (snapshot.use_count() > 1) pack_snapshot(*snapshot, packed);
+		std::lock_guard<std::mutex> guard(w.lock);
+		if (--w.busy == 0) w.idle.notify_all();
+	}
+}
+
+// Waits until every queued snapshot is packed
+void history_worker_wait() {
+	HistoryWorker &w = history_worker;
+	std::unique_lock<std::mutex> guard(w.lock);
+	w.idle.wait(guard, [&] { return w.busy == 0; });
+}
+
+void history_worker_stop() {
+	HistoryWorker &w = history_worker;
+	{
+		std::lock_guard<std::mutex> guard(w.lock);
+		w.stop = true;
+	}
+	w.wake.notify_all();
+	if (w.thread.joinable()) w.thread.join();
+	w.queue.clear();
+	w.busy = 0;
+	w.stop = false;
+}
+
+void queue_snapshots(const std::vector<TileChange> &changes) {
+	HistoryWorker &w = history_worker;
+	{
+		std::lock_guard<std::mutex> guard(w.lock);
+		if (!w.thread.joinable()) w.thread = std::thread(history_worker_run);
+		for (const TileChange &change : changes) {
+			if (!change.after) continue;
+			w.queue.push_back(change.after);
+			w.busy++;
+		}
+	}
+	w.wake.notify_one();
+}
+
+// Copies a snapshot out, bypassing the cache; false if the packed words
+// were corrupt (they can come from a file)
+bool decode_snapshot(TileSnapshot &snapshot, Tile *dst) {
+	{
+		std::lock_guard<std::mutex> guard(snapshot.lock);
+		if (snapshot.raw) {
+			memcpy(dst, snapshot.raw.get(), sizeof(Tile));
+			return true;
+		}
+	}
+	return rle_decode(snapshot.packed.get(), snapshot.words, (uint32_t *)dst->colors, TILE_SIZE*TILE_SIZE);
+}
+
+// Copies a snapshot out for undo or redo; safe to call from raster jobs.
+// False if the packed words were corrupt, and then nothing is cached.
+bool read_snapshot(const TileRef &snapshot, Tile *dst) {
+	HistoryWorker &w = history_worker;
+	{
+		std::lock_guard<std::mutex> guard(snapshot->lock);
+		if (snapshot->raw) {
+			memcpy(dst, snapshot->raw.get(), sizeof(Tile));
+			return true;
+		}
+	}
+	std::unique_ptr<Tile> spare;
+	{
+		std::lock_guard<std::mutex> guard(w.cache_lock);
+		auto found = w.cached.find(snapshot.get());
+		if (found != w.cached.end()) {
+			w.cache.splice(w.cache.begin(), w.cache, found->second);
+			memcpy(dst, w.cache.front().second.get(), sizeof(Tile));
+			w.hits++;
+			return true;
+		}
+		w.misses++;
+		if (w.cache.size() >= HISTORY_CACHE_TILES) {
+			w.cached.erase(w.cache.back().first.get());
+			spare = std::move(w.cache.back().second);
+			w.cache.pop_back();
+		}
+	}
+	if (!rle_decode(snapshot->packed.get(), snapshot->words, (uint32_t *)dst->colors, TILE_SIZE*TILE_SIZE)) return false;
+	if (!spare) spare.reset(new Tile);
+	memcpy(spare.get(), dst, sizeof(Tile));
+	std::lock_guard<std::mutex> guard(w.cache_lock);
+	if (w.cached.count(snapshot.get())) return true; // another job decoded it meanwhile
+	w.cache.emplace_front(snapshot, std::move(spare));
+	w.cached[snapshot.get()] = w.cache.begin();
+	return true;
+}
+
+void clear_snapshot_cache() {
+	HistoryWorker &w = history_worker;
+	std::lock_guard<std::mutex> guard(w.cache_lock);
+	w.cached.clear();
+	w.cache.clear();
+}
+
+Layer &active_layer() {
+	return canvas.layers[canvas.layer];
+}
+
+// An opened document only fills in committed; its tiles are decoded the
+// first time something draws, composites or reads them. A corrupt one
+// becomes empty, in committed too, so a save doesn't carry it over.
+void load_tile(Layer &layer, int index) {
+	if (!layer.unloaded[index]) return;
+	layer.unloaded[index] = 0;
+	if (!decode_snapshot(*layer.committed[index], allocate_tile(layer.tiles[index], &layer.resident))) {
+		release_tile(layer.tiles[index], &layer.resident);
+		layer.committed[index] = nullptr;
+	}
+}
+
+void load_tiles(int index) {
+	for (Layer &layer : canvas.layers) load_tile(layer, index);
+}
+
+void load_layer(Layer &layer) {
+	parallel_raster(layer.tiles.size(), [&](int i) { load_tile(layer, i); });
+}
+
+// Tile of the active layer, allocated on first write
+Tile *canvas_tile(int index) {
+	Layer &layer = active_layer();
+	load_tile(layer, index);
+	return allocate_tile(layer.tiles[index], &layer.resident);
+}
+
+void free_canvas_tile(int index) {
+	Layer &layer = active_layer();
+	layer.unloaded[index] = 0;
+	release_tile(layer.tiles[index], &layer.resident);
+}
+
+// Tile of the flattened image
+Tile *flat_tile(int index) {
+	return allocate_tile(canvas.tiles[index], &canvas.resident);
+}
+
+void invalidate_below(int index) {
+	canvas.below_valid[index] = 0;
+	release_tile(canvas.below[index], &canvas.below_resident);
+}
+
+void invalidate_below_all() {
+	for (size_t i = 0; i < canvas.below.size(); i++) invalidate_below(i);
+}
+
+size_t layer_tiles_resident() {
+	size_t total = 0;
+	for (Layer &layer : canvas.layers) total += layer.resident;
+	return total;
+}
+
+// Address of a pixel, allocating its tile; the caller clips to the canvas
+Vec4uc *canvas_pixel(int row, int column) {
+	Tile *tile = canvas_tile((row / TILE_SIZE)*canvas.tiles_count.x + column / TILE_SIZE);
+	return tile->colors + (row % TILE_SIZE)*TILE_SIZE + column % TILE_SIZE;
+}
+
+uint32_t read_pixel(int row, int column) {
+	int index = (row / TILE_SIZE)*canvas.tiles_count.x + column / TILE_SIZE;
+	load_tile(active_layer(), index);
+	Tile *tile = active_layer().tiles[index];
+	if (!tile) return 0;
+	uint32_t pixel;
+	memcpy(&pixel, tile->colors + (row % TILE_SIZE)*TILE_SIZE + column % TILE_SIZE, sizeof(pixel));
+	return pixel;
+}
+
+bool tile_is_empty(const Tile *tile) {
+	const uint32_t *p = (const uint32_t *)tile->colors;
+	for (int i = 0; i < TILE_SIZE*TILE_SIZE; i++) {
+		if (p[i]) return false;
+	}
+	return true;
+}
+
+// Copies a tile out of the canvas; transparent tiles aren't stored at all.
+// A resident tile that was painted back to transparent is released here.
+TileRef snapshot_tile(int index) {
+	Tile *tile = active_layer().tiles[index];
+	if (!tile) return nullptr;
+	if (tile_is_empty(tile)) {
+		free_canvas_tile(index);
+		return nullptr;
+	}
+	TileRef snapshot = std::make_shared<TileSnapshot>();
+	snapshot->raw.reset(new Tile(*tile));
+	snapshot->bytes = sizeof(Tile);
+	return snapshot;
+}
+
+bool same_tile(const TileRef &snapshot, const Tile *tile) {
+	Tile decoded;
+	return decode_snapshot(*snapshot, &decoded) && memcmp(&decoded, tile, sizeof(Tile)) == 0;
+}
+
+void restore_tile(int layer, int index, const TileRef &tile) {
+	Rect r = tile_rect(index);
+	Layer &l = canvas.layers[layer];
+	l.unloaded[index] = 0;
+	bool read = tile && read_snapshot(tile, allocate_tile(l.tiles[index], &l.resident));
+	if (!read) release_tile(l.tiles[index], &l.resident);
+	l.committed[index] = read ? tile : nullptr;
+	if (layer < canvas.layer) invalidate_below(index);
+	mark_dirty(r.min.y, r.min.x);
+	mark_dirty(r.max.y, r.max.x);
+}
+
+void free_canvas_tiles() {
+	for (Layer &layer : canvas.layers) {
+		for (Tile *&tile : layer.tiles) release_tile(tile, &layer.resident);
+	}
+	for (Tile *&tile : canvas.tiles) release_tile(tile, &canvas.resident);
+	invalidate_below_all();
+}
+
+void reset_history() {
+	CanvasHistory &h = canvas.history;
+	size_t count = canvas.tiles.size();
+	h.entries.clear();
+	h.cursor = 0;
+	h.bytes = 0;
+	for (Layer &layer : canvas.layers) {
+		layer.committed.assign(count, nullptr);
+		layer.unloaded.assign(count, 0);
+	}
+	clear_snapshot_cache();
+	h.touched.assign(count, 0);
+	h.touched_list.clear();
+}
+
+// Memory of one step as stored; raw adds up what it would take unpacked
+size_t entry_bytes(const HistoryEntry &entry, size_t *raw) {
+	size_t bytes = 0;
+	for (const TileChange &change : entry.changes) {
+		bytes += sizeof(TileChange) + (change.after ? change.after->bytes.load() : 0);
+		if (raw) *raw += sizeof(TileChange) + (change.after ? sizeof(Tile) : 0);
+	}
+	return bytes;
+}
+
+// Turns the tiles touched since the last commit into one undo step. Only
+// those tiles are copied; the rest of the canvas stays shared with the
+// previous state. The copies are packed later by the history worker, and
+// old steps are dropped once the memory budget is exceeded. Returns whether
+// a step was added.
+bool commit_history() {
+	CanvasHistory &h = canvas.history;
+	if (h.touched_list.empty()) return false;
+	PROFILE_SCOPE("commit");
+	sync_canvas();
+
+	// Copying the tiles is the expensive part and each one is independent
+	Layer &layer = active_layer();
+	std::vector<TileRef> snapshots(h.touched_list.size());
+	std::vector<unsigned char> unchanged(snapshots.size());
+	parallel_raster(snapshots.size(), [&](int i) {
+		int index = h.touched_list[i];
+		snapshots[i] = snapshot_tile(index);
+		const TileRef &before = layer.committed[index];
+		unchanged[i] = before ? snapshots[i] && same_tile(before, snapshots[i]->raw.get()) : !snapshots[i];
+	});
+
+	HistoryEntry entry;
+	for (size_t i = 0; i < h.touched_list.size(); i++) {
+		int index = h.touched_list[i];
+		h.touched[index] = 0;
+		if (unchanged[i]) continue;
+		entry.changes.push_back({ canvas.layer, index, layer.committed[index], snapshots[i] });
+		layer.committed[index] = snapshots[i];
+	}
+	h.touched_list.clear();
+	if (entry.changes.empty()) return false;
+	queue_snapshots(entry.changes);
+	if (op_hook) op_hook({ OP_COMMIT });
+
+	h.entries.resize(h.cursor);
+	h.entries.push_back(std::move(entry));
+	h.cursor++;
+	// packing shrinks the steps behind our back, so they are recounted
+	h.bytes = 0;
+	for (HistoryEntry &e : h.entries) h.bytes += entry_bytes(e, nullptr);
+	while (h.bytes > h.budget && h.entries.size() > 1) {
+		h.bytes -= entry_bytes(h.entries.front(), nullptr);
+		h.entries.erase(h.entries.begin());
+		h.cursor--;
+	}
+	return true;
+}
+
+// Writes a clipped horizontal run of a prepacked color, one store per tile
+void fill_row(int row, int x0, int x1, uint32_t color) {
+	if (row < 0 || row >= canvas.size.height) return;
+	if (x0 < 0) x0 = 0;
+	if (x1 >= canvas.size.width) x1 = canvas.size.width - 1;
+	if (x0 > x1) return;
+	int first = (row / TILE_SIZE)*canvas.tiles_count.x;
+	for (int x = x0; x <= x1;) {
+		int end = std::min(x1, (x / TILE_SIZE + 1)*TILE_SIZE - 1);
+		uint32_t *line = (uint32_t *)canvas_tile(first + x / TILE_SIZE)->colors + (row % TILE_SIZE)*TILE_SIZE;
+		std::fill(line + x % TILE_SIZE, line + end % TILE_SIZE + 1, color);
+		x = end + 1;
+	}
+	mark_dirty(row, x0);
+	mark_dirty(row, x1);
+	touch_tiles({ { x0, row }, { x1, row } });
+}
+
+std::vector<int> brush_spans[MAX_BRUSH_R + 1];
+
+// Half width of every row of the midpoint circle of radius r, indexed by
+// the distance to the center row. Built the first time a radius is used.
+const std::vector<int> &brush_span_table(int r) {
+	std::vector<int> &half = brush_spans[r];
+	if (!half.empty()) return half;
+
+	half.assign(r + 1, 0);
+	int pk = 1 - r;
+	Vec2i point = { 0, r };
+	while (true) {
+		if (point.x > half[point.y]) half[point.y] = point.x;
+		if (point.y > half[point.x]) half[point.x] = point.y;
+		if (point.x >= point.y) break;
+		point.x++;
+		if (pk < 0) {
+			pk = pk + 2*point.x + 1;
+		} else {
+			point.y--;
+			pk = pk + 2*point.x + 1 - 2*point.y;
+		}
+	}
+	for (int d = r - 1; d >= 0; d--) {
+		if (half[d + 1] > half[d]) half[d] = half[d + 1];
+	}
+	return half;
+}
+
+Layer new_layer() {
+	Layer layer = {};
+	layer.tiles.assign(canvas.tiles.size(), nullptr);
+	layer.committed.assign(canvas.tiles.size(), nullptr);
+	layer.unloaded.assign(canvas.tiles.size(), 0);
+	layer.opacity = 255;
+	layer.blend = BLEND_NORMAL;
+	layer.visible = true;
+	return layer;
+}
+
+// Releases every tile, so the cost follows the painted area. Without reset
+// only the active layer is cleared, as one undo step; a reset starts a new
+// document with a single layer.
+void clear_canvas(bool reset) {
+	sync_canvas();
+	if (op_hook) op_hook({ OP_CLEAR, reset ? OP_RESET : 0 });
+	if (!reset) {
+		Layer &layer = active_layer();
+		for (size_t i = 0; i < layer.tiles.size(); i++) {
+			if (!layer.tiles[i] && !layer.committed[i]) continue;
+			Rect r = tile_rect(i);
+			touch_tile(r.min.y, r.min.x);
+		}
+		for (size_t i = 0; i < layer.tiles.size(); i++) free_canvas_tile(i);
+		commit_history();
+	} else {
+		free_canvas_tiles();
+		canvas.layers.assign(1, new_layer());
+		canvas.layer = 0;
+		reset_history();
+		canvas.history.coords[0] = { -1, -1 };
+		canvas.history.coords[1] = { -1, -1 };
+		canvas.history.coords[2] = { -1, -1 };
+	}
+
+	mark_canvas_dirty();
+}
+
+int clamp(int value, int minimum, int maximum) {
+	if (value < minimum) return minimum;
+	if (value > maximum) return maximum;
+	return value;
+}
+
+// Narrows [lo, hi] to the x for which minimum <= k*x + c <= maximum
+void clip_linear(float k, float c, float minimum, float maximum, float *lo, float *hi) {
+	if (k == 0) {
+		if (c < minimum || c > maximum) *lo = INFINITY;
+		return;
+	}
+	float x0 = (minimum - c)/k, x1 = (maximum - c)/k;
+	if (x0 > x1) std::swap(x0, x1);
+	if (x0 > *lo) *lo = x0;
+	if (x1 < *hi) *hi = x1;
+}
+
+// Extent of row y inside the band swept by a disc of the given radius
+// moving from a to b, round caps excluded
+bool band_row(Vec2i a, Vec2i b, int y, float radius, float *lo, float *hi) {
+	float dx = b.x - a.x, dy = b.y - a.y;
+	float len = sqrtf(dx*dx + dy*dy);
+	*lo = -INFINITY;
+	*hi = INFINITY;
+	if (len == 0) return false;
+	clip_linear(-dy, dx*(y - a.y) + dy*a.x, -radius*len, radius*len, lo, hi);
+	clip_linear(dx, dy*(y - a.y) - dx*a.x, 0, len*len, lo, hi);
+	return *lo <= *hi;
+}
+
+// Same as band_row with both round caps, for the antialiased path
+bool capsule_row(Vec2i a, Vec2i b, int y, float radius, float *lo, float *hi) {
+	bool hit = band_row(a, b, y, radius, lo, hi);
+	if (!hit) {
+		*lo = INFINITY;
+		*hi = -INFINITY;
+	}
+	Vec2i caps[2] = { a, b };
+	for (Vec2i c : caps) {
+		float w2 = radius*radius - (y - c.y)*(y - c.y);
+		if (w2 < 0) continue;
+		float w = sqrtf(w2);
+		if (c.x - w < *lo) *lo = c.x - w;
+		if (c.x + w > *hi) *hi = c.x + w;
+		hit = true;
+	}
+	return hit;
+}
+
+float distance_to_segment(Vec2i a, Vec2i b, float x, float y) {
+	float dx = b.x - a.x, dy = b.y - a.y;
+	float len2 = dx*dx + dy*dy;
+	float t = len2 > 0 ? ((x - a.x)*dx + (y - a.y)*dy)/len2 : 0;
+	if (t < 0) t = 0;
+	if (t > 1) t = 1;
+	float ex = x - (a.x + t*dx), ey = y - (a.y + t*dy);
+	return sqrtf(ex*ex + ey*ey);
+}
+
+// Source-over of an opaque color at partial coverage, premultiplied
+void blend_pixel(Vec4uc *dst, Vec4uc color, float coverage) {
+	float k = 1 - coverage;
+	*dst = {
+		(unsigned char)(color.r*coverage + dst->r*k + 0.5f),
+		(unsigned char)(color.g*coverage + dst->g*k + 0.5f),
+		(unsigned char)(color.b*coverage + dst->b*k + 0.5f),
+		(unsigned char)(255*coverage + dst->a*k + 0.5f)
+	};
+}
+
+// Blends an opaque color at per-pixel coverage into a run of at most
+// TILE_SIZE pixels, in linear light when linear_blending is set
+void blend_span(uint32_t *dst, const float *coverage, int n, uint32_t color) {
+	if (!linear_blending) {
+		Vec4uc c;
+		memcpy(&c, &color, sizeof(c));
+		for (int i = 0; i < n; i++) blend_pixel((Vec4uc *)(dst + i), c, coverage[i]);
+		return;
+	}
+	float source[4], pixels[TILE_SIZE * 4];
+	decode_span(&color, source, 1);
+	decode_span(dst, pixels, n);
+	for (int i = 0; i < n; i++) {
+		for (int c = 0; c < 4; c++) {
+			float &p = pixels[4*i + c];
+			p = source[c]*coverage[i] + p*(1 - coverage[i]);
+		}
+	}
+	encode_span(pixels, dst, n);
+}
+
+// Blends the antialiased edge pixels x0..x1 of row y a tile at a time,
+// leaving out the ones at either end the capsule doesn't reach
+void blend_edge(Vec2i a, Vec2i b, int y, int radius, int x0, int x1, uint32_t color) {
+	float coverage[TILE_SIZE];
+	for (int x = x0; x <= x1;) {
+		int end = std::min(x1, (x / TILE_SIZE + 1)*TILE_SIZE - 1);
+		int first = -1, last = -1;
+		for (int i = x; i <= end; i++) {
+			float c = radius + 0.5f - distance_to_segment(a, b, i, y);
+			coverage[i - x] = c < 0 ? 0 : c > 1 ? 1 : c;
+			if (c <= 0) continue;
+			if (first < 0) first = i;
+			last = i;
+		}
+		if (first >= 0) {
+			blend_span((uint32_t *)canvas_pixel(y, first), coverage + first - x, last - first + 1, color);
+		}
+		x = end + 1;
+	}
+}
+
+void stroke_segment_aa(Vec2i a, Vec2i b, int y, int radius, uint32_t color) {
+	float lo, hi;
+	if (!capsule_row(a, b, y, radius + 0.5f, &lo, &hi)) return;
+	int x0 = clamp((int)ceilf(lo), 0, canvas.size.width);
+	int x1 = clamp((int)floorf(hi), -1, canvas.size.width - 1);
+	if (x0 > x1) return;
+
+	int in0 = x1 + 1, in1 = x1;
+	if (radius > 0 && capsule_row(a, b, y, radius - 0.5f, &lo, &hi)) {
+		in0 = clamp((int)ceilf(lo), x0, x1 + 1);
+		in1 = clamp((int)floorf(hi), in0 - 1, x1);
+	}
+	fill_row(y, in0, in1, color);
+	blend_edge(a, b, y, radius, x0, in0 - 1, color);
+	blend_edge(a, b, y, radius, in1 + 1, x1, color);
+	mark_dirty(y, x0);
+	mark_dirty(y, x1);
+	touch_tiles({ { x0, y }, { x1, y } });
+}
+
+// Rasterizes the capsule covering a dab moved from a to b as one span per
+// row, so every pixel of the segment is written once whatever its angle.
+// The round caps come from the cached dab table to keep the brush shape.
+// Only rows top..bottom are drawn.
+void stroke_segment_rows(Vec2i a, Vec2i b, int radius, uint32_t color, int top, int bottom) {
+	int y0 = (a.y < b.y ? a.y : b.y) - radius - 1;
+	int y1 = (a.y > b.y ? a.y : b.y) + radius + 1;
+	y0 = clamp(std::max(y0, top), 0, canvas.size.height);
+	y1 = clamp(std::min(y1, bottom), -1, canvas.size.height - 1);
+
+	const std::vector<int> &half = brush_span_table(radius);
+	for (int y = y0; y <= y1; y++) {
+		if (stroke_antialias) {
+			stroke_segment_aa(a, b, y, radius, color);
+			continue;
+		}
+		float lo, hi;
+		int x0 = INT_MAX, x1 = INT_MIN;
+		if (band_row(a, b, y, radius + 0.5f, &lo, &hi)) {
+			x0 = ceilf(lo);
+			x1 = floorf(hi);
+		}
+		Vec2i caps[2] = { a, b };
+		for (Vec2i c : caps) {
+			int d = abs(y - c.y);
+			if (d > radius) continue;
+			if (c.x - half[d] < x0) x0 = c.x - half[d];
+			if (c.x + half[d] > x1) x1 = c.x + half[d];
+		}
+		if (x0 <= x1) fill_row(y, x0, x1, color);
+	}
+}
+
+void stroke_segment(Vec2i a, Vec2i b, int radius, uint32_t color) {
+	stroke_segment_rows(a, b, radius, color, INT_MIN, INT_MAX);
+}
+
+// Draws the segments in queue order, in bands of one tile row that run in
+// parallel. A row only depends on the segments crossing it, taken in order,
+// so the result is the same as drawing them one after another.
+void raster_segments(const std::vector<StrokeSegment> &segments) {
+	int y0 = INT_MAX, y1 = INT_MIN;
+	for (const StrokeSegment &s : segments) {
+		brush_span_table(s.radius); // built here, the bands only read it
+		y0 = std::min(y0, std::min(s.a.y, s.b.y) - s.radius - 1);
+		y1 = std::max(y1, std::max(s.a.y, s.b.y) + s.radius + 1);
+	}
+	y0 = std::max(y0, 0);
+	y1 = std::min(y1, canvas.size.height - 1);
+	if (y0 > y1) return;
+	int first = y0 / TILE_SIZE;
+	parallel_raster(y1 / TILE_SIZE - first + 1, [&](int band) {
+		int top = (first + band)*TILE_SIZE;
+		for (const StrokeSegment &s : segments) {
+			stroke_segment_rows(s.a, s.b, s.radius, s.color, top, top + TILE_SIZE - 1);
+		}
+	});
+}
+
+void flush_strokes() {
+	if (input.segments.empty()) return;
+	PROFILE_SCOPE("raster");
+	if (op_hook) {
+		int flags = (stroke_antialias ? OP_ANTIALIAS : 0) | (linear_blending ? OP_LINEAR : 0);
+		for (StrokeSegment &s : input.segments) op_hook({ OP_SEGMENT, flags, { s.a.x, s.a.y, s.b.x, s.b.y, s.radius }, s.color });
+	}
+	double start = now_seconds();
+	if (raster_hook) {
+		raster_hook(input.segments);
+	} else {
+		raster_segments(input.segments);
+	}
+	input.segments.clear();
+	input.raster_time += now_seconds() - start;
+}
+
+void undo() {
+	PROFILE_SCOPE("undo");
+	CanvasHistory &h = canvas.history;
+	flush_strokes();
+	commit_history();
+	if (h.cursor > 0) {
+		h.cursor--;
+		std::vector<TileChange> &changes = h.entries[h.cursor].changes;
+		parallel_raster(changes.size(), [&](int i) { restore_tile(changes[i].layer, changes[i].index, changes[i].before); });
+		if (op_hook) {
+			for (TileChange &c : changes) op_hook({ OP_TILE, 0, { c.layer, c.index }, 0, c.before });
+		}
+	}
+}
+
+void redo() {
+	PROFILE_SCOPE("redo");
+	CanvasHistory &h = canvas.history;
+	flush_strokes();
+	commit_history();
+	if (h.cursor < (int)h.entries.size()) {
+		std::vector<TileChange> &changes = h.entries[h.cursor].changes;
+		parallel_raster(changes.size(), [&](int i) { restore_tile(changes[i].layer, changes[i].index, changes[i].after); });
+		if (op_hook) {
+			for (TileChange &c : changes) op_hook({ OP_TILE, 0, { c.layer, c.index }, 0, c.after });
+		}
+		h.cursor++;
+	}
+}
+
+struct FillSpan {
+	int x0, x1, y, dy;
+};
+
+static_assert(TILE_SIZE == 64, "fill masks keep one 64-bit word per tile row");
+
+// Pixels a fill has taken so far, one bit each and one word per tile row,
+// allocated only for the tiles the fill reaches
+struct FillMask {
+	std::vector<std::unique_ptr<uint64_t[]>> tiles;
+};
+
+uint64_t taken_word(FillMask &mask, int y, int x) {
+	uint64_t *tile = mask.tiles[(y / TILE_SIZE)*canvas.tiles_count.x + x / TILE_SIZE].get();
+	return tile ? tile[y % TILE_SIZE] : 0;
+}
+
+void take_run(FillMask &mask, int y, int x0, int x1) {
+	for (int x = x0; x <= x1;) {
+		int end = std::min(x1, (x / TILE_SIZE + 1)*TILE_SIZE - 1);
+		std::unique_ptr<uint64_t[]> &tile = mask.tiles[(y / TILE_SIZE)*canvas.tiles_count.x + x / TILE_SIZE];
+		if (!tile) tile.reset(new uint64_t[TILE_SIZE]());
+		int from = x % TILE_SIZE, count = end - x + 1;
+		tile[y % TILE_SIZE] |= (count == 64 ? ~0ull : ((1ull << count) - 1)) << from;
+		x = end + 1;
+	}
+}
+
+bool fillable(FillMask &mask, int y, int x, uint32_t target) {
+	return read_pixel(y, x) == target && !(taken_word(mask, y, x) >> (x % TILE_SIZE) & 1);
+}
+
+// First column at or right of x, before limit, that isn't a target pixel
+// the fill hasn't taken yet. A missing tile is a run of transparent pixels.
+int scan_target_run(FillMask &mask, int y, int x, int limit, uint32_t target) {
+	int first = (y / TILE_SIZE)*canvas.tiles_count.x;
+	while (x < limit) {
+		int end = std::min(limit, (x / TILE_SIZE + 1)*TILE_SIZE);
+		int left = (x / TILE_SIZE)*TILE_SIZE;
+		uint64_t taken = taken_word(mask, y, x) >> (x - left);
+		Tile *tile = active_layer().tiles[first + x / TILE_SIZE];
+		if (!tile) {
+			if (target != 0) return x;
+			if (taken && x + __builtin_ctzll(taken) < end) return x + __builtin_ctzll(taken);
+			x = end;
+			continue;
+		}
+		const uint32_t *line = (const uint32_t *)tile->colors + (y % TILE_SIZE)*TILE_SIZE;
+		while (x < end && line[x - left] == target && !(taken & 1)) {
+			x++;
+			taken >>= 1;
+		}
+		if (x < end) return x;
+	}
+	return limit;
+}
+
+// Span-based scanline fill (Smith's combined scan-and-fill). Each span
+// popped from the stack is a range of the row y to look for target pixels
+// in; every run found there is taken and only the parts of the neighbouring
+// rows that can still hold target pixels are pushed back. The runs are only
+// written once the region is known, in bands of one tile row running in
+// parallel. Returns the bounding box of the filled region.
+Rect boundary_fill(int row, int col, uint32_t color) {
+	Rect box = { { 0, 0 }, { -1, -1 } };
+	if (row < 0 || row >= canvas.size.height) return box;
+	if (col < 0 || col >= canvas.size.width) return box;
+
+	PROFILE_SCOPE("fill");
+	sync_canvas();
+	if (op_hook) op_hook({ OP_FILL, 0, { row, col }, color });
+	load_layer(active_layer()); // the fill can reach any tile
+	int width = canvas.size.width;
+	uint32_t target = read_pixel(row, col);
+	if (target == color) return box;
+
+	FillMask mask;
+	mask.tiles.resize(canvas.tiles.size());
+	std::vector<std::vector<FillSpan>> bands(canvas.tiles_count.y);
+	box = { { col, row }, { col, row } };
+	std::vector<FillSpan> stack;
+	stack.push_back({ col, col, row, 1 });
+	stack.push_back({ col, col, row - 1, -1 });
+	while (!stack.empty()) {
+		FillSpan span = stack.back();
+		stack.pop_back();
+		int y = span.y;
+		if (y < 0 || y >= canvas.size.height) continue;
+
+		int x0 = span.x0, x = span.x0;
+		if (fillable(mask, y, x, target)) {
+			while (x > 0 && fillable(mask, y, x - 1, target)) x--;
+			if (x < x0) stack.push_back({ x, x0 - 1, y - span.dy, -span.dy });
+		}
+		while (x0 <= span.x1) {
+			int end = scan_target_run(mask, y, x0, width, target);
+			if (end > x) {
+				take_run(mask, y, x, end - 1);
+				bands[y / TILE_SIZE].push_back({ x, end - 1, y, 0 });
+				if (x < box.min.x) box.min.x = x;
+				if (end - 1 > box.max.x) box.max.x = end - 1;
+				if (y < box.min.y) box.min.y = y;
+				if (y > box.max.y) box.max.y = y;
+				stack.push_back({ x, end - 1, y + span.dy, span.dy });
+				if (end - 1 > span.x1) stack.push_back({ span.x1 + 1, end - 1, y - span.dy, -span.dy });
+			}
+			x0 = end + 1;
+			while (x0 < span.x1 && !fillable(mask, y, x0, target)) x0++;
+			x = x0;
+		}
+	}
+
+	int first = box.min.y / TILE_SIZE;
+	parallel_raster(box.max.y / TILE_SIZE - first + 1, [&](int band) {
+		for (FillSpan &s : bands[first + band]) fill_row(s.y, s.x0, s.x1, color);
+	});
+	return box;
+}
+
+// Pixels lifted off the active layer by a selection, until stamp_selection
+// puts them back down
+struct FloatingPixels {
+	Rect from;                    // where they were lifted from
+	int width, height;
+	std::vector<uint32_t> pixels; // bottom row first
+};
+
+// Where floating pixels go: the canvas point their center lands on, the
+// scale of each axis, negative to flip, and a counterclockwise rotation
+struct SelectionTransform {
+	Vec2 center, scale;
+	float angle;
+};
+
+// The transform that leaves lifted pixels where they came from
+SelectionTransform selection_identity(Rect r) {
+	return { { (r.min.x + r.max.x + 1) / 2.0f, (r.min.y + r.max.y + 1) / 2.0f }, { 1, 1 }, 0 };
+}
+
+// Copies r, clipped to the canvas, off the active layer into f and clears
+// it there, a band of one tile row per job. Transparent tiles are skipped.
+void lift_selection(Rect r, FloatingPixels &f) {
+	PROFILE_SCOPE("lift");
+	sync_canvas();
+	r = { { std::max(r.min.x, 0), std::max(r.min.y, 0) }, { std::min(r.max.x, canvas.size.width - 1), std::min(r.max.y, canvas.size.height - 1) } };
+	f.from = r;
+	f.width = std::max(r.max.x - r.min.x + 1, 0);
+	f.height = std::max(r.max.y - r.min.y + 1, 0);
+	f.pixels.assign((size_t)f.width*f.height, 0);
+	if (!f.width || !f.height) return;
+	Layer &layer = active_layer();
+	int first = r.min.y / TILE_SIZE;
+	parallel_raster(r.max.y / TILE_SIZE - first + 1, [&](int band) {
+		int ty = first + band;
+		int y0 = std::max(r.min.y, ty*TILE_SIZE), y1 = std::min(r.max.y, ty*TILE_SIZE + TILE_SIZE - 1);
+		for (int tx = r.min.x / TILE_SIZE; tx <= r.max.x / TILE_SIZE; tx++) {
+			int index = ty*canvas.tiles_count.x + tx;
+			load_tile(layer, index);
+			Tile *tile = layer.tiles[index];
+			if (!tile) continue;
+			int x0 = std::max(r.min.x, tx*TILE_SIZE), x1 = std::min(r.max.x, tx*TILE_SIZE + TILE_SIZE - 1);
+			for (int y = y0; y <= y1; y++) {
+				uint32_t *line = (uint32_t *)tile->colors + (y % TILE_SIZE)*TILE_SIZE + x0 % TILE_SIZE;
+				memcpy(&f.pixels[(size_t)(y - r.min.y)*f.width + x0 - r.min.x], line, (x1 - x0 + 1)*sizeof(uint32_t));
+				memset(line, 0, (x1 - x0 + 1)*sizeof(uint32_t));
+			}
+			touch_tile(y0, x0);
+			mark_dirty(y0, x0);
+			mark_dirty(y1, x1);
+		}
+	});
+}
+
+// Resamples f through t over the active layer. Every canvas row is mapped
+// back into f and only the run of it the filter can reach f from is
+// sampled, a tile at a time; runs that come out transparent leave their
+// tile alone, so only the tiles the pixels land on are allocated, touched
+// and marked dirty. Bands of one tile row run in parallel. Returns the
+// tiles written, in index order.
+std::vector<int> stamp_selection(const FloatingPixels &f, const SelectionTransform &t, int filter) {
+	std::vector<int> written;
+	if (!f.width || !f.height || f.width > RESAMPLE_MAX || f.height > RESAMPLE_MAX || !t.scale.x || !t.scale.y) return written;
+	PROFILE_SCOPE("stamp");
+	sync_canvas();
+	ResampleSource src = { f.pixels.data(), f.width, f.height };
+	ResampleRow row = resample_row[filter];
+	float reach = resample_reach[filter];
+	// canvas to source: q = S^-1 R^T (p - center) + size/2, stepping by
+	// (ux, uy) along a row and (vx, vy) from one row to the next
+	double c = cos(t.angle), s = sin(t.angle);
+	double ux = c / t.scale.x, uy = -s / t.scale.y, vx = s / t.scale.x, vy = c / t.scale.y;
+	double y0 = INFINITY, y1 = -INFINITY;
+	for (int corner = 0; corner < 4; corner++) {
+		double qx = (corner & 1 ? f.width / 2.0 + reach : -f.width / 2.0 - reach)*t.scale.x;
+		double qy = (corner & 2 ? f.height / 2.0 + reach : -f.height / 2.0 - reach)*t.scale.y;
+		double py = t.center.y + s*qx + c*qy;
+		y0 = std::min(y0, py);
+		y1 = std::max(y1, py);
+	}
+	int top = std::max((int)floor(y0), 0), bottom = std::min((int)ceil(y1), canvas.size.height - 1);
+	if (top > bottom) return written;
+
+	int first = top / TILE_SIZE, bands = bottom / TILE_SIZE - first + 1;
+	std::vector<std::vector<int>> band_tiles(bands);
+	parallel_raster(bands, [&](int band) {
+		int ty = first + band;
+		std::vector<unsigned char> seen(canvas.tiles_count.x);
+		uint32_t samples[TILE_SIZE];
+		for (int y = std::max(top, ty*TILE_SIZE); y <= std::min(bottom, ty*TILE_SIZE + TILE_SIZE - 1); y++) {
+			// source position of the center of pixel 0 of the row
+			double dx = 0.5 - t.center.x, dy = y + 0.5 - t.center.y;
+			double qx = f.width / 2.0 + ux*dx + vx*dy, qy = f.height / 2.0 + uy*dx + vy*dy;
+			float lo = 0, hi = canvas.size.width - 1;
+			clip_linear(ux, qx, -reach, f.width + reach, &lo, &hi);
+			clip_linear(uy, qy, -reach, f.height + reach, &lo, &hi);
+			if (lo > hi) continue;
+			for (int x = std::max((int)ceil(lo), 0), end = std::min((int)floor(hi), canvas.size.width - 1); x <= end;) {
+				int tx = x / TILE_SIZE, last = std::min(end, tx*TILE_SIZE + TILE_SIZE - 1), n = last - x + 1;
+				row(samples, src, (int32_t)lround((qx + ux*x)*RESAMPLE_ONE), (int32_t)lround((qy + uy*x)*RESAMPLE_ONE),
+						(int32_t)lround(ux*RESAMPLE_ONE), (int32_t)lround(uy*RESAMPLE_ONE), n);
+				bool any = false;
+				for (int i = 0; i < n && !any; i++) any = samples[i] != 0;
+				if (any) {
+					int index = ty*canvas.tiles_count.x + tx;
+					uint32_t *line = (uint32_t *)canvas_tile(index)->colors + (y % TILE_SIZE)*TILE_SIZE;
+					composite_span(line + x % TILE_SIZE, samples, n, 255, BLEND_NORMAL);
+					touch_tile(y, x);
+					mark_dirty(y, x);
+					mark_dirty(y, last);
+					if (!seen[tx]) band_tiles[band].push_back(index);
+					seen[tx] = 1;
+				}
+				x = last + 1;
+			}
+		}
+		std::sort(band_tiles[band].begin(), band_tiles[band].end());
+	});
+	for (std::vector<int> &tiles : band_tiles) written.insert(written.end(), tiles.begin(), tiles.end());
+	return written;
+}
+
+// Commits a lift and its stamp as one step. The log can't replay the
+// resampling, so op_hook gets the step as the tiles it left, like a redo.
+void commit_selection() {
+	CanvasHistory &h = canvas.history;
+	if (!commit_history() || !op_hook) return;
+	for (TileChange &c : h.entries[h.cursor - 1].changes) op_hook({ OP_TILE, 0, { c.layer, c.index }, 0, c.after });
+}
+
+void hash_bytes(uint64_t *hash, const void *data, size_t n) {
+	const unsigned char *bytes = (const unsigned char *)data;
+	for (size_t i = 0; i < n; i++) {
+		*hash ^= bytes[i];
+		*hash *= 1099511628211ull;
+	}
+}
+
+// FNV-1a over the settings of every layer and the index and pixels of its
+// non-transparent tiles, to check that two runs produced the same document
+// whatever tiles they kept resident
+uint64_t canvas_hash() {
+	sync_canvas();
+	for (Layer &layer : canvas.layers) load_layer(layer);
+	uint64_t hash = 14695981039346656037ull;
+	hash_bytes(&hash, &canvas.size, sizeof(canvas.size));
+	for (Layer &layer : canvas.layers) {
+		int settings[3] = { layer.opacity, layer.blend, layer.visible };
+		hash_bytes(&hash, settings, sizeof(settings));
+		for (size_t i = 0; i < layer.tiles.size(); i++) {
+			Tile *tile = layer.tiles[i];
+			if (!tile || tile_is_empty(tile)) continue;
+			uint32_t index = i;
+			hash_bytes(&hash, &index, sizeof(index));
+			hash_bytes(&hash, tile->colors, sizeof(Tile));
+		}
+	}
+	return hash;
+}
+
+// Flattens layers [first, last) of one tile over base, or over transparent
+// without one. Every blend mode leaves a fully opaque layer unchanged over
+// transparent, so that case is a copy. Returns false if nothing was there.
+bool flatten_layers(Tile *dst, const Tile *base, int first, int last, int index) {
+	bool any = base != nullptr;
+	if (base) memcpy(dst, base, sizeof(Tile));
+	for (int l = first; l < last; l++) {
+		Layer &layer = canvas.layers[l];
+		Tile *src = layer.tiles[index];
+		if (!src || !layer.visible || layer.opacity == 0) continue;
+		if (!any && layer.opacity == 255) {
+			memcpy(dst, src, sizeof(Tile));
+		} else {
+			if (!any) memset(dst, 0, sizeof(Tile));
+			composite_span((uint32_t *)dst->colors, (const uint32_t *)src->colors, TILE_SIZE*TILE_SIZE, layer.opacity, layer.blend);
+		}
+		any = true;
+	}
+	return any;
+}
+
+// Flattened layers under the active one for a tile, null if transparent
+Tile *below_tile(int index) {
+	if (!canvas.below_valid[index]) {
+		canvas.below_valid[index] = 1;
+		Tile *tile = allocate_tile(canvas.below[index], &canvas.below_resident);
+		if (!flatten_layers(tile, nullptr, 0, canvas.layer, index) || tile_is_empty(tile)) {
+			release_tile(canvas.below[index], &canvas.below_resident);
+		}
+	}
+	return canvas.below[index];
+}
+
+// Recomposites one tile of the flattened image: the cached layers below the
+// active one, then the active layer and everything above it
+void composite_tile(int index) {
+	load_tiles(index);
+	Tile *below = below_tile(index);
+	bool above = false;
+	for (int l = canvas.layer; l < (int)canvas.layers.size(); l++) {
+		if (canvas.layers[l].tiles[index]) above = true;
+	}
+	if (!below && !above) {
+		release_tile(canvas.tiles[index], &canvas.resident);
+		return;
+	}
+	Tile *tile = flat_tile(index);
+	if (!flatten_layers(tile, below, canvas.layer, canvas.layers.size(), index) || tile_is_empty(tile)) release_tile(canvas.tiles[index], &canvas.resident);
+}
+
+// Recomposites every tile in a rectangle of tile coordinates, a row of
+// tiles per job
+void composite_tiles(Rect t) {
+	if (t.max.x < t.min.x) return;
+	PROFILE_SCOPE("composite");
+	sync_canvas();
+	parallel_raster(t.max.y - t.min.y + 1, [&](int row) {
+		for (int tx = t.min.x; tx <= t.max.x; tx++) {
+			composite_tile((t.min.y + row)*canvas.tiles_count.x + tx);
+		}
+	});
+}
+
+// Makes another layer the target of painting. The pending strokes belong
+// to the one they were drawn on, so they are committed first.
+void select_layer(int layer) {
+	layer = std::max(0, std::min(layer, (int)canvas.layers.size() - 1));
+	if (layer == canvas.layer) return;
+	flush_strokes();
+	commit_history();
+	if (op_hook) op_hook({ OP_SELECT_LAYER, 0, { layer } });
+	canvas.layer = layer;
+	invalidate_below_all();
+}
+
+// Adds an empty layer above the active one and selects it; history entries
+// of the layers above keep pointing at the same layers
+void add_layer() {
+	flush_strokes();
+	commit_history();
+	if (op_hook) op_hook({ OP_ADD_LAYER });
+	int layer = canvas.layer + 1;
+	canvas.layers.insert(canvas.layers.begin() + layer, new_layer());
+	for (HistoryEntry &entry : canvas.history.entries) {
+		for (TileChange &change : entry.changes) {
+			if (change.layer >= layer) change.layer++;
+		}
+	}
+	canvas.layer = layer;
+	invalidate_below_all();
+}
+
+// Called after the opacity, blend mode or visibility of a layer changed;
+// these aren't part of the history
+void layer_changed(int layer) {
+	sync_canvas();
+	Layer &l = canvas.layers[layer];
+	if (op_hook) op_hook({ OP_LAYER, 0, { layer, l.opacity, l.blend, l.visible } });
+	if (layer < canvas.layer) invalidate_below_all();
+	mark_canvas_dirty();
+}
+
+// True when the flattened image is the active layer as is, which the GPU
+// brush relies on to paint the displayed tiles directly
+bool canvas_is_flat() {
+	Layer &layer = canvas.layers[0];
+	return canvas.layers.size() == 1 && layer.visible && layer.opacity == 255;
+}
+
+void create_canvas(int width, int height) {
+	free_canvas_tiles();
+	canvas.size = { width, height };
+	canvas.tiles_count = { (width + TILE_SIZE - 1) / TILE_SIZE, (height + TILE_SIZE - 1) / TILE_SIZE };
+	size_t count = (size_t)canvas.tiles_count.x * canvas.tiles_count.y;
+	canvas.tiles.assign(count, nullptr);
+	canvas.below.assign(count, nullptr);
+	canvas.below_valid.assign(count, 0);
+	canvas.layers.assign(1, new_layer());
+	canvas.layer = 0;
+	reset_history();
+	canvas.history.coords[0] = { -1, -1 };
+	canvas.history.coords[1] = { -1, -1 };
+	canvas.history.coords[2] = { -1, -1 };
+	mark_canvas_dirty();
+}
+
+#endif
@@ -0,0 +1,237 @@
+#ifndef COLOR_H
+#define COLOR_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define COLOR_X86 1
+#endif
+
+// Color conversions shared by the UI and the raster code: HSV to RGB for the
+// wheel, packing to the canvas pixel format, and sRGB <-> linear through
+// lookup tables, so blending in linear light doesn't cost a powf per pixel.
+// Needs the vector types of canvas.h, which includes it after them.
+
+#define LINEAR_STEPS 4096 // resolution of the linear -> sRGB table
+
+// Hue angle in radians, as atan2 returns it, to the fully saturated color.
+// hue_to_rgb in shader.frag is the same formula, for the wheel itself.
+Vec3 hue_to_rgb(float angle) {
+	float f = angle / (2*(float)M_PI);
+	f = (f - floorf(f)) * 6;
+	return {
+		fminf(fmaxf(fabsf(f - 3) - 1, 0), 1),
+		fminf(fmaxf(2 - fabsf(f - 2), 0), 1),
+		fminf(fmaxf(2 - fabsf(f - 4), 0), 1)
+	};
+}
+
+// Hue in radians, saturation and value in 0..1
+Vec3 hsv_to_rgb(Vec3 hsv) {
+	Vec3 hue = hue_to_rgb(hsv.h);
+	float c = hsv.v * hsv.s;
+	float m = hsv.v - c;
+	return { c * hue.r + m, c * hue.g + m, c * hue.b + m };
+}
+
+Vec3 rgb_to_hsv(Vec3 rgb) {
+	float max = fmaxf(rgb.r, fmaxf(rgb.g, rgb.b));
+	float min = fminf(rgb.r, fminf(rgb.g, rgb.b));
+	float c = max - min;
+	float h = 0;
+	if (c > 0) {
+		if (max == rgb.r) h = fmodf((rgb.g - rgb.b)/c + 6, 6);
+		else if (max == rgb.g) h = (rgb.b - rgb.r)/c + 2;
+		else h = (rgb.r - rgb.g)/c + 4;
+	}
+	if (h > 3) h -= 6; // (-pi, pi], like atan2
+	return { h * (float)M_PI/3, max > 0 ? c/max : 0, max };
+}
+
+// Rounds each channel, opaque
+uint32_t pack_color(Vec3 rgb) {
+	Vec4uc c = {
+		(unsigned char)(fminf(fmaxf(rgb.r, 0), 1) * 255 + 0.5f),
+		(unsigned char)(fminf(fmaxf(rgb.g, 0), 1) * 255 + 0.5f),
+		(unsigned char)(fminf(fmaxf(rgb.b, 0), 1) * 255 + 0.5f),
+		255
+	};
+	uint32_t packed;
+	memcpy(&packed, &c, sizeof(packed));
+	return packed;
+}
+
+float srgb_to_linear_exact(float c) {
+	return c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+}
+
+float linear_to_srgb_exact(float c) {
+	return c <= 0.0031308f ? c * 12.92f : 1.055f * powf(c, 1 / 2.4f) - 0.055f;
+}
+
+float srgb_to_linear_table[256];
+int32_t linear_to_srgb_table[LINEAR_STEPS]; // int32 so AVX2 can gather it
+
+bool build_color_tables() {
+	for (int i = 0; i < 256; i++) srgb_to_linear_table[i] = srgb_to_linear_exact(i / 255.0f);
+	for (int i = 0; i < LINEAR_STEPS; i++) {
+		linear_to_srgb_table[i] = (int32_t)(linear_to_srgb_exact(i / (float)(LINEAR_STEPS - 1)) * 255 + 0.5f);
+	}
+	return true;
+}
+
+bool color_tables_ready = build_color_tables();
+
+// Span conversions between premultiplied sRGB8 pixels and premultiplied
+// linear floats, four per pixel. Color is unpremultiplied to index the
+// tables; alpha always indexes their last entry, which maps it to itself.
+// All versions round the same way (to nearest even, like cvtps2dq).
+
+void decode_span_scalar(const uint32_t *src, float *dst, int n) {
+	for (int i = 0; i < n; i++, dst += 4) {
+		float a = (float)(src[i] >> 24);
+		if (a == 0) {
+			dst[0] = dst[1] = dst[2] = dst[3] = 0;
+			continue;
+		}
+		float k = a * (1.0f/255);
+		for (int c = 0; c < 4; c++) {
+			float v = (float)((src[i] >> 8*c) & 255);
+			dst[c] = srgb_to_linear_table[(int)lrintf(v * 255 / a)] * k;
+		}
+	}
+}
+
+void encode_span_scalar(const float *src, uint32_t *dst, int n) {
+	for (int i = 0; i < n; i++, src += 4) {
+		float a = src[3];
+		if (a <= 0) {
+			dst[i] = 0;
+			continue;
+		}
+		uint32_t pixel = 0;
+		for (int c = 0; c < 4; c++) {
+			int index = (int)lrintf(src[c] / a * (LINEAR_STEPS - 1));
+			index = index < 0 ? 0 : index > LINEAR_STEPS - 1 ? LINEAR_STEPS - 1 : index;
+			int v = (int)lrintf((float)linear_to_srgb_table[index] * a);
+			pixel |= (uint32_t)(v > 255 ? 255 : v) << 8*c;
+		}
+		dst[i] = pixel;
+	}
+}
+
+#ifdef COLOR_X86
+
+// One pixel per register; SSE2 has no gather, so the table lookups go
+// through memory
+
+inline __m128 unpack_pixel_sse2(uint32_t pixel) {
+	__m128i zero = _mm_setzero_si128();
+	__m128i v = _mm_unpacklo_epi8(_mm_cvtsi32_si128(pixel), zero);
+	return _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero));
+}
+
+inline __m128i pack_pixel_sse2(__m128 v) {
+	__m128i i = _mm_cvtps_epi32(v);
+	return _mm_packus_epi16(_mm_packs_epi32(i, i), _mm_setzero_si128());
+}
+
+void decode_span_sse2(const uint32_t *src, float *dst, int n) {
+	alignas(16) int32_t index[4];
+	for (int i = 0; i < n; i++, dst += 4) {
+		__m128 v = unpack_pixel_sse2(src[i]);
+		__m128 a = _mm_shuffle_ps(v, v, 0xff);
+		if (!(src[i] >> 24)) {
+			_mm_storeu_ps(dst, _mm_setzero_ps());
+			continue;
+		}
+		_mm_store_si128((__m128i *)index, _mm_cvtps_epi32(_mm_div_ps(_mm_mul_ps(v, _mm_set1_ps(255)), a)));
+		__m128 t = _mm_setr_ps(srgb_to_linear_table[index[0]], srgb_to_linear_table[index[1]],
+				srgb_to_linear_table[index[2]], srgb_to_linear_table[index[3]]);
+		_mm_storeu_ps(dst, _mm_mul_ps(t, _mm_mul_ps(a, _mm_set1_ps(1.0f/255))));
+	}
+}
+
+void encode_span_sse2(const float *src, uint32_t *dst, int n) {
+	alignas(16) int32_t index[4];
+	const __m128i last = _mm_set1_epi32(LINEAR_STEPS - 1);
+	for (int i = 0; i < n; i++, src += 4) {
+		__m128 v = _mm_loadu_ps(src);
+		__m128 a = _mm_shuffle_ps(v, v, 0xff);
+		if (src[3] <= 0) {
+			dst[i] = 0;
+			continue;
+		}
+		__m128i k = _mm_cvtps_epi32(_mm_mul_ps(_mm_div_ps(v, a), _mm_set1_ps(LINEAR_STEPS - 1)));
+		// clamp to the table, with the signed compares SSE2 has
+		k = _mm_and_si128(k, _mm_cmpgt_epi32(k, _mm_setzero_si128()));
+		__m128i over = _mm_cmpgt_epi32(k, last);
+		k = _mm_or_si128(_mm_andnot_si128(over, k), _mm_and_si128(over, last));
+		_mm_store_si128((__m128i *)index, k);
+		__m128i t = _mm_setr_epi32(linear_to_srgb_table[index[0]], linear_to_srgb_table[index[1]],
+				linear_to_srgb_table[index[2]], linear_to_srgb_table[index[3]]);
+		dst[i] = _mm_cvtsi128_si32(pack_pixel_sse2(_mm_mul_ps(_mm_cvtepi32_ps(t), a)));
+	}
+}
+
+__attribute__((target("avx2")))
+void decode_span_avx2(const uint32_t *src, float *dst, int n) {
+	for (int i = 0; i < n; i++, dst += 4) {
+		__m128 v = unpack_pixel_sse2(src[i]);
+		__m128 a = _mm_shuffle_ps(v, v, 0xff);
+		if (!(src[i] >> 24)) {
+			_mm_storeu_ps(dst, _mm_setzero_ps());
+			continue;
+		}
+		__m128i index = _mm_cvtps_epi32(_mm_div_ps(_mm_mul_ps(v, _mm_set1_ps(255)), a));
+		__m128 t = _mm_i32gather_ps(srgb_to_linear_table, index, 4);
+		_mm_storeu_ps(dst, _mm_mul_ps(t, _mm_mul_ps(a, _mm_set1_ps(1.0f/255))));
+	}
+}
+
+__attribute__((target("avx2")))
+void encode_span_avx2(const float *src, uint32_t *dst, int n) {
+	for (int i = 0; i < n; i++, src += 4) {
+		__m128 v = _mm_loadu_ps(src);
+		__m128 a = _mm_shuffle_ps(v, v, 0xff);
+		if (src[3] <= 0) {
+			dst[i] = 0;
+			continue;
+		}
+		__m128i k = _mm_cvtps_epi32(_mm_mul_ps(_mm_div_ps(v, a), _mm_set1_ps(LINEAR_STEPS - 1)));
+		k = _mm_min_epi32(_mm_max_epi32(k, _mm_setzero_si128()), _mm_set1_epi32(LINEAR_STEPS - 1));
+		__m128i t = _mm_i32gather_epi32(linear_to_srgb_table, k, 4);
+		dst[i] = _mm_cvtsi128_si32(pack_pixel_sse2(_mm_mul_ps(_mm_cvtepi32_ps(t), a)));
+	}
+}
+
+#endif
+
+typedef void (*DecodeSpan)(const uint32_t *src, float *dst, int n);
+typedef void (*EncodeSpan)(const float *src, uint32_t *dst, int n);
+
+DecodeSpan select_decode_span() {
+#ifdef COLOR_X86
+	if (__builtin_cpu_supports("avx2")) return decode_span_avx2;
+	return decode_span_sse2;
+#else
+	return decode_span_scalar;
+#endif
+}
+
+EncodeSpan select_encode_span() {
+#ifdef COLOR_X86
+	if (__builtin_cpu_supports("avx2")) return encode_span_avx2;
+	return encode_span_sse2;
+#else
+	return encode_span_scalar;
+#endif
+}
+
+DecodeSpan decode_span = select_decode_span();
+EncodeSpan encode_span = select_encode_span();
+
+#endif
@@ -0,0 +1,440 @@
+#ifndef DOCUMENT_H
+#define DOCUMENT_H
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+// Native document format: a header, the committed tiles of every layer each
+// packed on its own with the RLE of rle.h, and an index of where they are.
+// A save appends only the tiles the file doesn't hold yet plus a new index,
+// and points the header at it last, so an interrupted save leaves the
+// previous one readable. Opening maps the file and hands the packed tiles to
+// the layers as they are; each is decoded when first needed (see load_tile).
+// Needs canvas.h.
+
+#define DOCUMENT_MAGIC 0x434f4450 // "PDOC"
+#define DOCUMENT_VERSION 1
+#define DOCUMENT_WRITE_BUFFER (1 << 20)
+
+// Every part is a multiple of 4 bytes, so the packed words stay aligned
+#pragma pack(push, 1)
+struct DocumentHeader {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t tile_size;
+	int32_t width, height;
+	uint32_t layers, active;
+	uint64_t index;   // offset of the current index
+	uint32_t tiles;   // records in it, after one DocumentLayer per layer
+	uint64_t sequence; // operation log position of an autosave, see oplog.h
+};
+
+struct DocumentLayer {
+	uint8_t opacity, blend, visible, reserved;
+};
+
+struct DocumentTile {
+	uint32_t layer, index;
+	uint64_t offset;  // of the packed words
+	uint32_t words, reserved;
+};
+#pragma pack(pop)
+
+struct MappedFile {
+	const unsigned char *data;
+	size_t size;
+	~MappedFile() {
+		munmap((void *)data, size);
+	}
+};
+
+struct SavedTile {
+	TileRef snapshot; // keeps the key alive
+	uint64_t offset;
+	uint32_t words;
+};
+
+// What the file at path holds, by snapshot, so a save can tell which
+// tiles changed since the last one without comparing any pixels
+struct Document {
+	std::string path;
+	std::unordered_map<const TileSnapshot *, SavedTile> saved;
+	uint64_t end;      // where appended tiles go
+	uint64_t live;     // bytes the current index and its tiles take
+	uint64_t sequence; // as opened or last saved
+	unsigned long written, kept; // tiles, by the last save
+};
+
+// The committed document at one point, which stays valid while painting
+// goes on, so it can be written from another thread
+struct DocumentState {
+	Vec2i size;
+	int active;
+	uint64_t sequence;
+	std::vector<DocumentLayer> layers;
+	std::vector<std::vector<TileRef>> tiles;
+};
+
+Document document = {};
+
+bool write_at(int fd, const void *data, size_t n, uint64_t offset) {
+	const char *p = (const char *)data;
+	while (n) {
+		ssize_t done = pwrite(fd, p, n, offset);
+		if (done <= 0) return false;
+		p += done;
+		n -= done;
+		offset += done;
+	}
+	return true;
+}
+
+// Packed words of a snapshot, encoded here if the history worker didn't
+// get to it yet
+const uint32_t *snapshot_words(TileSnapshot &snapshot, std::vector<uint32_t> &scratch, uint32_t *words) {
+	{
+		std::lock_guard<std::mutex> guard(snapshot.lock);
+		if (snapshot.raw) {
+			rle_encode((const uint32_t *)snapshot.raw->colors, TILE_SIZE*TILE_SIZE, scratch);
+			*words = scratch.size();
+			return scratch.data();
+		}
+	}
+	*words = snapshot.words;
+	return snapshot.packed.get();
+}
+
+// Leaves out what isn't committed yet; callers commit first if they want it
+DocumentState capture_document(uint64_t sequence) {
+	DocumentState s = { canvas.size, canvas.layer, sequence, {}, {} };
+	for (Layer &layer : canvas.layers) {
+		s.layers.push_back({ (uint8_t)layer.opacity, (uint8_t)layer.blend, (uint8_t)layer.visible, 0 });
+		s.tiles.push_back(layer.committed);
+	}
+	return s;
+}
+
+// Writing the same document to the same path again appends the changed
+// tiles; once more than half of the file is dead the whole document is
+// rewritten to a new file that replaces it. Off the main thread, parallel
+// has to be false, as the pool takes one caller at a time.
+bool write_document(Document &d, const char *path, const DocumentState &s, bool parallel) {
+	PROFILE_SCOPE("save");
+
+	struct stat st;
+	bool append = d.path == path && stat(path, &st) == 0 && (uint64_t)st.st_size == d.end && d.end - d.live <= d.live;
+	std::string target = append ? d.path : std::string(path) + ".tmp";
+	int fd = open(target.c_str(), append ? O_WRONLY : O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		printf("Can't open %s for writing\n", target.c_str());
+		return false;
+	}
+	std::unordered_map<const TileSnapshot *, SavedTile> saved;
+	if (append) saved.swap(d.saved);
+	uint64_t end = append ? d.end : sizeof(DocumentHeader);
+
+	std::vector<DocumentTile> records;
+	std::vector<TileRef> snapshots;
+	std::vector<int> fresh; // records of tiles the file doesn't hold
+	for (size_t l = 0; l < s.tiles.size(); l++) {
+		const std::vector<TileRef> &committed = s.tiles[l];
+		for (size_t i = 0; i < committed.size(); i++) {
+			if (!committed[i]) continue;
+			DocumentTile record = { (uint32_t)l, (uint32_t)i, 0, 0, 0 };
+			auto found = saved.find(committed[i].get());
+			if (found != saved.end()) {
+				record.offset = found->second.offset;
+				record.words = found->second.words;
+			} else {
+				fresh.push_back(records.size());
+			}
+			records.push_back(record);
+			snapshots.push_back(committed[i]);
+		}
+	}
+
+	// Tiles the history worker didn't pack yet are encoded in parallel
+	std::vector<std::vector<uint32_t>> scratch(fresh.size());
+	std::vector<const uint32_t *> words(fresh.size());
+	auto encode = [&](int k) {
+		words[k] = snapshot_words(*snapshots[fresh[k]], scratch[k], &records[fresh[k]].words);
+	};
+	if (parallel) parallel_for(fresh.size(), encode);
+	else for (size_t k = 0; k < fresh.size(); k++) encode(k);
+
+	bool ok = true;
+	std::vector<unsigned char> buffer;
+	uint64_t buffer_at = end;
+	for (size_t k = 0; k < fresh.size() && ok; k++) {
+		DocumentTile &record = records[fresh[k]];
+		record.offset = end;
+		const unsigned char *p = (const unsigned char *)words[k];
+		buffer.insert(buffer.end(), p, p + record.words*sizeof(uint32_t));
+		end += record.words*sizeof(uint32_t);
+		if (buffer.size() >= DOCUMENT_WRITE_BUFFER) {
+			ok = write_at(fd, buffer.data(), buffer.size(), buffer_at);
+			buffer_at = end;
+			buffer.clear();
+		}
+	}
+
+	DocumentHeader header = {
+		DOCUMENT_MAGIC, DOCUMENT_VERSION, TILE_SIZE, s.size.width, s.size.height,
+		(uint32_t)s.layers.size(), (uint32_t)s.active, end, (uint32_t)records.size(), s.sequence
+	};
+	const unsigned char *p = (const unsigned char *)s.layers.data();
+	buffer.insert(buffer.end(), p, p + s.layers.size()*sizeof(DocumentLayer));
+	p = (const unsigned char *)records.data();
+	buffer.insert(buffer.end(), p, p + records.size()*sizeof(DocumentTile));
+	end += s.layers.size()*sizeof(DocumentLayer) + records.size()*sizeof(DocumentTile);
+
+	// the new index has to be on disk before the header points at it
+	ok = ok && write_at(fd, buffer.data(), buffer.size(), buffer_at) && fdatasync(fd) == 0;
+	ok = ok && write_at(fd, &header, sizeof(header), 0) && fdatasync(fd) == 0;
+	close(fd);
+	if (ok && !append) ok = rename(target.c_str(), path) == 0;
+	if (!ok) {
+		printf("Saving %s failed\n", path);
+		if (!append) unlink(target.c_str());
+		d.path.clear(); // the next save starts over
+		return false;
+	}
+
+	d.saved.clear();
+	d.live = sizeof(DocumentHeader) + end - header.index;
+	for (size_t r = 0; r < records.size(); r++) {
+		d.saved[snapshots[r].get()] = { snapshots[r], records[r].offset, records[r].words };
+		d.live += records[r].words*sizeof(uint32_t);
+	}
+	d.path = path;
+	d.end = end;
+	d.sequence = s.sequence;
+	d.written = fresh.size();
+	d.kept = records.size() - fresh.size();
+	return true;
+}
+
+// Saves the committed state of every layer, pending strokes included
+bool save_document(const char *path) {
+	double start = now_seconds();
+	flush_strokes();
+	commit_history();
+	if (!write_document(document, path, capture_document(0), true)) return false;
+	printf("Saved %s: %lu tiles written, %lu kept, %llu KiB, %.1f ms\n", path, document.written, document.kept,
+			(unsigned long long)(document.end >> 10), (now_seconds() - start)*1e3);
+	return true;
+}
+
+// Replaces the canvas with a document, which d then tracks. Nothing is
+// decoded here; the layers get the packed tiles, which keep the mapping
+// alive for as long as any layer or history step refers to them.
+bool open_document(Document &d, const char *path) {
+	double start = now_seconds();
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		printf("Can't open document %s\n", path);
+		return false;
+	}
+	struct stat st;
+	void *data = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(DocumentHeader)) {
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	close(fd);
+	if (data == MAP_FAILED) {
+		printf("%s is not a document this build can read\n", path);
+		return false;
+	}
+	std::shared_ptr<MappedFile> file(new MappedFile{ (const unsigned char *)data, (size_t)st.st_size });
+
+	DocumentHeader header;
+	memcpy(&header, file->data, sizeof(header));
+	uint64_t index_end = header.index + (uint64_t)header.layers*sizeof(DocumentLayer) + (uint64_t)header.tiles*sizeof(DocumentTile);
+	if (header.magic != DOCUMENT_MAGIC || header.version != DOCUMENT_VERSION || header.tile_size != TILE_SIZE ||
+			header.width <= 0 || header.height <= 0 || header.layers == 0 || header.active >= header.layers ||
+			header.index % 4 || index_end > file->size) {
+		printf("%s is not a document this build can read\n", path);
+		return false;
+	}
+
+	create_canvas(header.width, header.height);
+	const unsigned char *index = file->data + header.index;
+	canvas.layers.assign(header.layers, new_layer());
+	for (uint32_t l = 0; l < header.layers; l++) {
+		DocumentLayer settings;
+		memcpy(&settings, index + l*sizeof(DocumentLayer), sizeof(settings));
+		canvas.layers[l].opacity = settings.opacity;
+		canvas.layers[l].blend = settings.blend < BLEND_MODES ? settings.blend : BLEND_NORMAL;
+		canvas.layers[l].visible = settings.visible;
+	}
+	canvas.layer = header.active;
+
+	d.saved.clear();
+	d.live = sizeof(DocumentHeader) + index_end - header.index;
+	const unsigned char *records = index + header.layers*sizeof(DocumentLayer);
+	unsigned long skipped = 0;
+	for (uint32_t r = 0; r < header.tiles; r++) {
+		DocumentTile record;
+		memcpy(&record, records + r*sizeof(DocumentTile), sizeof(record));
+		if (record.layer >= header.layers || record.index >= canvas.tiles.size() || record.offset % 4 ||
+				record.offset + (uint64_t)record.words*sizeof(uint32_t) > header.index) {
+			skipped++;
+			continue;
+		}
+		TileRef snapshot = std::make_shared<TileSnapshot>();
+		snapshot->packed = std::shared_ptr<const uint32_t>(file, (const uint32_t *)(file->data + record.offset));
+		snapshot->words = record.words;
+		snapshot->bytes = record.words*sizeof(uint32_t);
+		Layer &layer = canvas.layers[record.layer];
+		layer.committed[record.index] = snapshot;
+		layer.unloaded[record.index] = 1;
+		d.saved[snapshot.get()] = { snapshot, record.offset, record.words };
+		d.live += record.words*sizeof(uint32_t);
+	}
+	d.path = path;
+	d.end = file->size;
+	d.sequence = header.sequence;
+	invalidate_below_all();
+	mark_canvas_dirty();
+	printf("Opened %s: %dx%d, %u tiles in %u layers, %.1f ms\n", path, header.width, header.height,
+			header.tiles, header.layers, (now_seconds() - start)*1e3);
+	if (skipped) printf("%lu tile records of %s are out of bounds and were skipped\n", skipped, path);
+	return true;
+}
+
+// PNG export runs on a thread of its own over the committed snapshots,
+// which don't change under it, one row of tiles at a time: flattened,
+// unpremultiplied and deflated straight into IDAT chunks.
+struct PngExport {
+	std::thread thread;
+	std::atomic<bool> running;
+	std::atomic<int> rows; // written so far
+};
+
+PngExport png_export = {};
+
+struct ExportLayer {
+	std::vector<TileRef> tiles;
+	int opacity, blend;
+};
+
+void png_chunk(FILE *file, const char *type, const unsigned char *data, uint32_t n) {
+	unsigned char length[4] = { (unsigned char)(n >> 24), (unsigned char)(n >> 16), (unsigned char)(n >> 8), (unsigned char)n };
+	uLong crc = crc32(0, (const Bytef *)type, 4);
+	if (n) crc = crc32(crc, data, n); // a null buffer would restart it
+	unsigned char check[4] = { (unsigned char)(crc >> 24), (unsigned char)(crc >> 16), (unsigned char)(crc >> 8), (unsigned char)crc };
+	fwrite(length, 4, 1, file);
+	fwrite(type, 4, 1, file);
+	if (n) fwrite(data, n, 1, file);
+	fwrite(check, 4, 1, file);
+}
+
+// Feeds a row to deflate, writing an IDAT chunk every time its output fills
+void png_deflate(FILE *file, z_stream &z, std::vector<unsigned char> &out, const unsigned char *data, size_t n, int flush) {
+	z.next_in = (Bytef *)data;
+	z.avail_in = n;
+	do {
+		z.next_out = out.data();
+		z.avail_out = out.size();
+		deflate(&z, flush);
+		uint32_t produced = out.size() - z.avail_out;
+		if (produced) png_chunk(file, "IDAT", out.data(), produced);
+	} while (z.avail_out == 0 || (flush == Z_FINISH && z.avail_in));
+}
+
+void export_png_run(std::string path, std::vector<ExportLayer> layers, Vec2i size, Vec2i tiles_count) {
+	PROFILE_THREAD("export");
+	PROFILE_SCOPE("export");
+	double start = now_seconds();
+	FILE *file = fopen(path.c_str(), "wb");
+	if (!file) {
+		printf("Can't open %s for writing\n", path.c_str());
+		png_export.running = false;
+		return;
+	}
+	const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	fwrite(signature, 8, 1, file);
+	unsigned char ihdr[13] = {
+		(unsigned char)(size.width >> 24), (unsigned char)(size.width >> 16), (unsigned char)(size.width >> 8), (unsigned char)size.width,
+		(unsigned char)(size.height >> 24), (unsigned char)(size.height >> 16), (unsigned char)(size.height >> 8), (unsigned char)size.height,
+		8, 6, 0, 0, 0 // 8 bits per channel, RGBA
+	};
+	png_chunk(file, "IHDR", ihdr, sizeof(ihdr));
+
+	z_stream z = {};
+	deflateInit(&z, Z_BEST_SPEED);
+	std::vector<unsigned char> out(1 << 16);
+	std::vector<unsigned char> line(1 + 4*size.width); // filter type 0, then the pixels
+	std::vector<Tile> row(tiles_count.x);
+	Tile decoded;
+	for (int ty = 0; ty < tiles_count.y; ty++) {
+		for (int tx = 0; tx < tiles_count.x; tx++) {
+			Tile &dst = row[tx];
+			memset(&dst, 0, sizeof(Tile));
+			for (ExportLayer &layer : layers) {
+				const TileRef &ref = layer.tiles[ty*tiles_count.x + tx];
+				if (!ref || !decode_snapshot(*ref, &decoded)) continue;
+				composite_span((uint32_t *)dst.colors, (const uint32_t *)decoded.colors, TILE_SIZE*TILE_SIZE, layer.opacity, layer.blend);
+			}
+		}
+		int rows = std::min(TILE_SIZE, size.height - ty*TILE_SIZE);
+		for (int y = 0; y < rows; y++) {
+			unsigned char *p = line.data() + 1;
+			for (int x = 0; x < size.width; x++, p += 4) {
+				Vec4uc c = row[x / TILE_SIZE].colors[y*TILE_SIZE + x % TILE_SIZE];
+				if (!c.a) {
+					p[0] = p[1] = p[2] = p[3] = 0;
+					continue;
+				}
+				p[0] = std::min(255, (c.r*255 + c.a/2) / c.a);
+				p[1] = std::min(255, (c.g*255 + c.a/2) / c.a);
+				p[2] = std::min(255, (c.b*255 + c.a/2) / c.a);
+				p[3] = c.a;
+			}
+			png_deflate(file, z, out, line.data(), line.size(), Z_NO_FLUSH);
+			png_export.rows++;
+		}
+	}
+	png_deflate(file, z, out, nullptr, 0, Z_FINISH);
+	deflateEnd(&z);
+	png_chunk(file, "IEND", nullptr, 0);
+	bool ok = !ferror(file);
+	fclose(file);
+	if (ok) printf("Exported %s: %dx%d, %.1f ms\n", path.c_str(), size.width, size.height, (now_seconds() - start)*1e3);
+	else printf("Exporting %s failed\n", path.c_str());
+	png_export.running = false;
+}
+
+void export_png_wait() {
+	if (png_export.thread.joinable()) png_export.thread.join();
+}
+
+// Starts exporting the flattened image as it is after committing the
+// pending strokes; painting can go on meanwhile
+bool export_png(const char *path) {
+	if (png_export.running) {
+		printf("An export is still running\n");
+		return false;
+	}
+	export_png_wait();
+	flush_strokes();
+	commit_history();
+	std::vector<ExportLayer> layers;
+	for (Layer &layer : canvas.layers) {
+		if (!layer.visible || layer.opacity == 0) continue;
+		layers.push_back({ layer.committed, layer.opacity, layer.blend });
+	}
+	png_export.running = true;
+	png_export.rows = 0;
+	png_export.thread = std::thread(export_png_run, std::string(path), std::move(layers), canvas.size, canvas.tiles_count);
+	return true;
+}
+
+#endif
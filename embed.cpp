@@ -0,0 +1,125 @@
+// Writes assets.h: the shader sources as string literals and the button
+// icons decoded to RGBA, so the app reads no files at startup. Run it from
+// the source directory after changing any of them:
+//   g++ -std=c++17 embed.cpp -o embed -lz && ./embed
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+const char *shaders[][2] = {
+	{ "shader.vert", "shader_vert_source" },
+	{ "shader.frag", "shader_frag_source" },
+	{ "canvas.frag", "canvas_frag_source" },
+	{ "brush.vert", "brush_vert_source" },
+	{ "brush.frag", "brush_frag_source" },
+	{ "tail.vert", "tail_vert_source" },
+	{ "tail.frag", "tail_frag_source" },
+	{ "select.vert", "select_vert_source" },
+	{ "select.frag", "select_frag_source" },
+};
+
+bool read_file(const char *path, std::string &out) {
+	FILE *file = fopen(path, "rb");
+	if (!file) return false;
+	char buffer[4096];
+	size_t n;
+	while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) out.append(buffer, n);
+	fclose(file);
+	return true;
+}
+
+uint32_t be32(const unsigned char *p) {
+	return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+int paeth(int a, int b, int c) {
+	int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+	if (pa <= pb && pa <= pc) return a;
+	return pb <= pc ? b : c;
+}
+
+// Only what the icons use: 8-bit RGBA, not interlaced. Rows come out
+// bottom first, the order glTexImage2D takes them in.
+bool decode_png(const std::string &png, int *width, int *height, std::vector<unsigned char> &pixels) {
+	const unsigned char *p = (const unsigned char *)png.data();
+	if (png.size() < 33 || memcmp(p, "\x89PNG\r\n\x1a\n", 8)) return false;
+	std::string idat;
+	for (size_t at = 8; at + 12 <= png.size();) {
+		uint32_t n = be32(p + at);
+		const char *type = (const char *)p + at + 4;
+		if (at + 12 + n > png.size()) return false;
+		if (!memcmp(type, "IHDR", 4)) {
+			*width = be32(p + at + 8);
+			*height = be32(p + at + 12);
+			if (p[at + 16] != 8 || p[at + 17] != 6 || p[at + 20] != 0) return false;
+		} else if (!memcmp(type, "IDAT", 4)) {
+			idat.append((const char *)p + at + 8, n);
+		}
+		at += 12 + n;
+	}
+	size_t stride = (size_t)*width*4;
+	std::vector<unsigned char> raw((stride + 1) * *height);
+	uLongf size = raw.size();
+	if (uncompress(raw.data(), &size, (const Bytef *)idat.data(), idat.size()) != Z_OK || size != raw.size()) return false;
+
+	pixels.assign(stride * *height, 0);
+	std::vector<unsigned char> previous(stride), row(stride);
+	for (int y = 0; y < *height; y++) {
+		const unsigned char *src = &raw[y*(stride + 1)];
+		for (size_t x = 0; x < stride; x++) {
+			int a = x >= 4 ? row[x - 4] : 0, b = previous[x], c = x >= 4 ? previous[x - 4] : 0;
+			int predicted[] = { 0, a, b, (a + b) / 2, paeth(a, b, c) };
+			if (src[0] > 4) return false;
+			row[x] = src[1 + x] + predicted[src[0]];
+		}
+		memcpy(&pixels[(*height - 1 - y)*stride], row.data(), stride);
+		previous.swap(row);
+	}
+	return true;
+}
+
+int main() {
+	std::string out = "#ifndef ASSETS_H\n#define ASSETS_H\n\n"
+			"// Generated by embed.cpp from the shader sources and tex_btns.png; don't\n"
+			"// edit, change those and run it again.\n\n";
+	for (auto &shader : shaders) {
+		std::string source;
+		if (!read_file(shader[0], source)) {
+			printf("Can't read %s\n", shader[0]);
+			return 1;
+		}
+		if (source.find(")glsl\"") != std::string::npos) {
+			printf("%s can't be put in a raw string\n", shader[0]);
+			return 1;
+		}
+		out += "const char " + std::string(shader[1]) + "[] = R\"glsl(" + source + ")glsl\";\n\n";
+	}
+
+	std::string png;
+	int width = 0, height = 0;
+	std::vector<unsigned char> pixels;
+	if (!read_file("tex_btns.png", png) || !decode_png(png, &width, &height, pixels)) {
+		printf("Can't decode tex_btns.png\n");
+		return 1;
+	}
+	out += "// RGBA, bottom row first\n";
+	out += "const int tex_btns_width = " + std::to_string(width) + ", tex_btns_height = " + std::to_string(height) + ";\n";
+	out += "const unsigned char tex_btns_pixels[] = {";
+	for (size_t i = 0; i < pixels.size(); i++) {
+		out += i % 24 ? " " : "\n\t";
+		out += std::to_string(pixels[i]) + ",";
+	}
+	out += "\n};\n\n#endif\n";
+
+	FILE *file = fopen("assets.h", "wb");
+	if (!file || fwrite(out.data(), 1, out.size(), file) != out.size() || fclose(file)) {
+		printf("Can't write assets.h\n");
+		return 1;
+	}
+	printf("Wrote assets.h: %zu shaders, %dx%d icons\n", sizeof(shaders) / sizeof(shaders[0]), width, height);
+	return 0;
+}
@@ -0,0 +1,158 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+
+// Session journal: a header followed by fixed-size records of every input
+// event the callbacks saw, plus a marker at the end of each frame that had
+// events, so a replay coalesces them exactly like the recorded session.
+
+#define JOURNAL_MAGIC 0x4c4e4a50 // "PJNL"
+#define JOURNAL_VERSION 1
+
+enum JournalEventType {
+	JOURNAL_CURSOR,
+	JOURNAL_BUTTON,
+	JOURNAL_KEY,
+	JOURNAL_RESIZE,
+	JOURNAL_FRAME,
+	JOURNAL_SCROLL, // after the others, which older journals already use
+	JOURNAL_EVENT_TYPES
+};
+
+#pragma pack(push, 1)
+struct JournalHeader {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t reserved;
+	int32_t canvas_width, canvas_height;
+	int32_t window_width, window_height;
+};
+
+struct JournalEvent {
+	double time;            // seconds since recording started
+	float x, y;             // cursor position, new size for JOURNAL_RESIZE, offsets for JOURNAL_SCROLL
+	int16_t code, scancode; // button or key
+	uint8_t type, action, mods, tool;
+	uint16_t brush_r;
+	uint32_t color;         // active color, packed like canvas pixels
+};
+#pragma pack(pop)
+
+struct Journal {
+	FILE *file;
+	bool recording, replaying, realtime, dispatching;
+	bool pending;  // events recorded since the last frame marker
+	double start;
+	JournalHeader header;
+	std::vector<JournalEvent> events;
+	size_t next;
+	double cursor_x, cursor_y;
+	std::vector<double> timings[JOURNAL_EVENT_TYPES];
+	std::vector<float> event_timings; // one per replayed record, for the CSV
+	const char *path;
+};
+
+Journal journal = {};
+
+const char *journal_event_names[JOURNAL_EVENT_TYPES] = { "cursor", "button", "key", "resize", "frame", "scroll" };
+
+bool journal_record_start(const char *path, JournalHeader header, double now) {
+	journal.file = fopen(path, "wb");
+	if (!journal.file) {
+		printf("Can't open journal %s for writing\n", path);
+		return false;
+	}
+	header.magic = JOURNAL_MAGIC;
+	header.version = JOURNAL_VERSION;
+	fwrite(&header, sizeof(header), 1, journal.file);
+	journal.header = header;
+	journal.recording = true;
+	journal.start = now;
+	journal.path = path;
+	return true;
+}
+
+void journal_record(JournalEvent event) {
+	fwrite(&event, sizeof(event), 1, journal.file);
+	journal.pending = event.type != JOURNAL_FRAME;
+}
+
+void journal_record_stop() {
+	if (!journal.recording) return;
+	fclose(journal.file);
+	journal.file = NULL;
+	journal.recording = false;
+}
+
+bool journal_replay_open(const char *path, bool realtime) {
+	FILE *file = fopen(path, "rb");
+	if (!file) {
+		printf("Can't open journal %s\n", path);
+		return false;
+	}
+	JournalHeader header;
+	if (fread(&header, sizeof(header), 1, file) != 1 ||
+			header.magic != JOURNAL_MAGIC || header.version != JOURNAL_VERSION) {
+		printf("%s is not a journal this build can read\n", path);
+		fclose(file);
+		return false;
+	}
+	JournalEvent event;
+	journal.events.clear();
+	while (fread(&event, sizeof(event), 1, file) == 1) journal.events.push_back(event);
+	fclose(file);
+
+	journal.header = header;
+	journal.replaying = true;
+	journal.realtime = realtime;
+	journal.next = 0;
+	journal.path = path;
+	printf("Replaying %zu records from %s (%s)\n", journal.events.size(), path, realtime ? "real time" : "fast");
+	return true;
+}
+
+bool journal_replay_done() {
+	return journal.next >= journal.events.size();
+}
+
+void journal_add_timing(int type, double seconds) {
+	journal.timings[type].push_back(seconds);
+	journal.event_timings.push_back(seconds);
+}
+
+// Prints latency percentiles per event type and writes every per-record
+// timing to <journal>.csv
+void journal_report(uint64_t hash) {
+	printf("Replay finished. Canvas hash: %016llx\n", (unsigned long long)hash);
+	for (int type = 0; type < JOURNAL_EVENT_TYPES; type++) {
+		std::vector<double> &t = journal.timings[type];
+		if (t.empty()) continue;
+		std::vector<double> sorted = t;
+		std::sort(sorted.begin(), sorted.end());
+		double total = 0;
+		for (double v : sorted) total += v;
+		printf("  %-7s %7zu  total %9.3f ms  p50 %8.3f us  p99 %8.3f us  max %8.3f us\n",
+				journal_event_names[type], sorted.size(), total*1e3,
+				sorted[sorted.size()/2]*1e6,
+				sorted[(size_t)(0.99*(sorted.size() - 1))]*1e6,
+				sorted.back()*1e6);
+	}
+
+	char csv_path[512];
+	snprintf(csv_path, sizeof(csv_path), "%s.csv", journal.path);
+	FILE *csv = fopen(csv_path, "w");
+	if (!csv) return;
+	fprintf(csv, "index,type,time,elapsed_us\n");
+	for (size_t i = 0; i < journal.event_timings.size() && i < journal.events.size(); i++) {
+		fprintf(csv, "%zu,%s,%.6f,%.3f\n", i, journal_event_names[journal.events[i].type],
+				journal.events[i].time, journal.event_timings[i]*1e6);
+	}
+	fclose(csv);
+	printf("Per-event timings written to %s\n", csv_path);
+}
+
+#endif
@@ -6,16 +6,34 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 #include "shader.h"
-
-#define STB_IMAGE_IMPLEMENTATION
-#include "stb_image.h"
+#include "assets.h"
+#include "canvas.h"
+#include "document.h"
+#include "oplog.h"
+#include "mipmap.h"
+#include "journal.h"
 
 #define CANVAS_HEIGHT 600
 #define CANVAS_WIDTH CANVAS_HEIGHT
 #define COLOR_WHEEL_SIDE 200
-
-#define HISTORY 16
-#define MAX_HIST_MOV HISTORY
+#define PANEL_HEIGHT (COLOR_WHEEL_SIDE + 105) // wheel plus the two button rows
+
+#define PBO_RING 3
+#define UPLOAD_TILES 256 // tiles staged per unpack buffer
+#define INITIAL_TILE_LAYERS 64
+#define IDLE_TIMEOUT 0.5 // seconds the loop may sleep without events
+#define ZOOM_MIN 0.01f
+#define ZOOM_MAX 64.0f
+#define ZOOM_STEP 1.25f // per notch of the wheel
+#define DEFAULT_DOCUMENT "canvas.pdoc" // Ctrl+S saves here unless one was opened
+#define DEFAULT_AUTOSAVE ".paint-autosave" // left behind only by a session that crashed
+#define GPU_TIMERS 64 // timer queries in flight
+#define PREDICT_MAX_LEAD 0.05 // seconds the tail may run ahead of the newest sample
+#define PREDICT_PIECES 4      // capsules the curved tail is drawn with
+#define LATENCY_WINDOW 0.15   // seconds of path searched for what a frame shows
+#define OVERLAY_PX_PER_MS 4
+#define SELECT_HANDLE_PX 5  // half side of the corner handles
+#define SELECT_ROTATE_PX 24 // reach of the rotation grip around a corner
 
 #define initialize_quad(x, y, width, height, s1, t1, s2, t2) \
 	        x,          y, -1,   0, 0,  s1, t1, \
@@ -23,26 +41,6 @@
 	x + width, y + height, -1,   1, 1,  s2, t2, \
 	        x, y + height, -1,   0, 1,  s1, t2
 
-union Vec2 {
-	struct { float x, y; };
-	struct { float width, height; };
-};
-
-union Vec2i {
-	struct { int x, y; };
-	struct { int width, height; };
-};
-
-union Vec3 {
-	struct { float x, y, z; };
-	struct { float r, g, b; };
-	struct { float h, s, v; };
-};
-
-struct Vec4uc {
-	unsigned char r, g, b, a;
-};
-
 struct Color {
 	Vec3 rgb, hsv;
 };
@@ -65,7 +63,8 @@ enum UiElement {
 	BUTTON_UNDO,
 	BUTTON_REDO,
 	BUTTON_BRUSH,
-	BUTTON_BUCKET
+	BUTTON_BUCKET,
+	BUTTON_SELECT
 };
 
 Vec2 window_size = { CANVAS_WIDTH + COLOR_WHEEL_SIDE + 48, CANVAS_HEIGHT + 48 };
@@ -76,29 +75,186 @@ int active_ui_element = -1, hot_ui_element = -1;
 //Vec2i last_pix = { -1, -1 };
 int brush_r = 5;
 int active_tool = BUTTON_BRUSH;
-Vec4uc first_filled_pix;
 
-struct CanvasHistory {
-	int index, past, future;
-	Vec4uc *colors[HISTORY];
-	Vec2i coords[3];
+// Ring of pixel unpack buffers; each slot is reused once its fence signals
+struct PixelUnpack {
+	GLuint buffers[PBO_RING];
+	GLsync fences[PBO_RING];
+	unsigned char *mapped[PBO_RING];
+	GLsizeiptr size;
+	int next;
+	bool persistent;
+	unsigned long uploads, stalls;
+};
+
+PixelUnpack unpack = {};
+
+// GPU copy of the resident canvas tiles: canvas.texture is an array texture
+// with one TILE_SIZE layer per tile, and pages maps every canvas tile to its
+// layer, or -1 for a transparent tile that has no layer at all. Each layer
+// has its own mip levels, rebuilt by update_mips for the tiles listed in
+// mips_stale while the view minifies.
+struct TileLayers {
+	GLuint pages;
+	std::vector<unsigned char> hidden; // changed while out of view, not uploaded
+	std::vector<int> hidden_list;
+	std::vector<int> layer_of;
+	std::vector<int> free_layers;
+	int capacity, max_layers, levels;
+	bool overflow_reported;
+	std::vector<unsigned char> mips_stale;
+	std::vector<int> mips_list;
+	GLuint mip_fbos[2]; // read and draw, for levels of tiles only the GPU has
+	unsigned long mips_built, mips_blitted, mips_full;
+	unsigned long evicted; // layers taken back from tiles out of view
 };
 
-struct Canvas {
+TileLayers tile_layers = {};
+
+struct BrushInstance {
+	float segment[4];
+	float radius;
+	uint32_t color;
+};
+
+// Alternative backend (--gpu-brush, G toggles it): queued segments are drawn
+// as instanced quads straight into the tile layers through an FBO, and the
+// tiles painted that way are only read back, through a PBO, when the CPU
+// needs them
+struct GpuBrush {
+	bool enabled, commit_pending;
+	Shader *program;
+	int loc_tile_origin, loc_tile_size, loc_antialias;
+	GLuint fbo, vao, instances, pack;
+	GLsizeiptr pack_size;
+	GLsync fence;                     // readback in flight
+	std::vector<int> reading;         // tiles it covers, in buffer order
+	std::vector<unsigned char> stale; // tile is newer on the GPU
+	std::vector<int> stale_list;
+	unsigned long draws, readbacks, waits;
+};
+
+GpuBrush gpu_brush = {};
+
+struct StrokeSample {
+	Vec2 p; // canvas pixels, unrounded
+	double time;
+};
+
+// What a frame of a stroke showed, for --latency
+struct LatencyFrame {
+	double present;
+	Vec2 last, predicted; // tip of the stroke without and with the tail
+	int stroke;
+};
+
+// Extrapolates the stroke being drawn from its newest samples to the time
+// its frame is expected on screen, and draws that tail over the canvas in
+// the window only. The canvas gets nothing but real samples; each frame
+// draws the tail again from the newest of them. --latency keeps every
+// sample and what each frame showed, and reports at exit how far behind
+// the pointer the screen was, with the tail and without it.
+struct StrokePrediction {
+	bool enabled, measuring;
+	StrokeSample samples[3]; // newest first
+	int count;
+	double lead; // smoothed age of the newest sample once its frame is shown
+	Vec2 tip;    // end of the tail of the frame being drawn
+	Shader *program;
+	int loc_projection, loc_canvas_origin, loc_canvas_scale, loc_antialias;
+	GLuint vao, instances;
+	std::vector<std::vector<StrokeSample>> paths; // one per stroke
+	std::vector<LatencyFrame> frames;
+};
+
+StrokePrediction prediction = { .enabled = true, .lead = 1/60.0 };
+
+enum SelectDrag {
+	SELECT_IDLE,
+	SELECT_MARK,
+	SELECT_MOVE,
+	SELECT_SCALE,
+	SELECT_ROTATE
+};
+
+// Rectangular selection (R). A drag on the canvas marks a rectangle;
+// dragging inside it lifts its pixels off the active layer and moves them,
+// a corner handle scales them against the opposite corner and a drag just
+// outside a corner rotates them. While they float they are only drawn,
+// transformed on the GPU from a texture of their own; Enter, a click
+// outside or anything else that changes the document resamples them into
+// the layer with the chosen filter (I cycles it), Escape puts them back.
+struct Selection {
+	bool active, floating;
+	Rect rect; // canvas pixels marked, or lifted from
+	FloatingPixels lifted;
+	SelectionTransform transform, grabbed; // and as it was when the drag began
+	int drag, corner; // corner: bit 0 right, bit 1 top
+	Vec2 grab;        // canvas point the drag began at
+	int filter;
+	Shader *program;
+	int loc_projection, loc_canvas_origin, loc_canvas_scale, loc_center, loc_axis_x, loc_axis_y, loc_grow, loc_lifted, loc_handle;
+	GLuint vao, texture;
+	bool textured; // the lifted pixels fit in a texture
+};
+
+Selection selection = { .filter = RESAMPLE_BILINEAR };
+
+// The wheel, SV square and buttons only depend on this; the panel is shaded
+// into an offscreen texture when it changes and just copied otherwise
+struct PanelKey {
+	Vec3 hsv;
+	int hot, tool;
 	Vec2i size;
-	float scale;
-	Vec4uc *colors;
-	GLuint texture;
+};
+
+struct Panel {
+	GLuint fbo, texture;
+	PanelKey key;
+	bool valid;
+	unsigned long renders;
+};
+
+Panel panel = {};
 
-	CanvasHistory history;
+// What changed since the last frame. Unless --continuous is given, a frame
+// where nothing did isn't drawn and the loop sleeps until the next event.
+struct Damage {
+	bool canvas, ui, window, pointer;
+	unsigned long rendered, skipped;
 };
 
-Canvas canvas = {
-	.size = { 512, 512 },
-	.scale = 1.0,
-	.history = { .index = 1, .past = 0, .future = 0 }
+Damage damage = { true, true, true, true, 0, 0 };
+
+// Where the canvas quad is in the window: its top-left corner, y up, and
+// window pixels per quad unit. While fitted it fills the square left of the
+// panel and follows the window; the wheel zooms about the cursor, dragging
+// with the middle button pans, Home fits again and 1 shows it at 1:1.
+struct CanvasView {
+	Vec2 corner, scale;
+	bool fitted, panning;
+	Vec2 grab; // cursor position the pan continues from
+};
+
+CanvasView canvas_view = { .fitted = true };
+
+#ifndef PAINT_NO_PROFILE
+// GL timer queries around the GPU side of the stages. They are read a few
+// frames later without waiting and go to a ring of their own, placed at the
+// time the commands were issued. One runs at a time, the outermost.
+struct GpuTimers {
+	GLuint queries[GPU_TIMERS];
+	const char *names[GPU_TIMERS];
+	uint64_t issued[GPU_TIMERS];
+	unsigned long head, tail;
+	bool enabled, running;
+	ProfileRing *ring;
 };
 
+GpuTimers gpu_timers = {};
+bool profile_overlay = false; // P shows the frame times of the main thread
+#endif
+
 struct Ui {
 	int active, hot;
 };
@@ -110,209 +266,1137 @@ int loc_model, loc_view, loc_projection;
 int loc_hot_ui_element, loc_active_tool;
 int loc_color_wheel_center, loc_color_wheel_radius;
 int loc_wheel_color, loc_active_color, loc_hsv;
-int loc_canvas, loc_tex_btn;
-
-void change_canvas_unit(int row, int column) {
-	if (row < 0 || row >= canvas.size.height) return;
-	if (column < 0 || column >= canvas.size.width) return;
-	*(canvas.colors + row*canvas.size.width + column) = {
-		active_color.rgb.r * 255,
-		active_color.rgb.g * 255,
-		active_color.rgb.b * 255,
-		255
-	};
+int loc_tex_btn;
+int loc_canvas_model, loc_canvas_view, loc_canvas_projection;
+int loc_canvas, loc_canvas_pages, loc_canvas_size, loc_tile_size;
+
+void create_unpack_ring() {
+	unpack.size = UPLOAD_TILES * sizeof(Tile);
+	unpack.persistent = GLEW_ARB_buffer_storage;
+	glGenBuffers(PBO_RING, unpack.buffers);
+	for (int i = 0; i < PBO_RING; i++) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, unpack.buffers[i]);
+		if (unpack.persistent) {
+			GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+			glBufferStorage(GL_PIXEL_UNPACK_BUFFER, unpack.size, NULL, flags);
+			unpack.mapped[i] = (unsigned char *)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, unpack.size, flags);
+		} else {
+			glBufferData(GL_PIXEL_UNPACK_BUFFER, unpack.size, NULL, GL_STREAM_DRAW);
+		}
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 }
 
-void clear_canvas(bool reset_history) {
-	for (int i = 0; i < canvas.size.height; i++) {
-		for (int j = 0; j < canvas.size.width; j++) {
-			*(canvas.colors + i*canvas.size.width + j) = { 0, 0, 0, 0 };
-			*(canvas.history.colors[canvas.history.index] + i*canvas.size.width + j) = { 0, 0, 0, 0 };
+#ifndef PAINT_NO_PROFILE
+bool gpu_timer_begin(const char *name) {
+	GpuTimers &g = gpu_timers;
+	if (!g.enabled || g.running || g.head - g.tail == GPU_TIMERS) return false;
+	if (!g.ring) {
+		glGenQueries(GPU_TIMERS, g.queries);
+		g.ring = profile_register("GPU");
+	}
+	int i = g.head++ % GPU_TIMERS;
+	g.names[i] = name;
+	g.issued[i] = profile_now();
+	glBeginQuery(GL_TIME_ELAPSED, g.queries[i]);
+	g.running = true;
+	return true;
+}
+
+void gpu_timer_end(bool began) {
+	if (!began) return;
+	glEndQuery(GL_TIME_ELAPSED);
+	gpu_timers.running = false;
+}
+
+// Records the queries that have their result, oldest first
+void gpu_timers_poll() {
+	GpuTimers &g = gpu_timers;
+	for (; g.tail < g.head; g.tail++) {
+		int i = g.tail % GPU_TIMERS;
+		GLint available = 0;
+		glGetQueryObjectiv(g.queries[i], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available) break;
+		GLuint64 elapsed;
+		glGetQueryObjectui64v(g.queries[i], GL_QUERY_RESULT, &elapsed);
+		profile_record(g.ring, g.names[i], g.issued[i], g.issued[i] + elapsed);
+	}
+}
+
+struct GpuTimerScope {
+	bool began;
+	GpuTimerScope(const char *name) : began(gpu_timer_begin(name)) {}
+	~GpuTimerScope() { gpu_timer_end(began); }
+};
+
+#define GPU_PROFILE_SCOPE(name) GpuTimerScope PROFILE_NAME(__LINE__)(name)
+#else
+inline bool gpu_timer_begin(const char *name) { return false; }
+inline void gpu_timer_end(bool began) {}
+inline void gpu_timers_poll() {}
+
+#define GPU_PROFILE_SCOPE(name)
+#endif
+
+// Screen pixels per canvas pixel; below 1 the canvas is minified, which
+// samples the mip levels
+float view_zoom() {
+	CanvasView &v = canvas_view;
+	return std::min(v.scale.x * CANVAS_WIDTH / canvas.size.width, v.scale.y * CANVAS_HEIGHT / canvas.size.height);
+}
+
+// Width of the window left of the panel column, where the canvas is shown
+float viewport_width() {
+	return window_size.width - COLOR_WHEEL_SIDE * canvas.scale;
+}
+
+// Window coordinates, y up, to canvas ones; the caller rounds
+void window_to_canvas(double x, double y, double *column, double *row) {
+	CanvasView &v = canvas_view;
+	float width = v.scale.x * CANVAS_WIDTH, height = v.scale.y * CANVAS_HEIGHT;
+	*column = (x - v.corner.x) / width * canvas.size.width;
+	*row = (y - (v.corner.y - height)) / height * canvas.size.height;
+}
+
+bool over_canvas(double x, double y) {
+	CanvasView &v = canvas_view;
+	float width = v.scale.x * CANVAS_WIDTH, height = v.scale.y * CANVAS_HEIGHT;
+	return x >= std::max(v.corner.x, 0.0f) && x < std::min(v.corner.x + width, viewport_width()) &&
+			y >= std::max(v.corner.y - height, 0.0f) && y < std::min(v.corner.y, window_size.height);
+}
+
+// Tiles at least partly in view, empty if none
+Rect visible_tiles() {
+	Rect none = { { 0, 0 }, { -1, -1 } };
+	double x0, y0, x1, y1;
+	window_to_canvas(0, 0, &x0, &y0);
+	window_to_canvas(viewport_width(), window_size.height, &x1, &y1);
+	if (x1 <= 0 || y1 <= 0 || x0 >= canvas.size.width || y0 >= canvas.size.height) return none;
+	int c0 = clamp((int)floor(x0), 0, canvas.size.width - 1), c1 = clamp((int)ceil(x1) - 1, 0, canvas.size.width - 1);
+	int r0 = clamp((int)floor(y0), 0, canvas.size.height - 1), r1 = clamp((int)ceil(y1) - 1, 0, canvas.size.height - 1);
+	return { { c0 / TILE_SIZE, r0 / TILE_SIZE }, { c1 / TILE_SIZE, r1 / TILE_SIZE } };
+}
+
+bool tile_visible(int index, const Rect &v) {
+	int tx = index % canvas.tiles_count.x, ty = index / canvas.tiles_count.x;
+	return tx >= v.min.x && tx <= v.max.x && ty >= v.min.y && ty <= v.max.y;
+}
+
+void fit_view() {
+	canvas_view.corner = { 0, window_size.height };
+	canvas_view.scale = { canvas.scale, canvas.scale };
+}
+
+// Redraws, and marks the tiles that changed out of view and just came into
+// it for upload
+void view_changed() {
+	damage.canvas = true;
+	// the title shows the zoom; it is only set again when that changes
+	static int shown = -1;
+	int percent = lroundf(view_zoom() * 100);
+	if (percent != shown && glfwGetCurrentContext()) {
+		char title[64];
+		snprintf(title, sizeof(title), "Floating window - %d%%", percent);
+		glfwSetWindowTitle(glfwGetCurrentContext(), title);
+		shown = percent;
+	}
+	Rect v = visible_tiles();
+	std::vector<int> &list = tile_layers.hidden_list;
+	size_t kept = 0;
+	for (int index : list) {
+		if (!tile_layers.hidden[index]) continue;
+		if (!tile_visible(index, v)) {
+			list[kept++] = index;
+			continue;
 		}
+		tile_layers.hidden[index] = 0;
+		Rect r = tile_rect(index);
+		mark_dirty(r.min.y, r.min.x);
+		mark_dirty(r.max.y, r.max.x);
 	}
+	list.resize(kept);
+}
+
+// Zooms keeping the canvas point under about, in window coordinates, in place
+void zoom_view(float zoom, Vec2 about) {
+	CanvasView &v = canvas_view;
+	zoom = std::max(ZOOM_MIN, std::min(zoom, ZOOM_MAX));
+	// the point as a fraction of the canvas, from its top-left corner
+	Vec2 p = { (about.x - v.corner.x) / (v.scale.x * CANVAS_WIDTH), (v.corner.y - about.y) / (v.scale.y * CANVAS_HEIGHT) };
+	v.scale = { zoom * canvas.size.width / CANVAS_WIDTH, zoom * canvas.size.height / CANVAS_HEIGHT };
+	v.corner = { about.x - p.x * v.scale.x * CANVAS_WIDTH, about.y + p.y * v.scale.y * CANVAS_HEIGHT };
+	v.fitted = false;
+	view_changed();
+}
 
-	if (reset_history) {
-		//canvas.history = { .past = 0, .future = 0 };
-		canvas.history.past = 0;
-		canvas.history.future = 0;
-		canvas.history.index = (canvas.history.index + 1) % HISTORY;
-		canvas.history.coords[0] = { -1, -1 };
-		canvas.history.coords[1] = { -1, -1 };
-		canvas.history.coords[2] = { -1, -1 };
+void mark_mips(int index) {
+	if (tile_layers.mips_stale[index]) return;
+	tile_layers.mips_stale[index] = 1;
+	tile_layers.mips_list.push_back(index);
+}
+
+// Copies a batch of tiles into the next PBO of the ring and queues one layer
+// update per tile from it, so the driver copy doesn't block us
+void upload_tiles(const std::vector<int> &batch) {
+	if (batch.empty()) return;
+	int i = unpack.next;
+	unpack.next = (i + 1) % PBO_RING;
+	if (unpack.fences[i]) {
+		if (glClientWaitSync(unpack.fences[i], 0, 0) == GL_TIMEOUT_EXPIRED) {
+			unpack.stalls++;
+			glClientWaitSync(unpack.fences[i], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+		}
+		glDeleteSync(unpack.fences[i]);
+		unpack.fences[i] = 0;
 	}
 
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, canvas.size.width, canvas.size.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, canvas.colors);
-	glGenerateMipmap(GL_TEXTURE_2D);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, unpack.buffers[i]);
+	unsigned char *dst = unpack.mapped[i];
+	if (!unpack.persistent) {
+		// The fence already guarantees the GPU is done with this slot
+		dst = (unsigned char *)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, batch.size() * sizeof(Tile),
+				GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+	}
+	for (size_t k = 0; k < batch.size(); k++) {
+		memcpy(dst + k * sizeof(Tile), canvas.tiles[batch[k]], sizeof(Tile));
+	}
+	if (!unpack.persistent) glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+	for (size_t k = 0; k < batch.size(); k++) {
+		glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, tile_layers.layer_of[batch[k]], TILE_SIZE, TILE_SIZE, 1,
+				GL_RGBA, GL_UNSIGNED_BYTE, (void*)(k * sizeof(Tile)));
+	}
+	unpack.fences[i] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	unpack.uploads++;
+	for (int index : batch) mark_mips(index);
 }
 
-int clamp(int value, int minimum, int maximum) {
-	if (value < minimum) return minimum;
-	if (value > maximum) return maximum;
-	return value;
+// (Re)creates the layer array. Layers are handed out again from scratch, so
+// the whole canvas is marked dirty to upload every resident tile.
+void allocate_tile_layers(int capacity) {
+	if (canvas.texture) glDeleteTextures(1, &canvas.texture);
+	glGenTextures(1, &canvas.texture);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, canvas.texture);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	int levels = 1;
+	while (TILE_SIZE >> levels) levels++;
+	if (GLEW_ARB_texture_storage) {
+		glTexStorage3D(GL_TEXTURE_2D_ARRAY, levels, GL_RGBA8, TILE_SIZE, TILE_SIZE, capacity);
+	} else {
+		for (int i = 0; i < levels; i++) {
+			glTexImage3D(GL_TEXTURE_2D_ARRAY, i, GL_RGBA8, TILE_SIZE >> i, TILE_SIZE >> i, capacity, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+		}
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, levels - 1);
+	}
+
+	tile_layers.capacity = capacity;
+	tile_layers.levels = levels;
+	tile_layers.layer_of.assign(canvas.tiles.size(), -1);
+	tile_layers.mips_stale.assign(canvas.tiles.size(), 0);
+	tile_layers.mips_list.clear();
+	tile_layers.hidden.assign(canvas.tiles.size(), 0);
+	tile_layers.hidden_list.clear();
+	tile_layers.free_layers.clear();
+	for (int layer = capacity - 1; layer >= 0; layer--) tile_layers.free_layers.push_back(layer);
+	mark_canvas_dirty();
 }
 
-void join_points(Vec2i start, Vec2i end) {
-	//printf("coords0 = (%d, %d)   start = (%d, %d)   end = (%d, %d)\n", canvas.history.coords[0].x, canvas.history.coords[0].y, start.x, start.y, end.x, end.y);
-	if (start.x + start.y == -2) return;
+// Tiles of t out of view are left for view_changed, and t shrinks to the
+// ones in view
+void hide_tiles(Rect &t) {
+	Rect v = visible_tiles();
+	for (int ty = t.min.y; ty <= t.max.y; ty++) {
+		for (int tx = t.min.x; tx <= t.max.x; tx++) {
+			int index = ty*canvas.tiles_count.x + tx;
+			if (tile_visible(index, v) || tile_layers.hidden[index]) continue;
+			tile_layers.hidden[index] = 1;
+			tile_layers.hidden_list.push_back(index);
+		}
+	}
+	t = { { std::max(t.min.x, v.min.x), std::max(t.min.y, v.min.y) }, { std::min(t.max.x, v.max.x), std::min(t.max.y, v.max.y) } };
+}
+
+// Writes the block t of the page table, in tiles
+void upload_pages(const Rect &t) {
+	int columns = canvas.tiles_count.x;
+	glActiveTexture(GL_TEXTURE2);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, columns);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, t.min.x, t.min.y, t.max.x - t.min.x + 1, t.max.y - t.min.y + 1,
+			GL_RED_INTEGER, GL_INT, &tile_layers.layer_of[t.min.y*columns + t.min.x]);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	glActiveTexture(GL_TEXTURE0);
+}
+
+// Takes the layers back from the tiles out of view, which are marked hidden
+// so view_changed uploads them again when they scroll in. Tiles only the
+// GPU brush has painted keep theirs until they are read back. Returns how
+// many were freed.
+int evict_tile_layers() {
+	TileLayers &t = tile_layers;
+	Rect v = visible_tiles();
+	int evicted = 0;
+	for (int index = 0; index < (int)t.layer_of.size(); index++) {
+		int &layer = t.layer_of[index];
+		if (layer < 0 || tile_visible(index, v) || (!gpu_brush.stale.empty() && gpu_brush.stale[index])) continue;
+		t.free_layers.push_back(layer);
+		layer = -1;
+		if (!t.hidden[index]) {
+			t.hidden[index] = 1;
+			t.hidden_list.push_back(index);
+		}
+		evicted++;
+	}
+	if (evicted) upload_pages({ { 0, 0 }, { canvas.tiles_count.x - 1, canvas.tiles_count.y - 1 } });
+	t.evicted += evicted;
+	return evicted;
+}
+
+// Makes room for missing more tiles, doubling the layer array up to
+// max_layers. Growing hands every layer out again, so tiles the GPU brush
+// painted are read back first, and the whole canvas is left dirty. True
+// when it grew.
+bool grow_tile_layers(int missing) {
+	TileLayers &t = tile_layers;
+	if (missing <= (int)t.free_layers.size() || t.capacity >= t.max_layers) return false;
+	sync_canvas();
+	int needed = t.capacity - (int)t.free_layers.size() + missing;
+	int capacity = t.capacity;
+	while (capacity < needed) capacity *= 2;
+	allocate_tile_layers(std::min(capacity, t.max_layers));
+	return true;
+}
 
-	if (start.x == end.x) {
-		int dir = end.y > start.y? 1: -1;
-		start.y = clamp(start.y, -1, canvas.size.height);
-		end.y = clamp(end.y, -1, canvas.size.height);
-		for (int y = start.y; y != end.y; y += dir) {
-			for (int w = -brush_r; w <= brush_r; w++) {
-				int x = start.x + w;
-				change_canvas_unit(y, x);
+// Gives tile index a layer, unless it has one, taking them back from the
+// tiles out of view once the array is full; false when none is left
+bool take_tile_layer(int index) {
+	TileLayers &t = tile_layers;
+	int &layer = t.layer_of[index];
+	if (layer >= 0) return true;
+	if (t.free_layers.empty() && !evict_tile_layers()) {
+		if (!t.overflow_reported) printf("Canvas has more than %d painted tiles; the rest aren't shown\n", t.capacity);
+		t.overflow_reported = true;
+		return false;
+	}
+	layer = t.free_layers.back();
+	t.free_layers.pop_back();
+	return true;
+}
+
+// Flattens the layers under canvas.dirty and pushes those tiles: resident
+// ones get a layer and are uploaded, transparent ones give theirs back, and
+// the matching block of the page table is rewritten. Only the tiles in view
+// are; the rest wait until they scroll in.
+void upload_canvas() {
+	Rect &d = canvas.dirty;
+	if (d.max.x < d.min.x) return;
+	Rect t = { { d.min.x / TILE_SIZE, d.min.y / TILE_SIZE }, { d.max.x / TILE_SIZE, d.max.y / TILE_SIZE } };
+	d = { { 0, 0 }, { -1, -1 } };
+	int columns = canvas.tiles_count.x;
+	hide_tiles(t);
+	if (t.max.x < t.min.x || t.max.y < t.min.y) return;
+	PROFILE_SCOPE("upload");
+	composite_tiles(t);
+	GPU_PROFILE_SCOPE("gpu upload");
+
+	int missing = 0;
+	for (int ty = t.min.y; ty <= t.max.y; ty++) {
+		for (int tx = t.min.x; tx <= t.max.x; tx++) {
+			int index = ty*columns + tx;
+			int &layer = tile_layers.layer_of[index];
+			if (canvas.tiles[index]) {
+				if (layer < 0) missing++;
+			} else if (layer >= 0) {
+				tile_layers.free_layers.push_back(layer);
+				layer = -1;
 			}
 		}
-		return;
+	}
+	if (grow_tile_layers(missing)) {
+		t = { { 0, 0 }, { columns - 1, canvas.tiles_count.y - 1 } };
+		d = { { 0, 0 }, { -1, -1 } };
+		hide_tiles(t);
 	}
 
-	if (start.y == end.y) {
-		int dir = end.x > start.x? 1: -1;
-		start.x = clamp(start.x, -1, canvas.size.width);
-		end.x = clamp(end.x, -1, canvas.size.width);
-		//printf("after clamp:   start = (%d, %d)   end = (%d, %d)\n", start.x, start.y, end.x, end.y);
-		for (int x = start.x; x != end.x; x += dir) {
-			for (int h = -brush_r; h <= brush_r; h++) {
-				int y = start.y + h;
-				change_canvas_unit(y, x);
+	static std::vector<int> batch;
+	batch.clear();
+	for (int ty = t.min.y; ty <= t.max.y; ty++) {
+		for (int tx = t.min.x; tx <= t.max.x; tx++) {
+			int index = ty*columns + tx;
+			if (!canvas.tiles[index]) continue;
+			if (!gpu_brush.stale.empty() && gpu_brush.stale[index]) continue;
+			if (!take_tile_layer(index)) {
+				// shown once it gets one, when the view changes
+				if (!tile_layers.hidden[index]) tile_layers.hidden_list.push_back(index);
+				tile_layers.hidden[index] = 1;
+				continue;
 			}
+			batch.push_back(index);
+			if (batch.size() == UPLOAD_TILES) {
+				upload_tiles(batch);
+				batch.clear();
+			}
+		}
+	}
+	upload_tiles(batch);
+
+	upload_pages(t);
+}
+
+// The page table has one texel per canvas tile and is bound to unit 2; the
+// layer array starts small and doubles whenever more tiles get painted
+void allocate_canvas_texture() {
+	glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &tile_layers.max_layers);
+	glGenTextures(1, &tile_layers.pages);
+	glActiveTexture(GL_TEXTURE2);
+	glBindTexture(GL_TEXTURE_2D, tile_layers.pages);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R32I, canvas.tiles_count.x, canvas.tiles_count.y, 0, GL_RED_INTEGER, GL_INT, NULL);
+
+	int capacity = INITIAL_TILE_LAYERS;
+	while (capacity < (int)canvas.resident) capacity *= 2;
+	allocate_tile_layers(std::min(capacity, tile_layers.max_layers));
+	create_unpack_ring();
+	upload_canvas();
+}
+
+// Rebuilds the mip levels of the tiles whose level 0 changed. Closer than
+// 1:1 only level 0 is sampled, so they stay stale until the view zooms out,
+// and so do the ones out of view until they come into it.
+// Tiles the CPU has are reduced on the pool and uploaded level by level;
+// the ones the GPU brush painted since the last readback are reduced on the
+// GPU by blits from level to level. Once most layers changed, one
+// glGenerateMipmap over all of them is cheaper.
+void update_mips() {
+	TileLayers &t = tile_layers;
+	if (t.mips_list.empty() || view_zoom() >= 1) return;
+	PROFILE_SCOPE("mips");
+	GPU_PROFILE_SCOPE("gpu mips");
+	static std::vector<int> cpu, gpu;
+	cpu.clear();
+	gpu.clear();
+	Rect v = visible_tiles();
+	size_t kept = 0;
+	for (int index : t.mips_list) {
+		if (!tile_visible(index, v)) {
+			t.mips_list[kept++] = index;
+			continue;
 		}
+		t.mips_stale[index] = 0;
+		if (t.layer_of[index] < 0) continue;
+		bool painted = !gpu_brush.stale.empty() && gpu_brush.stale[index];
+		if (painted || !canvas.tiles[index]) gpu.push_back(index);
+		else cpu.push_back(index);
+	}
+	t.mips_list.resize(kept);
+	glActiveTexture(GL_TEXTURE0);
+	if ((cpu.size() + gpu.size())*2 > (size_t)(t.capacity - t.free_layers.size())) {
+		glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+		t.mips_full++;
 		return;
 	}
 
-	int dy = fabsf(start.y - end.y);
-	int dx = fabsf(start.x - end.x);
-	Vec2i dir = {
-		end.x > start.x ? 1 : -1,
-		end.y > start.y ? 1 : -1
-	};
-	if (dy < dx) {
-		float pk = 2*dy - dx;
-		int y = start.y;
-		for (int x = start.x; x != end.x; x += dir.x) {
-			int step_y = pk < 0 ? 0 : 1;
-			y += step_y*dir.y;
-			pk = pk + 2*dy - 2*dx*step_y;
-			for (int h = -brush_r; h <= brush_r; h++) {
-				int y2 = y + h;
-				change_canvas_unit(y2, x);
+	int pixels = mip_chain_pixels(TILE_SIZE);
+	static std::vector<uint32_t> chains;
+	chains.resize(cpu.size() * pixels);
+	parallel_for(cpu.size(), [&](int k) {
+		build_mip_chain((const uint32_t *)canvas.tiles[cpu[k]], TILE_SIZE, &chains[k*pixels]);
+	});
+	for (size_t k = 0; k < cpu.size(); k++) {
+		const uint32_t *level = &chains[k*pixels];
+		for (int l = 1, side = TILE_SIZE / 2; l < t.levels; l++, side /= 2) {
+			glTexSubImage3D(GL_TEXTURE_2D_ARRAY, l, 0, 0, t.layer_of[cpu[k]], side, side, 1, GL_RGBA, GL_UNSIGNED_BYTE, level);
+			level += side*side;
+		}
+	}
+	t.mips_built += cpu.size();
+
+	if (gpu.empty()) return;
+	if (!t.mip_fbos[0]) glGenFramebuffers(2, t.mip_fbos);
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, t.mip_fbos[0]);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, t.mip_fbos[1]);
+	for (int index : gpu) {
+		for (int l = 1, side = TILE_SIZE; l < t.levels; l++, side /= 2) {
+			glFramebufferTextureLayer(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, canvas.texture, l - 1, t.layer_of[index]);
+			glFramebufferTextureLayer(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, canvas.texture, l, t.layer_of[index]);
+			// every destination texel center falls between 4 source texels
+			glBlitFramebuffer(0, 0, side, side, 0, 0, side / 2, side / 2, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+		}
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	t.mips_blitted += gpu.size();
+}
+
+void update_page(int index) {
+	glActiveTexture(GL_TEXTURE2);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, index % canvas.tiles_count.x, index / canvas.tiles_count.x, 1, 1,
+			GL_RED_INTEGER, GL_INT, &tile_layers.layer_of[index]);
+	glActiveTexture(GL_TEXTURE0);
+}
+
+// Completes the readback in flight, if any, copying the tiles into the
+// canvas. Without wait it gives up when the GPU isn't done yet.
+bool gpu_brush_finish_readback(bool wait) {
+	if (!gpu_brush.fence) return true;
+	if (glClientWaitSync(gpu_brush.fence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+		if (!wait) return false;
+		gpu_brush.waits++;
+		glClientWaitSync(gpu_brush.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+	}
+	glDeleteSync(gpu_brush.fence);
+	gpu_brush.fence = 0;
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, gpu_brush.pack);
+	unsigned char *src = (unsigned char *)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0,
+			gpu_brush.reading.size() * sizeof(Tile), GL_MAP_READ_BIT);
+	for (size_t k = 0; k < gpu_brush.reading.size(); k++) {
+		int index = gpu_brush.reading[k];
+		memcpy(canvas.tiles[index], src + k * sizeof(Tile), sizeof(Tile));
+		memcpy(canvas_tile(index), src + k * sizeof(Tile), sizeof(Tile));
+		gpu_brush.stale[index] = 0;
+	}
+	glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	gpu_brush.reading.clear();
+	return true;
+}
+
+// Queues glReadPixels of every stale tile into the pack buffer; the copy
+// into the canvas happens in gpu_brush_finish_readback
+void gpu_brush_begin_readback() {
+	if (gpu_brush.fence || gpu_brush.stale_list.empty()) return;
+	GLsizeiptr bytes = gpu_brush.stale_list.size() * sizeof(Tile);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, gpu_brush.pack);
+	if (bytes > gpu_brush.pack_size) {
+		glBufferData(GL_PIXEL_PACK_BUFFER, bytes, NULL, GL_STREAM_READ);
+		gpu_brush.pack_size = bytes;
+	}
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, gpu_brush.fbo);
+	for (size_t k = 0; k < gpu_brush.stale_list.size(); k++) {
+		int layer = tile_layers.layer_of[gpu_brush.stale_list[k]];
+		glFramebufferTextureLayer(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, canvas.texture, 0, layer);
+		glReadPixels(0, 0, TILE_SIZE, TILE_SIZE, GL_RGBA, GL_UNSIGNED_BYTE, (void*)(k * sizeof(Tile)));
+	}
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	gpu_brush.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	gpu_brush.reading.swap(gpu_brush.stale_list);
+	gpu_brush.stale_list.clear();
+	gpu_brush.readbacks++;
+}
+
+// sync_hook: brings every tile painted on the GPU back to the canvas
+void gpu_brush_sync() {
+	gpu_brush_finish_readback(true);
+	gpu_brush_begin_readback();
+	gpu_brush_finish_readback(true);
+}
+
+// Tiles in hits, sorted by tile, that have no layer yet
+int tiles_without_layer(const std::vector<std::pair<int, int>> &hits) {
+	int missing = 0;
+	for (size_t k = 0; k < hits.size(); k++) {
+		if ((k == 0 || hits[k].first != hits[k - 1].first) && tile_layers.layer_of[hits[k].first] < 0) missing++;
+	}
+	return missing;
+}
+
+// raster_hook: draws each segment into every tile its capsule can reach,
+// one instanced draw per tile with the segments in queue order. The layers
+// are displayed flattened, so with more than one the CPU paints instead, as
+// it does for edges blended in linear light.
+void gpu_brush_raster(std::vector<StrokeSegment> &segments) {
+	if (!canvas_is_flat() || (stroke_antialias && linear_blending)) {
+		sync_canvas();
+		raster_segments(segments);
+		return;
+	}
+	GPU_PROFILE_SCOPE("gpu raster");
+	gpu_brush_finish_readback(true);
+	upload_canvas();
+
+	int columns = canvas.tiles_count.x;
+	static std::vector<std::pair<int, int>> hits;
+	hits.clear();
+	for (size_t i = 0; i < segments.size(); i++) {
+		StrokeSegment &s = segments[i];
+		int pad = s.radius + 1;
+		int x0 = clamp(std::min(s.a.x, s.b.x) - pad, 0, canvas.size.width - 1);
+		int x1 = clamp(std::max(s.a.x, s.b.x) + pad, 0, canvas.size.width - 1);
+		int y0 = clamp(std::min(s.a.y, s.b.y) - pad, 0, canvas.size.height - 1);
+		int y1 = clamp(std::max(s.a.y, s.b.y) + pad, 0, canvas.size.height - 1);
+		if (std::max(s.a.x, s.b.x) + pad < 0 || std::min(s.a.x, s.b.x) - pad >= canvas.size.width) continue;
+		if (std::max(s.a.y, s.b.y) + pad < 0 || std::min(s.a.y, s.b.y) - pad >= canvas.size.height) continue;
+		for (int ty = y0 / TILE_SIZE; ty <= y1 / TILE_SIZE; ty++) {
+			for (int tx = x0 / TILE_SIZE; tx <= x1 / TILE_SIZE; tx++) {
+				hits.push_back({ ty*columns + tx, (int)i });
 			}
 		}
+	}
+	if (hits.empty()) return;
+	std::stable_sort(hits.begin(), hits.end(),
+			[](const std::pair<int, int> &l, const std::pair<int, int> &r) { return l.first < r.first; });
+
+	// growing uploads every layer again from the tiles
+	if (grow_tile_layers(tiles_without_layer(hits))) upload_canvas();
+	if (tiles_without_layer(hits) > (int)tile_layers.free_layers.size()) evict_tile_layers();
+	// a tile left without a layer couldn't be painted here, so the CPU
+	// paints the whole batch instead
+	if (tiles_without_layer(hits) > (int)tile_layers.free_layers.size()) {
+		if (!tile_layers.overflow_reported) printf("Canvas has more than %d painted tiles; the GPU brush paints on the CPU\n", tile_layers.capacity);
+		tile_layers.overflow_reported = true;
+		sync_canvas();
+		raster_segments(segments);
+		return;
+	}
+
+	static std::vector<BrushInstance> instances;
+	instances.clear();
+	for (std::pair<int, int> &hit : hits) {
+		StrokeSegment &s = segments[hit.second];
+		instances.push_back({ { (float)s.a.x, (float)s.a.y, (float)s.b.x, (float)s.b.y }, (float)s.radius, s.color });
+	}
+
+	GLint program, vao;
+	glGetIntegerv(GL_CURRENT_PROGRAM, &program);
+	glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &vao);
+	gpu_brush.program->use();
+	glUniform1i(gpu_brush.loc_antialias, stroke_antialias);
+	glBindVertexArray(gpu_brush.vao);
+	glBindBuffer(GL_ARRAY_BUFFER, gpu_brush.instances);
+	glBufferData(GL_ARRAY_BUFFER, instances.size() * sizeof(BrushInstance), instances.data(), GL_STREAM_DRAW);
+	glBindFramebuffer(GL_FRAMEBUFFER, gpu_brush.fbo);
+	glViewport(0, 0, TILE_SIZE, TILE_SIZE);
+	if (stroke_antialias) {
+		glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
 	} else {
-		float pk = 2*dx - dy;
-		int x = start.x;
-		for (int y = start.y; y != end.y; y += dir.y) {
- 			int step_x = pk < 0 ? 0 : 1;
-			x += step_x*dir.x;
-			pk = pk - 2*dy*step_x + 2*dx;
-			for (int w = -brush_r; w <= brush_r; w++) {
-				int x2 = x + w;
-				change_canvas_unit(y, x2);
-			}
+		glDisable(GL_BLEND);
+	}
+
+	for (size_t first = 0, last; first < hits.size(); first = last) {
+		int index = hits[first].first;
+		for (last = first + 1; last < hits.size() && hits[last].first == index; last++);
+
+		bool fresh = tile_layers.layer_of[index] < 0;
+		if (fresh) {
+			take_tile_layer(index); // there is one, counted above
+			update_page(index);
+		}
+		int layer = tile_layers.layer_of[index];
+		// a tile that changed out of view has an outdated layer, if any
+		bool refresh = fresh || tile_layers.hidden[index];
+		if (tile_layers.hidden[index]) {
+			composite_tile(index);
+			tile_layers.hidden[index] = 0;
+		}
+		bool resident = canvas.tiles[index] != nullptr;
+		canvas_tile(index);
+		flat_tile(index);
+		glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, canvas.texture, 0, layer);
+		if (refresh && resident) {
+			glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, layer, TILE_SIZE, TILE_SIZE, 1, GL_RGBA, GL_UNSIGNED_BYTE, canvas.tiles[index]);
+		} else if (refresh) {
+			GLfloat transparent[4] = { 0, 0, 0, 0 };
+			glClearBufferfv(GL_COLOR, 0, transparent);
 		}
+
+		size_t offset = first * sizeof(BrushInstance);
+		glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, sizeof(BrushInstance), (void*)offset);
+		glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, sizeof(BrushInstance), (void*)(offset + offsetof(BrushInstance, radius)));
+		glVertexAttribPointer(2, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(BrushInstance), (void*)(offset + offsetof(BrushInstance, color)));
+		glUniform2f(gpu_brush.loc_tile_origin, index % columns * TILE_SIZE, index / columns * TILE_SIZE);
+		glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, last - first);
+		gpu_brush.draws++;
+
+		if (!gpu_brush.stale[index]) {
+			gpu_brush.stale[index] = 1;
+			gpu_brush.stale_list.push_back(index);
+		}
+		mark_mips(index);
+		Rect r = tile_rect(index);
+		touch_tile(r.min.y, r.min.x);
 	}
+
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glViewport(0, 0, window_size.width, window_size.height);
+	glBindVertexArray(vao);
+	glUseProgram(program);
 }
 
-void update_canvas(double x, double y) {
-	float side = canvas.scale * CANVAS_WIDTH;
-	y = y - (window_size.height - side);
-	int row    = y / side * canvas.size.height;
-	int column = x / side * canvas.size.width;
+void set_gpu_brush(bool enabled) {
+	flush_strokes();
+	sync_canvas();
+	if (enabled && !gpu_brush.program) {
+		gpu_brush.program = new Shader("brush", brush_vert_source, brush_frag_source);
+		gpu_brush.loc_tile_origin = glGetUniformLocation(gpu_brush.program->id, "tile_origin");
+		gpu_brush.loc_tile_size = glGetUniformLocation(gpu_brush.program->id, "tile_size");
+		gpu_brush.loc_antialias = glGetUniformLocation(gpu_brush.program->id, "antialias");
+		GLint program;
+		glGetIntegerv(GL_CURRENT_PROGRAM, &program);
+		gpu_brush.program->use();
+		glUniform1f(gpu_brush.loc_tile_size, TILE_SIZE);
+		glUseProgram(program);
+
+		GLint vao;
+		glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &vao);
+		glGenVertexArrays(1, &gpu_brush.vao);
+		glBindVertexArray(gpu_brush.vao);
+		glGenBuffers(1, &gpu_brush.instances);
+		for (int i = 0; i < 3; i++) {
+			glEnableVertexAttribArray(i);
+			glVertexAttribDivisor(i, 1);
+		}
+		glBindVertexArray(vao);
+		glGenFramebuffers(1, &gpu_brush.fbo);
+		glGenBuffers(1, &gpu_brush.pack);
+	}
+	gpu_brush.stale.assign(canvas.tiles.size(), 0);
+	gpu_brush.enabled = enabled;
+	raster_hook = enabled ? gpu_brush_raster : NULL;
+	sync_hook = enabled ? gpu_brush_sync : NULL;
+	printf("Brush backend: %s\n", enabled ? "GPU" : "CPU");
+}
 
-	int pk = 1 - brush_r;
-	int max = (float)brush_r/1.414214;
-	max = 2*max + 2;
-	Vec2i point = { 0, brush_r };
-	Vec2i points[max] = { 0, brush_r };
-	int ix = 0;
-	while (point.x < point.y) {
-		//printf("%2d  pk = %3d  ", ix, pk);
-		point.x++;
-		if (pk < 0) {
-			pk = pk + 2*point.x + 1;
-		} else {
-			point.y--;
-			pk = pk + 2*point.x + 1 - 2*point.y;
-		}
-		//printf("2x = %2d  2y = %2d\n", 2*point.x, 2*point.y);
-		ix++;
-		points[ix] = point;
-	}
-	int c = 3;
-	if (point.x == point.y) {
-		max--;
-		c = 2;
-	}
-	//printf("ix = %d  max = %d\n", ix, max);
-	for (int i = ix+1; i-c >= 0; i++) {
-		//printf("%2d -> %2d\n", i-c, i);
-		points[i].x = points[i-c].y;
-		points[i].y = points[i-c].x;
-		c += 2;
-	}
-	ix = 0;
-	while (ix < max) {
-		//printf("[%2d] %d, %d\n", ix, points[ix].x, points[ix].y);
-		for (int i = points[ix].y; i >= -points[ix].y; i--) {
-			Vec2i p = { column + points[ix].x, row + i };
-			change_canvas_unit(p.y, p.x);
-			p.x = column - points[ix].x;
-			change_canvas_unit(p.y, p.x);
-		}
-		ix++;
-	}
-
-	//if (fabsf(column - last_pix.x) > 1 || fabsf(row - last_pix.y) > 1) {
-		join_points(canvas.history.coords[1] /*last_pix*/, (Vec2i){ column, row });
-		canvas.history.coords[0] /*last_pix*/ = { column, row };
-	//}
-	//change_canvas_unit(row, column);
-
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, canvas.size.width, canvas.size.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, canvas.colors);
-	glGenerateMipmap(GL_TEXTURE_2D);
+uint32_t pack_active_color() {
+	return pack_color(active_color.rgb);
+}
+
+void record_event(int type, double x, double y, int code, int scancode, int action, int mods) {
+	if (!journal.recording) return;
+	journal_record({
+		glfwGetTime() - journal.start, (float)x, (float)y,
+		(int16_t)code, (int16_t)scancode,
+		(uint8_t)type, (uint8_t)action, (uint8_t)mods, (uint8_t)active_tool,
+		(uint16_t)brush_r, pack_active_color()
+	});
+}
+
+// A new stroke, or none on a release
+void reset_prediction(bool stroke) {
+	prediction.count = 0;
+	if (stroke && prediction.measuring) prediction.paths.emplace_back();
+}
+
+void predict_sample(Vec2 p, double time) {
+	StrokePrediction &s = prediction;
+	s.samples[2] = s.samples[1];
+	s.samples[1] = s.samples[0];
+	s.samples[0] = { p, time };
+	s.count = std::min(s.count + 1, 3);
+	if (s.measuring && !s.paths.empty()) s.paths.back().push_back(s.samples[0]);
+}
+
+// Where the pointer will be dt after the newest sample, at the velocity and
+// acceleration of the last three. The tail is kept within twice the length
+// the velocity alone gives, so a jittery sample can't fling it.
+Vec2 extrapolate(double dt) {
+	StrokeSample *s = prediction.samples;
+	Vec2 p = s[0].p;
+	double span = s[0].time - s[1].time;
+	if (prediction.count < 2 || span < 1e-4) return p;
+	double vx = (s[0].p.x - s[1].p.x) / span, vy = (s[0].p.y - s[1].p.y) / span, ax = 0, ay = 0;
+	double before = s[1].time - s[2].time;
+	if (prediction.count == 3 && before >= 1e-4) {
+		double half = (s[0].time - s[2].time) / 2;
+		ax = (vx - (s[1].p.x - s[2].p.x) / before) / half;
+		ay = (vy - (s[1].p.y - s[2].p.y) / before) / half;
+	}
+	double dx = vx*dt + ax*dt*dt/2, dy = vy*dt + ay*dt*dt/2;
+	double length = sqrt(dx*dx + dy*dy), limit = 2*sqrt(vx*vx + vy*vy)*dt;
+	if (length > limit) {
+		dx *= limit / length;
+		dy *= limit / length;
+	}
+	return { (float)(p.x + dx), (float)(p.y + dy) };
+}
+
+// Draws the tail of the stroke in progress, if any, from the end of the
+// real stroke to where the pointer should be when this frame is shown
+void draw_stroke_tail() {
+	StrokePrediction &s = prediction;
+	if (active_ui_element != CANVAS || active_tool != BUTTON_BRUSH || s.count < 1) return;
+	s.tip = s.samples[0].p;
+	// a pointer that stopped gets no tail
+	if (s.count < 2 || glfwGetTime() - s.samples[0].time > PREDICT_MAX_LEAD) return;
+	double dt = std::min(s.lead, PREDICT_MAX_LEAD);
+	s.tip = extrapolate(dt);
+	if (!s.enabled) return;
+
+	BrushInstance pieces[PREDICT_PIECES];
+	Vec2i start = canvas.history.coords[0]; // where the real stroke ends
+	Vec2 from = { (float)start.x, (float)start.y };
+	for (int i = 0; i < PREDICT_PIECES; i++) {
+		Vec2 to = extrapolate(dt * (i + 1) / PREDICT_PIECES);
+		pieces[i] = { { from.x, from.y, floorf(to.x), floorf(to.y) }, (float)brush_r, pack_active_color() };
+		from = { floorf(to.x), floorf(to.y) };
+	}
+	CanvasView &v = canvas_view;
+	s.program->use();
+	glUniformMatrix4fv(s.loc_projection, 1, GL_FALSE, glm::value_ptr(projection));
+	glUniform2f(s.loc_canvas_origin, v.corner.x, v.corner.y - v.scale.y * CANVAS_HEIGHT);
+	glUniform2f(s.loc_canvas_scale, v.scale.x * CANVAS_WIDTH / canvas.size.width, v.scale.y * CANVAS_HEIGHT / canvas.size.height);
+	glUniform1i(s.loc_antialias, stroke_antialias);
+	GLint vao;
+	glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &vao);
+	glBindVertexArray(s.vao);
+	glBindBuffer(GL_ARRAY_BUFFER, s.instances);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(pieces), pieces, GL_STREAM_DRAW);
+	glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, sizeof(BrushInstance), (void*)0);
+	glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, sizeof(BrushInstance), (void*)offsetof(BrushInstance, radius));
+	glVertexAttribPointer(2, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(BrushInstance), (void*)offsetof(BrushInstance, color));
+	glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, PREDICT_PIECES);
+	glBindVertexArray(vao);
+}
+
+// After the swap: learns how old the newest sample is by the time a frame
+// is shown, which is how far ahead the next tails reach
+void stroke_frame_presented() {
+	StrokePrediction &s = prediction;
+	if (active_ui_element != CANVAS || active_tool != BUTTON_BRUSH || s.count < 1) return;
+	if (s.measuring) glFinish();
+	double present = glfwGetTime(), age = present - s.samples[0].time;
+	if (age < 2*PREDICT_MAX_LEAD) s.lead += (age - s.lead) * 0.1;
+	if (s.measuring && !s.paths.empty()) s.frames.push_back({ present, s.samples[0].p, s.tip, (int)s.paths.size() - 1 });
+}
+
+// How long ago the pointer was where tip is, searching the path of the
+// stroke back from the present along the segments between samples; also
+// how far tip is from where the pointer is at present. False when the path
+// doesn't reach past present, so that isn't known.
+bool shown_lag(const std::vector<StrokeSample> &path, double present, Vec2 tip, double *lag, double *error) {
+	size_t next = 0;
+	while (next < path.size() && path[next].time <= present) next++;
+	if (next == 0 || next == path.size()) return false;
+	const StrokeSample &a = path[next - 1], &b = path[next];
+	double f = (present - a.time) / (b.time - a.time);
+	StrokeSample now = { { (float)(a.p.x + (b.p.x - a.p.x)*f), (float)(a.p.y + (b.p.y - a.p.y)*f) }, present };
+	*error = hypot(tip.x - now.p.x, tip.y - now.p.y);
+	double best = INFINITY;
+	const StrokeSample *to = &now;
+	for (size_t i = next; i-- > 0 && path[i].time >= present - LATENCY_WINDOW; to = &path[i]) {
+		const StrokeSample &from = path[i];
+		double dx = to->p.x - from.p.x, dy = to->p.y - from.p.y, len2 = dx*dx + dy*dy;
+		double t = len2 > 0 ? std::min(std::max(((tip.x - from.p.x)*dx + (tip.y - from.p.y)*dy) / len2, 0.0), 1.0) : 0;
+		double distance = hypot(from.p.x + dx*t - tip.x, from.p.y + dy*t - tip.y);
+		if (distance < best) {
+			best = distance;
+			*lag = present - (from.time + (to->time - from.time)*t);
+		}
+	}
+	return best < INFINITY;
+}
+
+void report_latency() {
+	StrokePrediction &s = prediction;
+	std::vector<double> lags[2], errors[2];
+	for (LatencyFrame &f : s.frames) {
+		double lag, error;
+		if (!shown_lag(s.paths[f.stroke], f.present, f.last, &lag, &error)) continue;
+		lags[0].push_back(lag);
+		errors[0].push_back(error);
+		shown_lag(s.paths[f.stroke], f.present, f.predicted, &lag, &error);
+		lags[1].push_back(lag);
+		errors[1].push_back(error);
+	}
+	if (lags[0].empty()) {
+		printf("[latency] No stroke frames to measure\n");
+		return;
+	}
+	const char *names[2] = { "without prediction", "with prediction" };
+	printf("[latency] %zu stroke frames, input to swap; the tail was %s\n", lags[0].size(), s.enabled ? "shown" : "off");
+	for (int k = 0; k < 2; k++) {
+		std::sort(lags[k].begin(), lags[k].end());
+		double mean = 0, off = 0;
+		for (size_t i = 0; i < lags[k].size(); i++) {
+			mean += lags[k][i] / lags[k].size();
+			off += errors[k][i] / lags[k].size();
+		}
+		printf("[latency] %-18s  mean %5.1f ms  p50 %5.1f ms  p95 %5.1f ms  %5.1f px from the pointer\n", names[k],
+				mean*1e3, lags[k][lags[k].size()/2]*1e3, lags[k][lags[k].size()*95/100]*1e3, off);
+	}
+}
+
+void create_tail_program() {
+	StrokePrediction &s = prediction;
+	s.program = new Shader("tail", tail_vert_source, tail_frag_source);
+	s.loc_projection = glGetUniformLocation(s.program->id, "projection");
+	s.loc_canvas_origin = glGetUniformLocation(s.program->id, "canvas_origin");
+	s.loc_canvas_scale = glGetUniformLocation(s.program->id, "canvas_scale");
+	s.loc_antialias = glGetUniformLocation(s.program->id, "antialias");
+	GLint vao;
+	glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &vao);
+	glGenVertexArrays(1, &s.vao);
+	glBindVertexArray(s.vao);
+	glGenBuffers(1, &s.instances);
+	for (int i = 0; i < 3; i++) {
+		glEnableVertexAttribArray(i);
+		glVertexAttribDivisor(i, 1);
+	}
+	glBindVertexArray(vao);
+}
+
+Vec2 selection_size() {
+	Rect &r = selection.rect;
+	return { (float)(r.max.x - r.min.x + 1), (float)(r.max.y - r.min.y + 1) };
+}
+
+// Canvas position of a corner of the selection under t
+Vec2 selection_corner(const SelectionTransform &t, int corner) {
+	Vec2 size = selection_size();
+	float x = (corner & 1 ? 0.5f : -0.5f) * size.width * t.scale.x, y = (corner & 2 ? 0.5f : -0.5f) * size.height * t.scale.y;
+	float c = cosf(t.angle), s = sinf(t.angle);
+	return { t.center.x + c*x - s*y, t.center.y + s*x + c*y };
+}
+
+// What a drag starting at p, in canvas pixels, does to the selection; the
+// grips are sized in window pixels
+int selection_hit(Vec2 p, int *corner) {
+	SelectionTransform &t = selection.transform;
+	float best = INFINITY, zoom = view_zoom();
+	for (int k = 0; k < 4; k++) {
+		Vec2 q = selection_corner(t, k);
+		float distance = hypotf(p.x - q.x, p.y - q.y) * zoom;
+		if (distance < best) {
+			best = distance;
+			*corner = k;
+		}
+	}
+	if (best <= SELECT_HANDLE_PX + 1) return SELECT_SCALE;
+	Vec2 size = selection_size();
+	float c = cosf(t.angle), s = sinf(t.angle), dx = p.x - t.center.x, dy = p.y - t.center.y;
+	float x = (c*dx + s*dy) / t.scale.x, y = (c*dy - s*dx) / t.scale.y;
+	if (fabsf(x) <= size.width / 2 && fabsf(y) <= size.height / 2) return SELECT_MOVE;
+	if (best <= SELECT_ROTATE_PX) return SELECT_ROTATE;
+	return SELECT_MARK;
+}
+
+// Takes the marked pixels off the layer and into the preview texture
+void lift_selected() {
+	Selection &s = selection;
+	if (s.floating) return;
+	lift_selection(s.rect, s.lifted);
+	s.rect = s.lifted.from;
+	s.transform = selection_identity(s.rect);
+	s.floating = true;
+	GLint max_size;
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+	s.textured = s.lifted.width <= max_size && s.lifted.height <= max_size;
+	if (!s.textured) printf("Selection is larger than %d pixels, only its outline is shown\n", max_size);
+	if (!s.texture) glGenTextures(1, &s.texture);
+	glActiveTexture(GL_TEXTURE4);
+	glBindTexture(GL_TEXTURE_2D, s.texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	if (s.textured) {
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, s.lifted.width, s.lifted.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, s.lifted.pixels.data());
+	}
+	glActiveTexture(GL_TEXTURE0);
+}
+
+// Resamples the floating pixels into the active layer, or back where they
+// came from without apply, as one undo step with the lift, and drops the
+// selection. Only the tiles the stamp wrote are uploaded, a run of one
+// tile row at a time, instead of their bounding box.
+void put_down_selection(bool apply) {
+	Selection &s = selection;
+	if (s.floating) {
+		SelectionTransform t = apply ? s.transform : selection_identity(s.lifted.from);
+		upload_canvas();
+		std::vector<int> written = stamp_selection(s.lifted, t, apply ? s.filter : RESAMPLE_NEAREST);
+		int columns = canvas.tiles_count.x;
+		for (size_t k = 0, end; k < written.size(); k = end) {
+			for (end = k + 1; end < written.size() && written[end] == written[end - 1] + 1 && written[end] % columns; end++);
+			canvas.dirty = { tile_rect(written[k]).min, tile_rect(written[end - 1]).max };
+			upload_canvas();
+		}
+		commit_selection();
+		std::vector<uint32_t>().swap(s.lifted.pixels);
+		s.floating = false;
+	}
+	s.active = false;
+	s.drag = SELECT_IDLE;
+	damage.canvas = true;
+}
+
+void press_selection(Vec2 p) {
+	Selection &s = selection;
+	s.drag = s.active ? selection_hit(p, &s.corner) : SELECT_MARK;
+	s.grab = p;
+	if (s.drag == SELECT_MARK) {
+		put_down_selection(true);
+		s.drag = SELECT_MARK;
+		s.active = true;
+		s.rect = { { (int)floorf(p.x), (int)floorf(p.y) }, { (int)floorf(p.x), (int)floorf(p.y) } };
+		s.transform = selection_identity(s.rect);
+	} else {
+		lift_selected();
+	}
+	s.grabbed = s.transform;
+	damage.canvas = true;
+}
+
+void drag_selection(Vec2 p) {
+	Selection &s = selection;
+	SelectionTransform &t = s.transform, &g = s.grabbed;
+	switch (s.drag) {
+		case SELECT_MARK: {
+			int x0 = floorf(std::min(s.grab.x, p.x)), x1 = floorf(std::max(s.grab.x, p.x));
+			int y0 = floorf(std::min(s.grab.y, p.y)), y1 = floorf(std::max(s.grab.y, p.y));
+			x0 = clamp(x0, 0, canvas.size.width - 1);
+			y0 = clamp(y0, 0, canvas.size.height - 1);
+			s.rect = { { x0, y0 }, { clamp(x1, x0, std::min(canvas.size.width - 1, x0 + RESAMPLE_MAX - 1)),
+					clamp(y1, y0, std::min(canvas.size.height - 1, y0 + RESAMPLE_MAX - 1)) } };
+			t = selection_identity(s.rect);
+			break;
+		}
+		case SELECT_MOVE:
+			// whole pixels, so a plain move doesn't resample
+			t.center = { g.center.x + roundf(p.x - s.grab.x), g.center.y + roundf(p.y - s.grab.y) };
+			break;
+		case SELECT_SCALE: {
+			Vec2 anchor = selection_corner(g, 3 - s.corner), size = selection_size();
+			float c = cosf(g.angle), sn = sinf(g.angle), dx = p.x - anchor.x, dy = p.y - anchor.y;
+			float w = s.corner & 1 ? size.width : -size.width, h = s.corner & 2 ? size.height : -size.height;
+			float sx = (c*dx + sn*dy) / w, sy = (c*dy - sn*dx) / h;
+			// at least a pixel across
+			if (fabsf(sx*w) < 1) sx = sx < 0 ? -1 / fabsf(w) : 1 / fabsf(w);
+			if (fabsf(sy*h) < 1) sy = sy < 0 ? -1 / fabsf(h) : 1 / fabsf(h);
+			t.scale = { sx, sy };
+			t.center = { anchor.x + (c*sx*w - sn*sy*h) / 2, anchor.y + (sn*sx*w + c*sy*h) / 2 };
+			break;
+		}
+		case SELECT_ROTATE:
+			t.angle = g.angle + atan2f(p.y - g.center.y, p.x - g.center.x) - atan2f(s.grab.y - g.center.y, s.grab.x - g.center.x);
+			break;
+		default:
+			return;
+	}
+	damage.canvas = true;
+}
+
+// Draws the selection over the canvas: the floating pixels, if any, and
+// the outline with its handles
+void draw_selection() {
+	Selection &s = selection;
+	if (!s.active) return;
+	CanvasView &v = canvas_view;
+	SelectionTransform &t = s.transform;
+	Vec2 size = selection_size();
+	float c = cosf(t.angle), sn = sinf(t.angle), hx = t.scale.x * size.width / 2, hy = t.scale.y * size.height / 2;
+	s.program->use();
+	glUniformMatrix4fv(s.loc_projection, 1, GL_FALSE, glm::value_ptr(projection));
+	glUniform2f(s.loc_canvas_origin, v.corner.x, v.corner.y - v.scale.y * CANVAS_HEIGHT);
+	glUniform2f(s.loc_canvas_scale, v.scale.x * CANVAS_WIDTH / canvas.size.width, v.scale.y * CANVAS_HEIGHT / canvas.size.height);
+	glUniform2f(s.loc_center, t.center.x, t.center.y);
+	glUniform2f(s.loc_axis_x, c*hx, sn*hx);
+	glUniform2f(s.loc_axis_y, -sn*hy, c*hy);
+	glUniform1f(s.loc_grow, SELECT_HANDLE_PX + 1);
+	glUniform1f(s.loc_handle, SELECT_HANDLE_PX);
+	glUniform1i(s.loc_lifted, s.floating && s.textured);
+	if (s.floating && s.textured) {
+		// the GPU has no bicubic lookup; the preview of that one is bilinear
+		GLint filter = s.filter == RESAMPLE_NEAREST ? GL_NEAREST : GL_LINEAR;
+		glActiveTexture(GL_TEXTURE4);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+		glActiveTexture(GL_TEXTURE0);
+	}
+	GLint vao;
+	glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &vao);
+	glBindVertexArray(s.vao);
+	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	glBindVertexArray(vao);
+}
+
+void create_select_program() {
+	Selection &s = selection;
+	s.program = new Shader("select", select_vert_source, select_frag_source);
+	s.loc_projection = glGetUniformLocation(s.program->id, "projection");
+	s.loc_canvas_origin = glGetUniformLocation(s.program->id, "canvas_origin");
+	s.loc_canvas_scale = glGetUniformLocation(s.program->id, "canvas_scale");
+	s.loc_center = glGetUniformLocation(s.program->id, "center");
+	s.loc_axis_x = glGetUniformLocation(s.program->id, "axis_x");
+	s.loc_axis_y = glGetUniformLocation(s.program->id, "axis_y");
+	s.loc_grow = glGetUniformLocation(s.program->id, "grow");
+	s.loc_lifted = glGetUniformLocation(s.program->id, "lifted");
+	s.loc_handle = glGetUniformLocation(s.program->id, "handle");
+	s.program->use();
+	glUniform1i(glGetUniformLocation(s.program->id, "pixels"), 4);
+	glGenVertexArrays(1, &s.vao);
+}
+
+// Keys that leave a selection as it is: its own, the view's, toggles that
+// only affect painting, and the modifiers of the shortcuts
+bool keeps_selection(int key) {
+	switch (key) {
+		case GLFW_KEY_ESCAPE:
+		case GLFW_KEY_ENTER:
+		case GLFW_KEY_KP_ENTER:
+		case GLFW_KEY_R:
+		case GLFW_KEY_I:
+		case GLFW_KEY_A:
+		case GLFW_KEY_HOME:
+		case GLFW_KEY_1:
+		case GLFW_KEY_P:
+		case GLFW_KEY_UP:
+		case GLFW_KEY_DOWN:
+			return true;
+	}
+	return key >= GLFW_KEY_LEFT_SHIFT && key <= GLFW_KEY_MENU;
+}
+
+// Pointer samples only queue a segment; they are rasterized together once
+// per frame by flush_strokes, however many events the mouse delivered
+void queue_stroke_sample(double x, double y) {
+	double canvas_x, canvas_y;
+	window_to_canvas(x, y, &canvas_x, &canvas_y);
+	int row    = canvas_y;
+	int column = canvas_x;
+
+	Vec2i start = canvas.history.coords[1];
+	if (start.x + start.y == -2) start = { column, row };
+	input.segments.push_back({ start, { column, row }, brush_r, pack_active_color() });
+	input.events++;
+	canvas.history.coords[0] = { column, row };
+	predict_sample({ (float)canvas_x, (float)canvas_y }, glfwGetTime());
+}
+
+// With --input-stats, how many pointer events each frame coalesced while painting
+void report_input_stats() {
+	double now = glfwGetTime();
+	if (now - input.report_time < 1.0) return;
+	if (input.reporting && input.events > 0) {
+		printf("[input] %4lu events in %3lu frames (%.1f per frame)  raster %.3f ms/frame\n",
+				input.events, input.frames, (double)input.events/input.frames,
+				input.raster_time*1000/input.frames);
+	}
+	input.events = 0;
+	input.frames = 0;
+	input.raster_time = 0;
+	input.report_time = now;
 }
 
 void calculate_selected_colors(float ang) {
-	ang *= 180.0/3.141593;
-	if (ang < 0) ang += 360;
-	float r = 0, g = 0, b = 0;
-	float f = ang/60.0;
-    if (ang < 60) {
-        r = 1;
-        g = f;
-    } else if (ang < 120) {
-        r = 2 - f;
-        g = 1;
-    } else if (ang < 180) {
-        g = 1;
-        b = f - 2;
-    } else if (ang < 240) {
-        g = 4 - f;
-        b = 1;
-    } else if (ang < 300) {
-        r = f - 4;
-        b = 1;
-    } else {
-        r = 1;
-        b = 6 - f;
-    }
-	wheel_color = { r, g, b };
-
-	float c = active_color.hsv.v * active_color.hsv.s;
-	float m = active_color.hsv.v - c;
-	active_color.rgb = {
-		c * wheel_color.r + m,
-		c * wheel_color.g + m,
-		c * wheel_color.b + m
-	};
+	wheel_color = hue_to_rgb(ang);
+	active_color.rgb = hsv_to_rgb(active_color.hsv);
 }
 
 void framebuffer_size_callback(GLFWwindow *window, int width, int height) {
+	if (journal.replaying && !journal.dispatching) return;
+	PROFILE_SCOPE("input");
+	record_event(JOURNAL_RESIZE, width, height, 0, 0, 0, 0);
+	damage.window = true;
 	glViewport(0, 0, width, height);
 	projection = glm::ortho(0.0f, (float)width, 0.0f, (float)height, 0.1f, 50.0f);
-	glUniformMatrix4fv(loc_projection, 1, GL_FALSE, glm::value_ptr(projection));
 	window_size.width = width;
 	window_size.height = height;
 
@@ -325,53 +1409,62 @@ void framebuffer_size_callback(GLFWwindow *window, int width, int height) {
 		scale.y = window_size.height/base_size.height;
 	}
 	canvas.scale = scale.x < scale.y ? scale.x : scale.y;
-
-	float radius = (float)COLOR_WHEEL_SIDE/2 * canvas.scale;
-	glUniform1f(loc_color_wheel_radius, radius);
-	glUniform2f(loc_color_wheel_center, window_size.width - radius, window_size.height - radius);
-}
-
-void undo() {
-	if (canvas.history.past > 0) {
-		canvas.history.past--;
-		canvas.history.future++;
-		int index = canvas.history.index - 2;
-		if (index < 0) index += HISTORY;
-		memcpy(canvas.colors, canvas.history.colors[index],
-				canvas.size.width * canvas.size.height * sizeof(Vec4uc));
-		canvas.history.index = (index + 1) % HISTORY;
-
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, canvas.size.width, canvas.size.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, canvas.colors);
-		glGenerateMipmap(GL_TEXTURE_2D);
-		printf("[fn undo] Past: %2d  Future: %2d  Index: %2d\n", canvas.history.past, canvas.history.future, canvas.history.index);
-	}
+	if (canvas_view.fitted) fit_view();
+	view_changed();
 }
 
-void redo() {
-	if (canvas.history.future > 0) {
-		canvas.history.future--;
-		canvas.history.past++;
-		int index = canvas.history.index;
-		memcpy(canvas.colors, canvas.history.colors[index],
-				canvas.size.width * canvas.size.height * sizeof(Vec4uc));
-		canvas.history.index = (index + 1) % HISTORY;
-
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, canvas.size.width, canvas.size.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, canvas.colors);
-		glGenerateMipmap(GL_TEXTURE_2D);
-		printf("[fn redo] Past: %2d  Future: %2d  Index: %2d\n", canvas.history.past, canvas.history.future, canvas.history.index);
-	}
+void print_layer() {
+	Layer &layer = active_layer();
+	printf("Layer %d/%zu  %s  %d%%%s\n", canvas.layer + 1, canvas.layers.size(),
+			blend_mode_names[layer.blend], (layer.opacity*100 + 127)/255, layer.visible ? "" : "  hidden");
 }
 
 void key_callback(GLFWwindow *window, int key, int scancode, int action, int mods) {
+	if (journal.replaying && !journal.dispatching) return;
+	PROFILE_SCOPE("input");
+	record_event(JOURNAL_KEY, 0, 0, key, scancode, action, mods);
 	if (action == GLFW_PRESS) {
+		if (selection.active && !keeps_selection(key)) put_down_selection(true);
 		switch (key) {
+			case GLFW_KEY_A:
+				if (mods == GLFW_MOD_SHIFT) {
+					flush_strokes();
+					linear_blending = !linear_blending;
+					printf("Blending: %s\n", linear_blending ? "linear" : "sRGB");
+					break;
+				}
+				stroke_antialias = !stroke_antialias;
+				printf("Antialiasing: %s\n", stroke_antialias ? "on" : "off");
+				break;
 			case GLFW_KEY_B:
 				active_tool = BUTTON_BRUSH;
-				glUniform1i(loc_active_tool, active_tool);
+				break;
+			case GLFW_KEY_E:
+				if (mods == GLFW_MOD_CONTROL) {
+					std::string path = (document.path.empty() ? std::string(DEFAULT_DOCUMENT) : document.path) + ".png";
+					export_png(path.c_str());
+				}
 				break;
 			case GLFW_KEY_F:
 				active_tool = BUTTON_BUCKET;
-				glUniform1i(loc_active_tool, active_tool);
+				break;
+			case GLFW_KEY_R:
+				active_tool = BUTTON_SELECT;
+				break;
+			case GLFW_KEY_I:
+				selection.filter = (selection.filter + 1) % RESAMPLE_FILTERS;
+				printf("Resampling: %s\n", resample_filter_names[selection.filter]);
+				damage.canvas = true;
+				break;
+			case GLFW_KEY_ENTER:
+			case GLFW_KEY_KP_ENTER:
+				put_down_selection(true);
+				break;
+			case GLFW_KEY_ESCAPE:
+				put_down_selection(false);
+				break;
+			case GLFW_KEY_G:
+				set_gpu_brush(!gpu_brush.enabled);
 				break;
 			case GLFW_KEY_N:
 				if (mods == GLFW_MOD_CONTROL) {
@@ -381,6 +1474,12 @@ void key_callback(GLFWwindow *window, int key, int scancode, int action, int mod
 			case GLFW_KEY_Q:
 				glfwSetWindowShouldClose(window, true);
 				break;
+			case GLFW_KEY_S:
+				if (mods == GLFW_MOD_CONTROL) {
+					std::string path = document.path.empty() ? std::string(DEFAULT_DOCUMENT) : document.path;
+					save_document(path.c_str());
+				}
+				break;
 			case GLFW_KEY_Y:
 				if (mods == GLFW_MOD_CONTROL) {
 					redo();
@@ -391,57 +1490,79 @@ void key_callback(GLFWwindow *window, int key, int scancode, int action, int mod
 					undo();
 				}
 				break;
+			case GLFW_KEY_L:
+				add_layer();
+				print_layer();
+				break;
+			case GLFW_KEY_PAGE_UP:
+				select_layer(canvas.layer + 1);
+				print_layer();
+				break;
+			case GLFW_KEY_PAGE_DOWN:
+				select_layer(canvas.layer - 1);
+				print_layer();
+				break;
+			case GLFW_KEY_M:
+				active_layer().blend = (active_layer().blend + 1) % BLEND_MODES;
+				layer_changed(canvas.layer);
+				print_layer();
+				break;
+			case GLFW_KEY_V:
+				active_layer().visible = !active_layer().visible;
+				layer_changed(canvas.layer);
+				print_layer();
+				break;
+			case GLFW_KEY_LEFT_BRACKET:
+			case GLFW_KEY_RIGHT_BRACKET: {
+				// steps of 10%
+				int percent = (active_layer().opacity*100 + 127)/255;
+				percent = clamp(percent + (key == GLFW_KEY_LEFT_BRACKET ? -10 : 10), 0, 100);
+				active_layer().opacity = (percent*255 + 50)/100;
+				layer_changed(canvas.layer);
+				print_layer();
+				break;
+			}
+			case GLFW_KEY_HOME:
+				canvas_view.fitted = true;
+				fit_view();
+				view_changed();
+				break;
+			case GLFW_KEY_1:
+				zoom_view(1, { viewport_width() / 2, window_size.height / 2 });
+				break;
+#ifndef PAINT_NO_PROFILE
+			case GLFW_KEY_P:
+				profile_overlay = !profile_overlay;
+				gpu_timers.enabled = profile_overlay || profiler.trace;
+				damage.window = true;
+				break;
+#endif
 			case GLFW_KEY_UP:
-				if (brush_r < 23) brush_r++;
+				brush_r = clamp(brush_r + (mods == GLFW_MOD_SHIFT ? 10 : 1), 0, MAX_BRUSH_R);
 				break;
 			case GLFW_KEY_DOWN:
-				if (brush_r > 0) brush_r--;
+				brush_r = clamp(brush_r - (mods == GLFW_MOD_SHIFT ? 10 : 1), 0, MAX_BRUSH_R);
 				break;
 		}
 	}
 }
 
-void boundary_fill(int row, int col) {
-	//printf("bf %3d\n", (*(canvas.colors + row*canvas.size.width + col)).a);
-	//if ( (*(canvas.colors + row*canvas.size.width + col)).a == 0) {
-	if (
-			(*(canvas.colors + row*canvas.size.width + col)).r == first_filled_pix.r &&
-			(*(canvas.colors + row*canvas.size.width + col)).g == first_filled_pix.g &&
-			(*(canvas.colors + row*canvas.size.width + col)).b == first_filled_pix.b &&
-			(*(canvas.colors + row*canvas.size.width + col)).a == first_filled_pix.a
-	) {
-		change_canvas_unit(row, col);
-
-		if (col > 0) boundary_fill(row, col-1);
-		if (col < canvas.size.width-1) boundary_fill(row, col+1);
-		if (row > 0) boundary_fill(row-1, col);
-		if (row < canvas.size.height-1) boundary_fill(row+1, col);
-	}
-}
-
-void copy_vec4uc(Vec4uc *dest, Vec4uc *src) {
-	(*dest).r = (*src).r;
-	(*dest).g = (*src).g;
-	(*dest).b = (*src).b;
-	(*dest).a = (*src).a;
-}
-
 void check_ui_elements(double xpos, double ypos) {
 	ypos = window_size.height - ypos;
 
-	float canvas_side = canvas.scale * CANVAS_WIDTH;
 	if (active_ui_element == CANVAS) {
+		double canvas_x, canvas_y;
+		window_to_canvas(xpos, ypos, &canvas_x, &canvas_y);
 		canvas.history.coords[2] = canvas.history.coords[1];
 		canvas.history.coords[1] = canvas.history.coords[0];
-		canvas.history.coords[0] = {
-			floor(xpos/canvas_side * canvas.size.width),
-			floor((ypos - (window_size.height - canvas_side))/canvas_side * canvas.size.height)
-		};
+		canvas.history.coords[0] = { (int)floor(canvas_x), (int)floor(canvas_y) };
 		/*printf("[2] %3d, %3d\n", canvas.history.coords[2].x, canvas.history.coords[2].y);
 		printf("[1] %3d, %3d\n", canvas.history.coords[1].x, canvas.history.coords[1].y);
 		printf("[0] %3d, %3d\n\n", canvas.history.coords[0].x, canvas.history.coords[0].y);*/
 		if (active_tool == BUTTON_BRUSH)
-			update_canvas(xpos, ypos);
+			queue_stroke_sample(xpos, ypos);
+		else if (active_tool == BUTTON_SELECT)
+			drag_selection({ (float)canvas_x, (float)canvas_y });
 		// revisar cómo cambia cómo cambia el historial al usar el llenado
 		/*else if (active_tool == BUTTON_BUCKET) {
 			int col = canvas.history.coords[0].x;
@@ -455,8 +1576,7 @@ void check_ui_elements(double xpos, double ypos) {
 		}*/
 	}
 
-	if (xpos >= 0 && xpos < canvas_side &&
-			ypos >= window_size.height - canvas_side && ypos < window_size.height) {
+	if (over_canvas(xpos, ypos)) {
 		hot_ui_element = CANVAS;
 		return;
 	}
@@ -471,9 +1591,6 @@ void check_ui_elements(double xpos, double ypos) {
 			if (active_ui_element == hot_ui_element) {
 				active_color.hsv.h = atan2(uv.y, uv.x);
 				calculate_selected_colors(active_color.hsv.h);
-				glUniform3fv(loc_wheel_color, 1, &wheel_color.r);
-				glUniform3fv(loc_active_color, 1, &active_color.rgb.r);
-				glUniform3fv(loc_hsv, 1, &active_color.hsv.h);
 			}
 			return;
 		}
@@ -483,20 +1600,14 @@ void check_ui_elements(double xpos, double ypos) {
 				//printf("Moving inside the sv square   %.2f\n", glfwGetTime());
 				active_color.hsv.v = uv.y + 0.5;
 				active_color.hsv.s = uv.x + 0.5;
-				float c = active_color.hsv.v * active_color.hsv.s;
-				float m = active_color.hsv.v - c;
-				active_color.rgb = {
-					c * wheel_color.r + m,
-					c * wheel_color.g + m,
-					c * wheel_color.b + m
-				};
-				glUniform3f(loc_active_color, active_color.rgb.r, active_color.rgb.g, active_color.rgb.b);
-				glUniform3f(loc_hsv, active_color.hsv.h, active_color.hsv.s, active_color.hsv.v);
+				active_color.rgb = hsv_to_rgb(active_color.hsv);
 			}
 			return;
 		}
 	}
 
+		if (selection.active && active_ui_element >= BUTTON_CLEAR_CANVAS && active_ui_element != BUTTON_SELECT)
+			put_down_selection(true);
 		switch (active_ui_element) {
 			case BUTTON_CLEAR_CANVAS:
 				clear_canvas(true);
@@ -509,11 +1620,12 @@ void check_ui_elements(double xpos, double ypos) {
 				break;
 			case BUTTON_BRUSH:
 				active_tool = BUTTON_BRUSH;
-				glUniform1i(loc_active_tool, active_tool);
 				break;
 			case BUTTON_BUCKET:
 				active_tool = BUTTON_BUCKET;
-				glUniform1i(loc_active_tool, active_tool);
+				break;
+			case BUTTON_SELECT:
+				active_tool = BUTTON_SELECT;
 				break;
 		}
 
@@ -522,62 +1634,316 @@ void check_ui_elements(double xpos, double ypos) {
 }
 
 void mouse_button_callback(GLFWwindow *window, int button, int action, int mods) {
+	if (journal.replaying && !journal.dispatching) return;
+	PROFILE_SCOPE("input");
+	double xpos, ypos;
+	if (journal.replaying) {
+		xpos = journal.cursor_x;
+		ypos = journal.cursor_y;
+	} else {
+		glfwGetCursorPos(window, &xpos, &ypos);
+	}
+	record_event(JOURNAL_BUTTON, xpos, ypos, button, 0, action, mods);
+	if (button == GLFW_MOUSE_BUTTON_MIDDLE) {
+		canvas_view.panning = action == GLFW_PRESS;
+		canvas_view.grab = { (float)xpos, (float)(window_size.height - ypos) };
+	}
 	if (button == GLFW_MOUSE_BUTTON_LEFT) {
+		reset_prediction(action == GLFW_PRESS);
 		if (action == GLFW_RELEASE) {
 			canvas.history.coords[0] = { -1, -1 }; //last_pix = { -1, -1 };
-			if (active_ui_element == CANVAS) {
-				memcpy(canvas.history.colors[canvas.history.index], canvas.colors,
-					canvas.size.width * canvas.size.height * sizeof(Vec4uc));
-				printf("Copiado a [%2d]\n", canvas.history.index);
-				canvas.history.index = (canvas.history.index + 1) % HISTORY;
-				if (canvas.history.past < HISTORY - 1) canvas.history.past++;
-				canvas.history.future = 0;
-				printf("Sigue [%2d]. Pasado: %2d  Futuro: %2d\n", canvas.history.index, canvas.history.past, canvas.history.future);
+			if (active_ui_element == CANVAS && active_tool == BUTTON_SELECT) {
+				// the selection stays up; it is committed when it's put down.
+				// A click without a drag only deselects.
+				Rect &r = selection.rect;
+				if (selection.drag == SELECT_MARK && r.min.x == r.max.x && r.min.y == r.max.y) {
+					selection.active = false;
+					damage.canvas = true;
+				}
+				selection.drag = SELECT_IDLE;
+			} else if (active_ui_element == CANVAS) {
+				flush_strokes();
+				if (gpu_brush.enabled) {
+					// Committed once the readback lands, see the main loop
+					gpu_brush_begin_readback();
+					gpu_brush.commit_pending = true;
+				} else {
+					commit_history();
+				}
 			}
 			active_ui_element = -1;
 		}
 		if (action == GLFW_PRESS) {
-			double xpos, ypos;
-			glfwGetCursorPos(window, &xpos, &ypos);
 			active_ui_element = hot_ui_element;
-			if (active_ui_element == CANVAS && active_tool == BUTTON_BUCKET) {
-				ypos = window_size.height - ypos;
-				float canvas_side = canvas.scale * CANVAS_WIDTH;
+			if (gpu_brush.commit_pending) {
+				commit_history();
+				gpu_brush.commit_pending = false;
+			}
+			if (active_ui_element == CANVAS && active_tool == BUTTON_SELECT) {
+				double canvas_x, canvas_y;
+				window_to_canvas(xpos, window_size.height - ypos, &canvas_x, &canvas_y);
+				press_selection({ (float)canvas_x, (float)canvas_y });
+			} else if (active_ui_element == CANVAS && active_tool == BUTTON_BUCKET) {
+				double canvas_x, canvas_y;
+				window_to_canvas(xpos, window_size.height - ypos, &canvas_x, &canvas_y);
 				canvas.history.coords[2] = canvas.history.coords[1];
 				canvas.history.coords[1] = canvas.history.coords[0];
-				canvas.history.coords[0] = {
-					floor(xpos/canvas_side * canvas.size.width),
-					floor((ypos - (window_size.height - canvas_side))/canvas_side * canvas.size.height)
-				};
+				canvas.history.coords[0] = { (int)floor(canvas_x), (int)floor(canvas_y) };
 				int col = canvas.history.coords[0].x;
 				int row = canvas.history.coords[0].y;
 				//printf("Bucket start: %3d, %3d\n", col, row);
-				copy_vec4uc(&first_filled_pix, canvas.colors + row*canvas.size.width + col);
-				printf("ff_px = { %d, %d, %d, %d }\n", first_filled_pix.r, first_filled_pix.g, first_filled_pix.b, first_filled_pix.a);
-				boundary_fill(row, col);
-				glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, canvas.size.width, canvas.size.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, canvas.colors);
-				glGenerateMipmap(GL_TEXTURE_2D);
+				Rect filled = boundary_fill(row, col, pack_active_color());
+				if (filled.max.x >= filled.min.x) {
+					mark_dirty(filled.min.y, filled.min.x);
+					mark_dirty(filled.max.y, filled.max.x);
+					touch_tiles(filled);
+				}
 			} else
 				check_ui_elements(xpos, ypos);
 		}
 	}
 }
 
+Vec2i panel_size() {
+	return { (int)ceilf(COLOR_WHEEL_SIDE * canvas.scale), (int)ceilf(PANEL_HEIGHT * canvas.scale) };
+}
+
+// Shades the panel quads into panel.texture, only when something they show
+// has changed, and tells whether it did. The viewport is offset so the quads
+// keep their window coordinates while landing in the panel-sized target.
+bool render_panel(Shader &program, int quad_count) {
+	PanelKey key = { active_color.hsv, hot_ui_element, active_tool, panel_size() };
+	if (panel.valid && !memcmp(&key, &panel.key, sizeof(key))) return false;
+	int w = key.size.width, h = key.size.height;
+
+	if (!panel.fbo) glGenFramebuffers(1, &panel.fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, panel.fbo);
+	if (!panel.valid || w != panel.key.size.width || h != panel.key.size.height) {
+		if (panel.texture) glDeleteTextures(1, &panel.texture);
+		glGenTextures(1, &panel.texture);
+		glActiveTexture(GL_TEXTURE3);
+		glBindTexture(GL_TEXTURE_2D, panel.texture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+		glActiveTexture(GL_TEXTURE0);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, panel.texture, 0);
+	}
+	Vec2i origin = { (int)window_size.width - w, (int)window_size.height - h };
+	glViewport(-origin.x, -origin.y, window_size.width, window_size.height);
+	glClear(GL_COLOR_BUFFER_BIT);
+
+	program.use();
+	float radius = (float)COLOR_WHEEL_SIDE/2 * canvas.scale;
+	model = glm::mat4(1.0f);
+	model = glm::translate(model, glm::vec3(window_size.width, window_size.height, 0.0f));
+	model = glm::scale(model, glm::vec3(canvas.scale, canvas.scale, 1.0f));
+	glUniformMatrix4fv(loc_model, 1, GL_FALSE, glm::value_ptr(model));
+	glUniformMatrix4fv(loc_projection, 1, GL_FALSE, glm::value_ptr(projection));
+	glUniform1i(loc_hot_ui_element, hot_ui_element-1);
+	glUniform1i(loc_active_tool, active_tool);
+	glUniform1f(loc_color_wheel_radius, radius);
+	glUniform2f(loc_color_wheel_center, window_size.width - radius - origin.x, window_size.height - radius - origin.y);
+	glUniform3fv(loc_wheel_color, 1, &wheel_color.r);
+	glUniform3fv(loc_active_color, 1, &active_color.rgb.r);
+	glUniform3fv(loc_hsv, 1, &active_color.hsv.h);
+	glDrawElements(GL_TRIANGLES, 6*(quad_count-1), GL_UNSIGNED_INT, (void*)(6 * sizeof(unsigned int)));
+
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glViewport(0, 0, window_size.width, window_size.height);
+	panel.key = key;
+	panel.valid = true;
+	panel.renders++;
+	return true;
+}
+
+void composite_panel() {
+	int w = panel.key.size.width, h = panel.key.size.height;
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, panel.fbo);
+	glBlitFramebuffer(0, 0, w, h, window_size.width - w, window_size.height - h, window_size.width, window_size.height,
+			GL_COLOR_BUFFER_BIT, GL_NEAREST);
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+}
+
+#ifndef PAINT_NO_PROFILE
+// The last frames as stacked bars in the lower left corner, a color per
+// stage and gray for the rest, under a line at 60 Hz
+void draw_profile_overlay() {
+	const float colors[PROFILE_STAGES + 1][3] = {
+		{ 0.9, 0.8, 0.2 }, // input
+		{ 0.9, 0.3, 0.2 }, // raster
+		{ 0.7, 0.3, 0.8 }, // commit
+		{ 0.2, 0.6, 0.9 }, // upload
+		{ 0.2, 0.8, 0.8 }, // mips
+		{ 0.3, 0.8, 0.3 }, // draw
+		{ 0.5, 0.5, 0.5 },
+	};
+	int bars = std::min<unsigned long>(std::min<unsigned long>(PROFILE_FRAMES, profiler.frame_count), viewport_width() / 3);
+	glEnable(GL_SCISSOR_TEST);
+	for (int i = 0; i < bars; i++) {
+		const ProfileFrame &f = profiler.frames[(profiler.frame_count - bars + i) % PROFILE_FRAMES];
+		float ms = 0;
+		for (int s = 0; s <= PROFILE_STAGES; s++) {
+			int y0 = ms * OVERLAY_PX_PER_MS;
+			ms += s < PROFILE_STAGES ? f.stages[s] : f.other;
+			int y1 = std::min<float>(ms * OVERLAY_PX_PER_MS, window_size.height);
+			if (y1 <= y0) continue;
+			glScissor(i * 3, y0, 2, y1 - y0);
+			glClearColor(colors[s][0], colors[s][1], colors[s][2], 1.0);
+			glClear(GL_COLOR_BUFFER_BIT);
+		}
+	}
+	glScissor(0, 1000.0f / 60 * OVERLAY_PX_PER_MS, bars * 3, 1);
+	glClearColor(1.0, 1.0, 1.0, 1.0);
+	glClear(GL_COLOR_BUFFER_BIT);
+	glDisable(GL_SCISSOR_TEST);
+	glClearColor(0.2, 0.2, 0.2, 1.0);
+}
+#endif
+
 bool collision_point_rectangle(double px, double py, float rx, float ry, float w, float h) {
 	if (px < rx || px > rx+w) return false;
 	if (py < ry || py > ry+h) return false;
 	return true;
 }
 
+// Exposed parts of the window have to be drawn again even if nothing changed
+void window_refresh_callback(GLFWwindow *window) {
+	damage.window = true;
+}
+
 static void cursor_position_callback(GLFWwindow *window, double xpos, double ypos) {
+	if (journal.replaying && !journal.dispatching) return;
+	PROFILE_SCOPE("input");
+	record_event(JOURNAL_CURSOR, xpos, ypos, 0, 0, 0, 0);
 	//printf("cursor pos callback %.4f, %.4f\n", xpos, ypos);
 	mouse = { xpos, window_size.height - ypos };
+	damage.pointer = true;
+	if (canvas_view.panning) {
+		CanvasView &v = canvas_view;
+		v.corner = { v.corner.x + mouse.x - v.grab.x, v.corner.y + mouse.y - v.grab.y };
+		v.grab = mouse;
+		v.fitted = false;
+		view_changed();
+	}
 	check_ui_elements(xpos, ypos);
 }
 
-int main() {
+// Zooms about the cursor, ZOOM_STEP per notch
+static void scroll_callback(GLFWwindow *window, double xoffset, double yoffset) {
+	if (journal.replaying && !journal.dispatching) return;
+	PROFILE_SCOPE("input");
+	record_event(JOURNAL_SCROLL, xoffset, yoffset, 0, 0, 0, 0);
+	if (!over_canvas(mouse.x, mouse.y)) return;
+	zoom_view(view_zoom() * powf(ZOOM_STEP, yoffset), mouse);
+}
+
+// Feeds journal records to the callbacks up to the next frame marker, in
+// real time mode only once their timestamp has been reached. Returns whether
+// the marker was reached, i.e. the coming flush closes a recorded frame.
+bool replay_frame(GLFWwindow *window) {
+	bool marker = false;
+	journal.dispatching = true;
+	while (!journal_replay_done()) {
+		JournalEvent &e = journal.events[journal.next];
+		if (journal.realtime && e.time > glfwGetTime() - journal.start) break;
+		journal.next++;
+		if (e.type == JOURNAL_FRAME) {
+			marker = true;
+			break;
+		}
+		double start = glfwGetTime();
+		switch (e.type) {
+			case JOURNAL_CURSOR:
+				cursor_position_callback(window, e.x, e.y);
+				break;
+			case JOURNAL_BUTTON:
+				journal.cursor_x = e.x;
+				journal.cursor_y = e.y;
+				mouse_button_callback(window, e.code, e.action, e.mods);
+				break;
+			case JOURNAL_KEY:
+				key_callback(window, e.code, e.scancode, e.action, e.mods);
+				break;
+			case JOURNAL_RESIZE:
+				framebuffer_size_callback(window, e.x, e.y);
+				break;
+			case JOURNAL_SCROLL:
+				scroll_callback(window, e.x, e.y);
+				break;
+		}
+		journal_add_timing(e.type, glfwGetTime() - start);
+	}
+	journal.dispatching = false;
+	return marker;
+}
+
+int main(int argc, char **argv) {
+	double launch = now_seconds(); // time to first frame counts from here
 	//printf("%d\n", canvas.size.width*canvas.size.height*sizeof(Vec4uc));
 	//return 0;
+	// --record <file> journals the session, --replay <file> [--realtime] plays one back,
+	// --canvas <width>x<height> sets the document size, --gpu-brush paints on the GPU,
+	// --continuous redraws every frame instead of waiting for changes,
+	// --linear blends antialiased edges in linear light, --threads <n> sizes
+	// the raster pool (one thread per core by default), --open <file> starts
+	// from a saved document, or from its autosave after a crash, --autosave
+	// <base> logs the session to <base>.oplog and <base>.pdoc instead of the
+	// default, --no-autosave doesn't, --profile <base> writes a Chrome trace
+	// to <base>.json and a per-second summary to <base>.csv, --no-prediction
+	// leaves out the predicted stroke tail, --latency reports how far the
+	// screen lags the pointer, --input-stats prints the pointer events per
+	// frame every second while painting
+	const char *record_path = NULL, *open_path = NULL, *autosave_base = DEFAULT_AUTOSAVE, *profile_base = NULL;
+	bool gpu_brush_flag = false, continuous = false;
+	int threads = 0;
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--gpu-brush")) {
+			gpu_brush_flag = true;
+		} else if (!strcmp(argv[i], "--continuous")) {
+			continuous = true;
+		} else if (!strcmp(argv[i], "--linear")) {
+			linear_blending = true;
+		} else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+			threads = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--canvas") && i + 1 < argc) {
+			Vec2i size;
+			if (sscanf(argv[++i], "%dx%d", &size.width, &size.height) == 2 && size.width > 0 && size.height > 0) {
+				canvas.size = size;
+			}
+		} else if (!strcmp(argv[i], "--open") && i + 1 < argc) {
+			open_path = argv[++i];
+		} else if (!strcmp(argv[i], "--autosave") && i + 1 < argc) {
+			autosave_base = argv[++i];
+		} else if (!strcmp(argv[i], "--no-autosave")) {
+			autosave_base = NULL;
+		} else if (!strcmp(argv[i], "--no-prediction")) {
+			prediction.enabled = false;
+		} else if (!strcmp(argv[i], "--latency")) {
+			prediction.measuring = true;
+		} else if (!strcmp(argv[i], "--input-stats")) {
+			input.reporting = true;
+		} else if (!strcmp(argv[i], "--profile") && i + 1 < argc) {
+			profile_base = argv[++i];
+		} else if (!strcmp(argv[i], "--record") && i + 1 < argc) {
+			record_path = argv[++i];
+		} else if (!strcmp(argv[i], "--replay") && i + 1 < argc) {
+			bool realtime = i + 2 < argc && !strcmp(argv[i + 2], "--realtime");
+			if (!journal_replay_open(argv[++i], realtime)) return 1;
+			if (realtime) i++;
+		}
+	}
+	if (journal.replaying) {
+		autosave_base = NULL; // a replay has to start from the journal's canvas
+		canvas.size = { journal.header.canvas_width, journal.header.canvas_height };
+		window_size = { (float)journal.header.window_width, (float)journal.header.window_height };
+	}
+
+	profile_start(profile_base);
+#ifndef PAINT_NO_PROFILE
+	gpu_timers.enabled = profiler.trace;
+#endif
+
 	glfwInit();
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
@@ -595,6 +1961,9 @@ int main() {
 	glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
 	glfwSetKeyCallback(window, key_callback);
 	glfwSetMouseButtonCallback(window, mouse_button_callback);
+	glfwSetScrollCallback(window, scroll_callback);
+	glfwSetWindowRefreshCallback(window, window_refresh_callback);
+	if (journal.replaying && !journal.realtime) glfwSwapInterval(0);
 
 	glewInit();
 
@@ -609,6 +1978,8 @@ int main() {
 		initialize_quad(-COLOR_WHEEL_SIDE+80, -COLOR_WHEEL_SIDE-55, 36, 36, 1.0, 0.5, 0.5, 1),
 		initialize_quad(-COLOR_WHEEL_SIDE, -COLOR_WHEEL_SIDE-105, 36, 36,   0.0, 0.0, 0.5, 0.5),
 		initialize_quad(-COLOR_WHEEL_SIDE+40, -COLOR_WHEEL_SIDE-105, 36, 36,   0.5, 0.0, 1.0, 0.5),
+		// no icon in tex_btns.png, shader.frag draws it
+		initialize_quad(-COLOR_WHEEL_SIDE+80, -COLOR_WHEEL_SIDE-105, 36, 36,   -1, -1, -1, -1),
 	};
 
 	int nq = sizeof(quads)/sizeof(quads[0]);
@@ -645,25 +2016,32 @@ int main() {
 	glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)(sizeof(Vec3) + sizeof(Vec2)));
 	glEnableVertexAttribArray(2);
 
-	for (int i = 0; i < HISTORY; i++) {
-		canvas.history.colors[i] = (Vec4uc *)malloc(canvas.size.width * canvas.size.height * sizeof(Vec4uc));
+	if (getenv("PAINT_HISTORY_MB")) {
+		canvas.history.budget = (size_t)atoi(getenv("PAINT_HISTORY_MB")) << 20;
+	}
+	pool_start(threads);
+	create_canvas(canvas.size.width, canvas.size.height);
+	fit_view();
+	// a log left by a crash is recovered first, unless it was editing some
+	// other document than the one asked for; then it is kept for later
+	bool recovered = false;
+	std::string owner;
+	if (autosave_base && oplog_in_use(autosave_base)) {
+		printf("Another session is autosaving to %s; autosave is off\n", autosave_base);
+		autosave_base = NULL;
 	}
-	canvas.history.coords[0] = { -1, -1 };
-	canvas.colors = (Vec4uc *)malloc(canvas.size.width * canvas.size.height * sizeof(Vec4uc));
-	for (int i = 0; i < canvas.size.height; i++) {
-		for (int j = 0; j < canvas.size.width; j++) {
-			*(canvas.colors + i*canvas.size.width + j) = { 0, 0, 0, 0 };
-			*(canvas.history.colors[0] + i*canvas.size.width + j) = { 0, 0, 0, 0 };
+	if (autosave_base && oplog_owner(autosave_base, owner)) {
+		if (open_path && owner != oplog_document_path(open_path)) {
+			printf("%s.oplog has unsaved work on %s; it is kept and autosave is off, run without --open to recover it\n",
+					autosave_base, owner.empty() ? "a new document" : owner.c_str());
+			autosave_base = NULL;
+		} else {
+			recovered = oplog_recover(autosave_base);
 		}
 	}
-
-	glGenTextures(1, &canvas.texture);
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, canvas.texture);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR); //
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, canvas.size.width, canvas.size.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, canvas.colors);
-	glGenerateMipmap(GL_TEXTURE_2D);
+	if (open_path && !recovered && !open_document(document, open_path)) return 1;
+	if (autosave_base && !oplog_start(autosave_base)) printf("Autosave is off, %s can't be written\n", autosave_base);
+	allocate_canvas_texture();
 
 	unsigned int texture_btn;
 	glGenTextures(1, &texture_btn);
@@ -671,23 +2049,11 @@ int main() {
 	glBindTexture(GL_TEXTURE_2D, texture_btn);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	stbi_set_flip_vertically_on_load(true);
-	int width, height, n_ch;
-	unsigned char *data	= stbi_load("tex_btns.png", &width, &height, &n_ch, 0);
-	if (data) {
-		/*for (int i = 0; i < height; i++) {
-			for (int j = 0; j < width; j++) {
-				printf("%3d  ", *(data+i*width+j));
-			}
-			printf("\n");
-		}*/
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
-		glGenerateMipmap(GL_TEXTURE_2D);
-	} else return 1;
-	stbi_image_free(data);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, tex_btns_width, tex_btns_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, tex_btns_pixels);
+	glGenerateMipmap(GL_TEXTURE_2D);
 	glActiveTexture(GL_TEXTURE0);
 
-	Shader program = Shader("shader.vert", "shader.frag");
+	Shader program = Shader("panel", shader_vert_source, shader_frag_source);
 	program.use();
 	model = glm::mat4(1.0f);
 	view = glm::mat4(1.0f);
@@ -696,39 +2062,70 @@ int main() {
 	loc_view = glGetUniformLocation(program.id, "view");
 	loc_projection = glGetUniformLocation(program.id, "projection");
 	glUniformMatrix4fv(loc_view, 1, GL_FALSE, glm::value_ptr(view));
-	glUniformMatrix4fv(loc_projection, 1, GL_FALSE, glm::value_ptr(projection));
 
 	loc_hot_ui_element = glGetUniformLocation(program.id, "hot_ui_element");
-	glUniform1i(loc_hot_ui_element, -1);
 	loc_active_tool = glGetUniformLocation(program.id, "active_tool");
-	glUniform1i(loc_active_tool, active_tool);
 	loc_color_wheel_radius = glGetUniformLocation(program.id, "color_wheel_radius");
-	glUniform1f(loc_color_wheel_radius, 100.0);
 	loc_color_wheel_center = glGetUniformLocation(program.id, "color_wheel_center");
-	glUniform2f(loc_color_wheel_center, CANVAS_WIDTH + COLOR_WHEEL_SIDE, CANVAS_HEIGHT);
 	loc_wheel_color = glGetUniformLocation(program.id, "wheel_color");
-	glUniform3f(loc_wheel_color, wheel_color.r, wheel_color.g, wheel_color.b);
 	loc_active_color = glGetUniformLocation(program.id, "active_color");
-	glUniform3f(loc_active_color, active_color.rgb.r, active_color.rgb.g, active_color.rgb.b);
 	loc_hsv = glGetUniformLocation(program.id, "hsv");
-	glUniform3f(loc_hsv, active_color.hsv.h, active_color.hsv.s, active_color.hsv.v);
-	loc_canvas = glGetUniformLocation(program.id, "canvas");
-	glUniform1i(loc_canvas, 0);
 	loc_tex_btn = glGetUniformLocation(program.id, "tex_btn");
 	glUniform1i(loc_tex_btn, 1);
 
+	Shader canvas_program = Shader("canvas", shader_vert_source, canvas_frag_source);
+	canvas_program.use();
+	loc_canvas_model = glGetUniformLocation(canvas_program.id, "model");
+	loc_canvas_view = glGetUniformLocation(canvas_program.id, "view");
+	loc_canvas_projection = glGetUniformLocation(canvas_program.id, "projection");
+	glUniformMatrix4fv(loc_canvas_view, 1, GL_FALSE, glm::value_ptr(view));
+	loc_canvas = glGetUniformLocation(canvas_program.id, "canvas");
+	glUniform1i(loc_canvas, 0);
+	loc_canvas_pages = glGetUniformLocation(canvas_program.id, "canvas_pages");
+	glUniform1i(loc_canvas_pages, 2);
+	loc_canvas_size = glGetUniformLocation(canvas_program.id, "canvas_size");
+	glUniform2f(loc_canvas_size, canvas.size.width, canvas.size.height);
+	loc_tile_size = glGetUniformLocation(canvas_program.id, "tile_size");
+	glUniform1f(loc_tile_size, TILE_SIZE);
+
+	create_tail_program();
+	create_select_program();
+
 	glClearColor(0.2, 0.2, 0.2, 1.0);
+	if (gpu_brush_flag) set_gpu_brush(true);
+
+	if (record_path) {
+		JournalHeader header = {};
+		header.canvas_width = canvas.size.width;
+		header.canvas_height = canvas.size.height;
+		header.window_width = window_size.width;
+		header.window_height = window_size.height;
+		journal_record_start(record_path, header, glfwGetTime());
+	}
+	if (journal.replaying) journal.start = glfwGetTime();
 
 	while (!glfwWindowShouldClose(window)){
-		glClear(GL_COLOR_BUFFER_BIT);
-
-		model = glm::mat4(1.0f);
-		model = glm::translate(model, glm::vec3(0.0f, window_size.height, 0.0f));
-		model = glm::scale(model, glm::vec3(canvas.scale, canvas.scale, 1.0f));
-		glUniformMatrix4fv(loc_model, 1, GL_FALSE, glm::value_ptr(model));
-		glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+		PROFILE_MARK(frame_mark);
+		bool replayed_frame = journal.replaying && replay_frame(window);
+		double frame_start = glfwGetTime();
+		if (!input.segments.empty() || canvas.dirty.max.x >= canvas.dirty.min.x) damage.canvas = true;
+		flush_strokes();
+		upload_canvas();
+		if (gpu_brush.commit_pending && gpu_brush_finish_readback(false)) {
+			commit_history();
+			gpu_brush.commit_pending = false;
+		}
+		if (replayed_frame) journal_add_timing(JOURNAL_FRAME, glfwGetTime() - frame_start);
+		if (journal.replaying && journal_replay_done()) {
+			journal_report(canvas_hash());
+			journal.replaying = false;
+			glfwSetWindowShouldClose(window, true);
+		}
+		input.frames++;
+		report_input_stats();
+		oplog_tick();
 
-		for (int i = 2; i < nq; i++) {
+		for (int i = 2; i < nq && (damage.pointer || damage.window); i++) {
 			if (collision_point_rectangle(
 					(mouse.x - window_size.width)/canvas.scale,
 					(mouse.y - window_size.height)/canvas.scale,
@@ -747,17 +2144,81 @@ int main() {
 				//selected = -1;
 			//}
 		}
-		glUniform1i(loc_hot_ui_element, hot_ui_element-1);
-
-		model = glm::mat4(1.0f);
-		model = glm::translate(model, glm::vec3(window_size.width, window_size.height, 0.0f));
-		model = glm::scale(model, glm::vec3(canvas.scale, canvas.scale, 1.0f));
-		glUniformMatrix4fv(loc_model, 1, GL_FALSE, glm::value_ptr(model));
-		glDrawElements(GL_TRIANGLES, 6*(nq-1), GL_UNSIGNED_INT, (void*)(6 * sizeof(unsigned int)));
-
-		glfwSwapBuffers(window);
-		glfwPollEvents();
+		damage.pointer = false;
+		if (render_panel(program, nq)) damage.ui = true;
+
+		if (continuous || damage.canvas || damage.ui || damage.window) {
+			damage.canvas = damage.ui = damage.window = false;
+			damage.rendered++;
+
+			glClear(GL_COLOR_BUFFER_BIT);
+
+			update_mips();
+			PROFILE_MARK(draw_mark);
+			bool gpu_draw = gpu_timer_begin("gpu draw");
+			canvas_program.use();
+			CanvasView &v = canvas_view;
+			model = glm::mat4(1.0f);
+			model = glm::translate(model, glm::vec3(v.corner.x, v.corner.y, 0.0f));
+			model = glm::scale(model, glm::vec3(v.scale.x, v.scale.y, 1.0f));
+			glUniformMatrix4fv(loc_canvas_model, 1, GL_FALSE, glm::value_ptr(model));
+			glUniformMatrix4fv(loc_canvas_projection, 1, GL_FALSE, glm::value_ptr(projection));
+			// the rasterizer drops what is out of the window; this keeps the
+			// canvas off the panel column
+			glEnable(GL_SCISSOR_TEST);
+			glScissor(0, 0, ceilf(viewport_width()), window_size.height);
+			glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+			draw_stroke_tail();
+			draw_selection();
+			glDisable(GL_SCISSOR_TEST);
+
+			composite_panel();
+#ifndef PAINT_NO_PROFILE
+			if (profile_overlay) draw_profile_overlay();
+#endif
+			gpu_timer_end(gpu_draw);
+			PROFILE_SINCE(draw_mark, "draw");
+
+			glfwSwapBuffers(window);
+			stroke_frame_presented();
+			if (damage.rendered == 1) {
+				printf("[startup] First frame: %.1f ms  Programs: %.1f ms, %d from the cache, %d compiled\n",
+						(now_seconds() - launch)*1e3, shader_stats.seconds*1e3, shader_stats.cached, shader_stats.compiled);
+			}
+		} else {
+			damage.skipped++;
+		}
+		PROFILE_SINCE(frame_mark, "frame");
+		gpu_timers_poll();
+		profile_frame();
+		if (continuous || journal.replaying) glfwPollEvents();
+		else glfwWaitEventsTimeout(gpu_brush.commit_pending ? 0.001 : IDLE_TIMEOUT);
+		if (journal.recording && journal.pending) record_event(JOURNAL_FRAME, 0, 0, 0, 0, 0, 0);
+	}
+	journal_record_stop();
+	if (prediction.measuring) report_latency();
+	printf("[pbo] Uploads: %lu  Stalled on fence: %lu  Ring: %d\n", unpack.uploads, unpack.stalls, PBO_RING);
+	if (gpu_brush.program) printf("[gpu brush] Tile draws: %lu  Readbacks: %lu  Waited: %lu\n", gpu_brush.draws, gpu_brush.readbacks, gpu_brush.waits);
+	printf("[frames] Rendered: %lu  Skipped: %lu  Panel shaded: %lu\n", damage.rendered, damage.skipped, panel.renders);
+	printf("[tiles] Flattened: %zu of %zu  Painted: %zu in %zu layers  Below cache: %zu  GPU layers: %d  Evicted: %lu\n",
+			canvas.resident, canvas.tiles.size(), layer_tiles_resident(), canvas.layers.size(), canvas.below_resident, tile_layers.capacity,
+			tile_layers.evicted);
+	printf("[mips] Tiles rebuilt: %lu  Blitted: %lu  Full rebuilds: %lu\n", tile_layers.mips_built, tile_layers.mips_blitted, tile_layers.mips_full);
+	printf("[pool] Threads: %d  Steals: %lu\n", pool.size, pool.steals.load());
+	size_t stored = 0, unpacked = 0;
+	for (HistoryEntry &entry : canvas.history.entries) stored += entry_bytes(entry, &unpacked);
+	printf("[history] Steps: %d  Packed: %lu tiles  %zu KiB of %zu KiB  Cache hits: %lu  Misses: %lu\n", canvas.history.cursor,
+			history_worker.packed.load(), stored >> 10, unpacked >> 10, history_worker.hits, history_worker.misses);
+	if (oplog.running) {
+		oplog_stop(true);
+		printf("[autosave] Logged: %llu ops  Syncs: %llu  Checkpoints: %llu  Waited: %lu\n",
+				(unsigned long long)oplog.sequence, (unsigned long long)oplog.syncs, (unsigned long long)oplog.checkpoints, oplog.waits);
 	}
+	export_png_wait();
+	history_worker_stop();
+	pool_stop();
+	gpu_timers_poll();
+	profile_stop();
 	glfwTerminate();
 
 	return 0;
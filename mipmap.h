@@ -0,0 +1,86 @@
+#ifndef MIPMAP_H
+#define MIPMAP_H
+
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MIPMAP_X86 1
+#endif
+
+// Box filter for the mip levels of a tile, so a tile that changed gets its
+// own levels rebuilt instead of the driver regenerating every tile. Pixels
+// are premultiplied RGBA8, which averages correctly as is; every output is
+// the rounded mean of its 2x2 block, the same in every kernel.
+
+// n output pixels from the rows row0 and row1, 2n pixels each
+void mip_reduce_scalar(uint32_t *dst, const uint32_t *row0, const uint32_t *row1, int n) {
+	for (int i = 0; i < n; i++) {
+		uint32_t a = row0[2*i], b = row0[2*i + 1], c = row1[2*i], d = row1[2*i + 1];
+		uint32_t out = 0;
+		for (int shift = 0; shift < 32; shift += 8) {
+			uint32_t sum = (a >> shift & 255) + (b >> shift & 255) + (c >> shift & 255) + (d >> shift & 255);
+			out |= (sum + 2) >> 2 << shift;
+		}
+		dst[i] = out;
+	}
+}
+
+#ifdef MIPMAP_X86
+
+// Sums of 2 input pixels per 16-bit lane pair, then the left and right
+// pixels of every block are brought together with 64-bit unpacks
+inline __m128i mip_reduce_sse2_4(const uint32_t *row0, const uint32_t *row1) {
+	const __m128i zero = _mm_setzero_si128();
+	__m128i a = _mm_loadu_si128((const __m128i *)row0), b = _mm_loadu_si128((const __m128i *)row1);
+	__m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+	__m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+	__m128i sum = _mm_add_epi16(_mm_unpacklo_epi64(lo, hi), _mm_unpackhi_epi64(lo, hi));
+	return _mm_srli_epi16(_mm_add_epi16(sum, _mm_set1_epi16(2)), 2);
+}
+
+void mip_reduce_sse2(uint32_t *dst, const uint32_t *row0, const uint32_t *row1, int n) {
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128i first = mip_reduce_sse2_4(row0 + 2*i, row1 + 2*i);
+		__m128i second = mip_reduce_sse2_4(row0 + 2*i + 4, row1 + 2*i + 4);
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(first, second));
+	}
+	mip_reduce_scalar(dst + i, row0 + 2*i, row1 + 2*i, n - i);
+}
+
+#endif
+
+typedef void (*MipReduce)(uint32_t *dst, const uint32_t *row0, const uint32_t *row1, int n);
+
+MipReduce select_mip_reduce() {
+#ifdef MIPMAP_X86
+	return mip_reduce_sse2;
+#else
+	return mip_reduce_scalar;
+#endif
+}
+
+MipReduce mip_reduce = select_mip_reduce();
+
+// Pixels of the levels below a side x side image, side a power of two
+int mip_chain_pixels(int side) {
+	int pixels = 0;
+	for (side /= 2; side > 0; side /= 2) pixels += side*side;
+	return pixels;
+}
+
+// Writes every level below src into chain, largest first, each one
+// reduced from the previous
+void build_mip_chain(const uint32_t *src, int side, uint32_t *chain, MipReduce reduce = mip_reduce) {
+	for (; side > 1; side /= 2) {
+		int half = side / 2;
+		for (int y = 0; y < half; y++) {
+			reduce(chain + y*half, src + 2*y*side, src + (2*y + 1)*side, half);
+		}
+		src = chain;
+		chain += half*half;
+	}
+}
+
+#endif
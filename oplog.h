@@ -0,0 +1,429 @@
+#ifndef OPLOG_H
+#define OPLOG_H
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <cstdlib>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+#include <zlib.h>
+
+// Autosave through an operation log. Every CanvasOp goes through a ring
+// that only the main thread writes and only the writer thread reads, so
+// reporting one is a copy and a store, plus a wake-up once the writer has
+// gone idle. The writer appends them to
+// <base>.oplog in batches and fsyncs every OPLOG_SYNC_MS. Every so often
+// the main thread captures the committed document, which the writer saves
+// as a checkpoint to <base>.pdoc before it starts a new log. Recovery opens
+// the checkpoint and replays the log on top; a clean exit removes both.
+// Every log names the document file it was editing, if any, so a session
+// that opens a different one leaves it alone, and is locked while its
+// session runs, so one started next to it doesn't take it for a crash.
+// Needs canvas.h and document.h.
+
+#define OPLOG_MAGIC 0x4c504f50 // "POPL"
+#define OPLOG_VERSION 2
+#define OPLOG_RING (1 << 16)   // ops in flight to the writer
+#define OPLOG_POLL_MS 20       // the writer's sleep while a sync is due
+#define OPLOG_SYNC_MS 200
+#define OPLOG_CHECKPOINT_OPS 100000
+#define OPLOG_CHECKPOINT_SECONDS 60
+#define OPLOG_CHECKPOINT OP_TYPES // ring slots that carry a document instead
+
+#pragma pack(push, 1)
+struct OpLogHeader {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t path_length;  // bytes of the document path after the header
+	int32_t width, height; // canvas the log starts from, without a checkpoint
+	uint64_t base;         // ops before the first record
+};
+
+struct OpRecord {
+	uint32_t crc;          // of the rest of the record and its words
+	uint8_t type, flags;
+	uint16_t reserved;
+	int32_t v[5];
+	uint32_t color;
+	uint32_t words;        // packed tile words following an OP_TILE, 0 if transparent
+};
+#pragma pack(pop)
+
+struct OpSlot {
+	CanvasOp op;
+	std::unique_ptr<DocumentState> checkpoint;
+	std::string path; // of the document, with a checkpoint
+};
+
+struct OpLog {
+	std::string log_path, checkpoint_path;
+	std::unique_ptr<OpSlot[]> ring;
+	std::atomic<uint64_t> head, tail; // slots handed over, and taken
+	std::atomic<bool> stop;
+	std::atomic<bool> idle; // the writer waits on wake, all written and synced
+	std::mutex lock;
+	std::condition_variable wake;
+	std::thread writer;
+	int fd;
+	bool running;
+	// main thread
+	uint64_t sequence;   // ops reported
+	uint64_t checkpointed;
+	double checkpoint_time;
+	unsigned long waits; // reports that found the ring full
+	// writer thread
+	Document document;
+	uint64_t written, syncs, checkpoints;
+};
+
+OpLog oplog = {};
+
+uint32_t record_crc(const OpRecord &record, const uint32_t *words) {
+	uLong crc = crc32(0, (const Bytef *)&record + sizeof(record.crc), sizeof(record) - sizeof(record.crc));
+	if (record.words) crc = crc32(crc, (const Bytef *)words, record.words*sizeof(uint32_t));
+	return crc;
+}
+
+// Reporters call it after publishing head; the writer sets idle before it
+// looks at head one last time, so one of them sees the other
+void oplog_wake() {
+	if (!oplog.idle.load()) return;
+	std::lock_guard<std::mutex> guard(oplog.lock);
+	oplog.wake.notify_one();
+}
+
+void oplog_report(const CanvasOp &op) {
+	uint64_t head = oplog.head.load(std::memory_order_relaxed);
+	while (head - oplog.tail.load(std::memory_order_acquire) >= OPLOG_RING) {
+		oplog.waits++;
+		std::this_thread::yield();
+	}
+	oplog.ring[head % OPLOG_RING].op = op;
+	oplog.head.store(head + 1);
+	oplog.sequence++;
+	oplog_wake();
+}
+
+// The name a log stores for the document at path, the same however it was
+// given on the command line; empty for a document never saved
+std::string oplog_document_path(const std::string &path) {
+	char resolved[PATH_MAX];
+	if (path.empty() || !realpath(path.c_str(), resolved)) return path;
+	return resolved;
+}
+
+// Creates <base>.oplog afresh, durably, before it replaces the old one
+int oplog_create(Vec2i size, uint64_t base, const std::string &path) {
+	std::string temporary = oplog.log_path + ".tmp";
+	int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) return -1;
+	// taken before the rename, so the log is never there unlocked
+	flock(fd, LOCK_EX | LOCK_NB);
+	uint16_t length = std::min(path.size(), (size_t)UINT16_MAX);
+	OpLogHeader header = { OPLOG_MAGIC, OPLOG_VERSION, length, size.width, size.height, base };
+	if (!write_at(fd, &header, sizeof(header), 0) || !write_at(fd, path.data(), length, sizeof(header)) ||
+			fdatasync(fd) != 0 || rename(temporary.c_str(), oplog.log_path.c_str()) != 0) {
+		close(fd);
+		unlink(temporary.c_str());
+		return -1;
+	}
+	lseek(fd, 0, SEEK_END);
+	return fd;
+}
+
+// The ops up to the checkpoint are all in the current log by now, so once
+// the document is on disk the log can start over after them
+void oplog_checkpoint(const DocumentState &state, const std::string &path, bool parallel) {
+	if (!write_document(oplog.document, oplog.checkpoint_path.c_str(), state, parallel)) return;
+	int fd = oplog_create(state.size, state.sequence, path);
+	if (fd < 0) {
+		printf("Can't start a new operation log in %s\n", oplog.log_path.c_str());
+		return;
+	}
+	if (oplog.fd >= 0) close(oplog.fd);
+	oplog.fd = fd;
+	oplog.checkpoints++;
+}
+
+void append_record(std::vector<unsigned char> &batch, const CanvasOp &op, std::vector<uint32_t> &scratch) {
+	OpRecord record = { 0, (uint8_t)op.type, (uint8_t)op.flags, 0, {}, op.color, 0 };
+	memcpy(record.v, op.v, sizeof(record.v));
+	const uint32_t *words = nullptr;
+	if (op.tile) words = snapshot_words(*op.tile, scratch, &record.words);
+	record.crc = record_crc(record, words);
+	const unsigned char *p = (const unsigned char *)&record;
+	batch.insert(batch.end(), p, p + sizeof(record));
+	p = (const unsigned char *)words;
+	if (record.words) batch.insert(batch.end(), p, p + record.words*sizeof(uint32_t));
+}
+
+void oplog_writer() {
+	PROFILE_THREAD("oplog");
+	std::vector<unsigned char> batch;
+	std::vector<uint32_t> scratch;
+	double synced = now_seconds();
+	bool unsynced = false;
+	while (true) {
+		bool stopping = oplog.stop.load(std::memory_order_acquire);
+		uint64_t head = oplog.head.load(std::memory_order_acquire);
+		uint64_t tail = oplog.tail.load(std::memory_order_relaxed);
+		for (; tail < head; tail++) {
+			OpSlot &slot = oplog.ring[tail % OPLOG_RING];
+			if (slot.checkpoint) {
+				if (!batch.empty() && write(oplog.fd, batch.data(), batch.size()) != (ssize_t)batch.size()) {
+					printf("Writing the operation log failed\n");
+				}
+				batch.clear();
+				oplog_checkpoint(*slot.checkpoint, slot.path, false);
+				slot.checkpoint.reset();
+				unsynced = false;
+			} else {
+				append_record(batch, slot.op, scratch);
+				slot.op.tile.reset();
+				oplog.written++;
+			}
+			oplog.tail.store(tail + 1, std::memory_order_release);
+		}
+		if (!batch.empty()) {
+			PROFILE_SCOPE("log write");
+			if (write(oplog.fd, batch.data(), batch.size()) != (ssize_t)batch.size()) printf("Writing the operation log failed\n");
+			batch.clear();
+			unsynced = true;
+		}
+		double now = now_seconds();
+		if (unsynced && (stopping || now - synced >= OPLOG_SYNC_MS/1000.0)) {
+			PROFILE_SCOPE("log sync");
+			fdatasync(oplog.fd);
+			synced = now;
+			unsynced = false;
+			oplog.syncs++;
+		}
+		if (stopping) return; // head was read after stop, so nothing is left
+		if (head != oplog.head.load(std::memory_order_acquire)) continue;
+		if (unsynced) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(OPLOG_POLL_MS));
+			continue;
+		}
+		// nothing to write or sync: no wake-ups until an op comes
+		std::unique_lock<std::mutex> guard(oplog.lock);
+		oplog.idle.store(true);
+		oplog.wake.wait(guard, [head] { return oplog.head.load() != head || oplog.stop.load(); });
+		oplog.idle.store(false);
+	}
+}
+
+// Checkpoints the document as it is and starts logging after it
+bool oplog_start(const char *base) {
+	oplog.log_path = std::string(base) + ".oplog";
+	oplog.checkpoint_path = std::string(base) + ".pdoc";
+	oplog.ring.reset(new OpSlot[OPLOG_RING]);
+	oplog.head = oplog.tail = 0;
+	oplog.stop = false;
+	oplog.idle = false;
+	oplog.fd = -1;
+	oplog.sequence = oplog.checkpointed = 0;
+	oplog.waits = 0;
+	oplog.written = oplog.syncs = oplog.checkpoints = 0;
+	oplog.checkpoint_time = now_seconds();
+	flush_strokes();
+	commit_history();
+	oplog_checkpoint(capture_document(0), oplog_document_path(document.path), true);
+	if (oplog.fd < 0) return false;
+	oplog.running = true;
+	oplog.writer = std::thread(oplog_writer);
+	op_hook = oplog_report;
+	return true;
+}
+
+// Called once per frame: hands a checkpoint to the writer once enough ops
+// or time went by, but never in the middle of a stroke, whose ops are
+// logged while its tiles aren't committed yet
+void oplog_tick() {
+	if (!oplog.running) return;
+	uint64_t ops = oplog.sequence - oplog.checkpointed;
+	double now = now_seconds();
+	if (ops == 0 || (ops < OPLOG_CHECKPOINT_OPS && now - oplog.checkpoint_time < OPLOG_CHECKPOINT_SECONDS)) return;
+	if (!input.segments.empty() || !canvas.history.touched_list.empty()) return;
+	uint64_t head = oplog.head.load(std::memory_order_relaxed);
+	while (head - oplog.tail.load(std::memory_order_acquire) >= OPLOG_RING) std::this_thread::yield();
+	OpSlot &slot = oplog.ring[head % OPLOG_RING];
+	slot.op.type = OPLOG_CHECKPOINT;
+	slot.checkpoint.reset(new DocumentState(capture_document(oplog.sequence)));
+	slot.path = oplog_document_path(document.path); // it changes when a new document is saved
+	oplog.head.store(head + 1);
+	oplog_wake();
+	oplog.checkpointed = oplog.sequence;
+	oplog.checkpoint_time = now;
+}
+
+// Waits for the writer to flush everything; a clean exit (remove) leaves
+// nothing to recover
+void oplog_stop(bool remove) {
+	if (!oplog.running) return;
+	op_hook = NULL;
+	oplog.stop.store(true);
+	oplog_wake();
+	oplog.writer.join();
+	close(oplog.fd);
+	oplog.running = false;
+	if (remove) {
+		unlink(oplog.log_path.c_str());
+		unlink(oplog.checkpoint_path.c_str());
+	}
+}
+
+void replay_segments(std::vector<StrokeSegment> &segments, int flags) {
+	if (segments.empty()) return;
+	stroke_antialias = flags & OP_ANTIALIAS;
+	linear_blending = flags & OP_LINEAR;
+	raster_segments(segments);
+	segments.clear();
+}
+
+bool read_log_header(FILE *file, OpLogHeader &header, std::string &path) {
+	if (fread(&header, sizeof(header), 1, file) != 1) return false;
+	if (header.magic != OPLOG_MAGIC || header.version != OPLOG_VERSION || header.width <= 0 || header.height <= 0) return false;
+	path.resize(header.path_length);
+	return fread(&path[0], 1, path.size(), file) == path.size();
+}
+
+// Whether a running session is logging to <base>.oplog
+bool oplog_in_use(const char *base) {
+	int fd = open((std::string(base) + ".oplog").c_str(), O_RDONLY);
+	if (fd < 0) return false;
+	bool locked = flock(fd, LOCK_EX | LOCK_NB) != 0 && errno == EWOULDBLOCK;
+	close(fd);
+	return locked;
+}
+
+// Whether a crashed session left <base>.oplog behind, and the path of the
+// document it was editing, empty if it had never been saved
+bool oplog_owner(const char *base, std::string &path) {
+	std::string log_path = std::string(base) + ".oplog";
+	FILE *file = fopen(log_path.c_str(), "rb");
+	if (!file) return false;
+	OpLogHeader header;
+	bool ok = read_log_header(file, header, path);
+	fclose(file);
+	if (!ok) printf("%s is not an operation log this build can read\n", log_path.c_str());
+	return ok;
+}
+
+// Rebuilds the document a crashed session left in <base>.pdoc and
+// <base>.oplog, and makes the file it was editing the one to save to. The
+// log is read up to the first record that is torn or doesn't check out.
+// Returns false when there was nothing to recover.
+bool oplog_recover(const char *base) {
+	double start = now_seconds();
+	std::string log_path = std::string(base) + ".oplog", checkpoint_path = std::string(base) + ".pdoc";
+	FILE *file = fopen(log_path.c_str(), "rb");
+	if (!file) return false;
+	OpLogHeader header;
+	std::string path;
+	if (!read_log_header(file, header, path)) {
+		fclose(file);
+		printf("%s is not an operation log this build can read\n", log_path.c_str());
+		return false;
+	}
+	std::vector<unsigned char> log;
+	unsigned char chunk[1 << 16];
+	size_t n;
+	while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0) log.insert(log.end(), chunk, chunk + n);
+	fclose(file);
+
+	Document checkpoint = {};
+	uint64_t done = header.base;
+	bool opened = access(checkpoint_path.c_str(), F_OK) == 0 && open_document(checkpoint, checkpoint_path.c_str());
+	if (opened) {
+		done = checkpoint.sequence;
+		if (done < header.base) printf("Checkpoint %s is older than its log; ops are missing\n", checkpoint_path.c_str());
+	} else {
+		create_canvas(header.width, header.height);
+	}
+
+	bool antialias = stroke_antialias, linear = linear_blending;
+	std::vector<StrokeSegment> segments;
+	int segment_flags = 0;
+	uint64_t sequence = header.base, applied = 0;
+	size_t p = 0;
+	while (p + sizeof(OpRecord) <= log.size()) {
+		OpRecord record;
+		memcpy(&record, log.data() + p, sizeof(record));
+		size_t size = sizeof(record) + (size_t)record.words*sizeof(uint32_t);
+		if (record.words > TILE_SIZE*TILE_SIZE*2 || p + size > log.size()) break;
+		std::vector<uint32_t> words(record.words);
+		memcpy(words.data(), log.data() + p + sizeof(record), record.words*sizeof(uint32_t));
+		if (record_crc(record, words.data()) != record.crc) break;
+		p += size;
+		if (++sequence <= done) continue;
+		applied++;
+
+		if (record.type == OP_SEGMENT && (segments.empty() || record.flags == segment_flags)) {
+			segment_flags = record.flags;
+			segments.push_back({ { record.v[0], record.v[1] }, { record.v[2], record.v[3] }, clamp(record.v[4], 0, MAX_BRUSH_R), record.color });
+			continue;
+		}
+		replay_segments(segments, segment_flags);
+		switch (record.type) {
+			case OP_SEGMENT:
+				segment_flags = record.flags;
+				segments.push_back({ { record.v[0], record.v[1] }, { record.v[2], record.v[3] }, clamp(record.v[4], 0, MAX_BRUSH_R), record.color });
+				break;
+			case OP_FILL:
+				boundary_fill(record.v[0], record.v[1], record.color);
+				break;
+			case OP_CLEAR:
+				clear_canvas(record.flags & OP_RESET);
+				break;
+			case OP_COMMIT:
+				commit_history();
+				break;
+			case OP_TILE: {
+				if (record.v[0] < 0 || record.v[0] >= (int)canvas.layers.size() || record.v[1] < 0 || record.v[1] >= (int)canvas.tiles.size()) break;
+				TileRef tile;
+				if (record.words) {
+					tile = std::make_shared<TileSnapshot>();
+					uint32_t *packed = new uint32_t[record.words];
+					std::copy(words.begin(), words.end(), packed);
+					tile->packed.reset(packed, std::default_delete<uint32_t[]>());
+					tile->words = record.words;
+					tile->bytes = record.words*sizeof(uint32_t);
+				}
+				restore_tile(record.v[0], record.v[1], tile);
+				break;
+			}
+			case OP_ADD_LAYER:
+				add_layer();
+				break;
+			case OP_SELECT_LAYER:
+				select_layer(record.v[0]);
+				break;
+			case OP_LAYER:
+				if (record.v[0] < 0 || record.v[0] >= (int)canvas.layers.size()) break;
+				canvas.layers[record.v[0]].opacity = clamp(record.v[1], 0, 255);
+				canvas.layers[record.v[0]].blend = clamp(record.v[2], 0, BLEND_MODES - 1);
+				canvas.layers[record.v[0]].visible = record.v[3];
+				layer_changed(record.v[0]);
+				break;
+		}
+	}
+	replay_segments(segments, segment_flags);
+	commit_history(); // strokes the session didn't get to commit become a step
+	document = {};
+	document.path = path; // saving writes the file the session was editing
+	stroke_antialias = antialias;
+	linear_blending = linear;
+	mark_canvas_dirty();
+	printf("Recovered %s: %llu ops replayed over %s, %.1f ms\n", log_path.c_str(), (unsigned long long)applied,
+			opened ? "the checkpoint" : "a new canvas", (now_seconds() - start)*1e3);
+	return true;
+}
+
+#endif
@@ -0,0 +1,132 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "profile.h"
+
+// Work-stealing pool for raster jobs. parallel_for deals the job indices out
+// to one queue per thread, the calling thread included; each thread runs its
+// own queue from the back and, once it is empty, steals from the front of
+// the others. Jobs must not depend on the order they run in.
+
+struct WorkQueue {
+	std::mutex lock;
+	std::deque<int> jobs;
+};
+
+struct WorkerPool {
+	std::vector<std::thread> workers;
+	std::unique_ptr<WorkQueue[]> queues; // queues[0] belongs to the caller
+	int size;
+	std::mutex lock;
+	std::condition_variable wake, done;
+	std::atomic<const std::function<void(int)> *> job;
+	std::atomic<int> remaining;
+	unsigned long generation;
+	bool stop;
+	std::atomic<unsigned long> steals;
+};
+
+WorkerPool pool = {};
+
+bool pool_take(int self, int *index) {
+	{
+		WorkQueue &own = pool.queues[self];
+		std::lock_guard<std::mutex> guard(own.lock);
+		if (!own.jobs.empty()) {
+			*index = own.jobs.back();
+			own.jobs.pop_back();
+			return true;
+		}
+	}
+	for (int k = 1; k < pool.size; k++) {
+		WorkQueue &other = pool.queues[(self + k) % pool.size];
+		std::lock_guard<std::mutex> guard(other.lock);
+		if (!other.jobs.empty()) {
+			*index = other.jobs.front();
+			other.jobs.pop_front();
+			pool.steals++;
+			return true;
+		}
+	}
+	return false;
+}
+
+void pool_run(int self) {
+	int index;
+	while (pool_take(self, &index)) {
+		// read after taking the index, so it belongs to the same batch
+		(*pool.job.load())(index);
+		if (--pool.remaining == 0) {
+			std::lock_guard<std::mutex> guard(pool.lock);
+			pool.done.notify_all();
+		}
+	}
+}
+
+void pool_worker(int self) {
+	PROFILE_THREAD("pool");
+	unsigned long seen = 0;
+	while (true) {
+		{
+			std::unique_lock<std::mutex> guard(pool.lock);
+			pool.wake.wait(guard, [&] { return pool.stop || pool.generation != seen; });
+			if (pool.stop) return;
+			seen = pool.generation;
+		}
+		PROFILE_SCOPE("jobs");
+		pool_run(self);
+	}
+}
+
+void pool_stop() {
+	{
+		std::lock_guard<std::mutex> guard(pool.lock);
+		pool.stop = true;
+	}
+	pool.wake.notify_all();
+	for (std::thread &t : pool.workers) t.join();
+	pool.workers.clear();
+	pool.stop = false;
+}
+
+// threads counts the caller; 0 means one per hardware thread
+void pool_start(int threads) {
+	pool_stop();
+	if (threads <= 0) threads = std::max(1u, std::thread::hardware_concurrency());
+	pool.size = threads;
+	pool.queues.reset(new WorkQueue[threads]);
+	for (int i = 1; i < threads; i++) pool.workers.emplace_back(pool_worker, i);
+}
+
+void parallel_for(int count, const std::function<void(int)> &job) {
+	if (pool.size <= 1 || count <= 1) {
+		for (int i = 0; i < count; i++) job(i);
+		return;
+	}
+	pool.job = &job;
+	pool.remaining = count;
+	// contiguous blocks, so neighbouring jobs start on the same thread
+	for (int t = 0; t < pool.size; t++) {
+		WorkQueue &q = pool.queues[t];
+		std::lock_guard<std::mutex> guard(q.lock);
+		for (int i = (long)count*t/pool.size; i < (long)count*(t + 1)/pool.size; i++) q.jobs.push_back(i);
+	}
+	{
+		std::lock_guard<std::mutex> guard(pool.lock);
+		pool.generation++;
+	}
+	pool.wake.notify_all();
+	pool_run(0);
+	std::unique_lock<std::mutex> guard(pool.lock);
+	pool.done.wait(guard, [] { return pool.remaining == 0; });
+}
+
+#endif
@@ -0,0 +1,286 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Hot-path profiler. PROFILE_SCOPE times the rest of the enclosing block
+// into a ring owned by the calling thread, so recording an event is two
+// clock reads and a store; the main thread drains every ring once per frame
+// in profile_frame. With --profile <base> the events go to <base>.json as a
+// Chrome trace (chrome://tracing, Perfetto) and a per-second summary of
+// every event name to <base>.csv; the last frames of the main thread are
+// kept for the overlay. Building with -DPAINT_NO_PROFILE leaves the macros
+// empty and the functions doing nothing.
+
+#ifndef PAINT_NO_PROFILE
+
+#define PROFILE_RING (1 << 14) // events per thread between two drains
+#define PROFILE_FRAMES 240     // kept for the overlay
+
+// Stages the overlay stacks, in order; the rest of a frame is drawn as other
+enum ProfileStage {
+	STAGE_INPUT,
+	STAGE_RASTER,
+	STAGE_COMMIT,
+	STAGE_UPLOAD,
+	STAGE_MIPS,
+	STAGE_DRAW,
+	PROFILE_STAGES
+};
+
+const char *profile_stage_names[PROFILE_STAGES] = { "input", "raster", "commit", "upload", "mips", "draw" };
+
+struct ProfileEvent {
+	const char *name; // a string literal
+	uint64_t start, end; // ns since the profiler started
+};
+
+struct ProfileRing {
+	ProfileEvent events[PROFILE_RING];
+	std::atomic<uint64_t> head, tail; // written by the owner, drained up to
+	std::atomic<bool> released; // its thread exited, the next one can take it
+	const char *name;
+	int tid;
+	unsigned long dropped; // events that found the ring full
+};
+
+// CPU ms of the main thread in one frame. Stages nested in others only
+// count in the innermost, so the parts add up to the frame.
+struct ProfileFrame {
+	float stages[PROFILE_STAGES];
+	float other; // in the frame but in none of the stages
+};
+
+// Stage event of the frame being put together
+struct ProfileMark {
+	uint64_t start, end;
+	bool claimed; // already taken out of the event that contains it
+};
+
+// Per-second totals of one event name over every thread
+struct ProfileTotal {
+	const char *name;
+	unsigned long count;
+	double total, max; // ms
+};
+
+struct Profiler {
+	std::chrono::steady_clock::time_point epoch;
+	std::mutex lock; // guards rings
+	std::vector<std::unique_ptr<ProfileRing>> rings;
+	ProfileRing *main;
+	FILE *trace, *csv;
+	bool traced; // an event was written, so the next needs a comma
+	std::vector<ProfileTotal> totals;
+	uint64_t second; // the one totals belong to
+	ProfileFrame frame, frames[PROFILE_FRAMES];
+	std::vector<ProfileMark> marks;
+	unsigned long frame_count;
+};
+
+Profiler profiler = { std::chrono::steady_clock::now() };
+
+uint64_t profile_now() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - profiler.epoch).count();
+}
+
+// Rings of threads that exited are reused, as exports get a thread each
+ProfileRing *profile_register(const char *name) {
+	std::lock_guard<std::mutex> guard(profiler.lock);
+	for (auto &ring : profiler.rings) {
+		if (ring->released.exchange(false, std::memory_order_acquire)) {
+			ring->name = name;
+			return ring.get();
+		}
+	}
+	ProfileRing *ring = new ProfileRing();
+	ring->name = name;
+	ring->tid = profiler.rings.size() + 1;
+	profiler.rings.emplace_back(ring);
+	return ring;
+}
+
+struct ProfileThread {
+	ProfileRing *ring = profile_register("thread");
+	~ProfileThread() { ring->released.store(true, std::memory_order_release); }
+};
+
+ProfileRing *profile_ring() {
+	thread_local ProfileThread thread;
+	return thread.ring;
+}
+
+void profile_record(ProfileRing *ring, const char *name, uint64_t start, uint64_t end) {
+	uint64_t head = ring->head.load(std::memory_order_relaxed);
+	if (head - ring->tail.load(std::memory_order_acquire) >= PROFILE_RING) {
+		ring->dropped++;
+		return;
+	}
+	ring->events[head % PROFILE_RING] = { name, start, end };
+	ring->head.store(head + 1, std::memory_order_release);
+}
+
+// Names the calling thread in the trace
+void profile_thread(const char *name) {
+	profile_ring()->name = name;
+}
+
+struct ProfileScope {
+	const char *name;
+	uint64_t start;
+	ProfileScope(const char *name) : name(name), start(profile_now()) {}
+	~ProfileScope() { profile_record(profile_ring(), name, start, profile_now()); }
+};
+
+#define PROFILE_CONCAT(a, b) a##b
+#define PROFILE_NAME(line) PROFILE_CONCAT(profile_scope_, line)
+#define PROFILE_SCOPE(name) ProfileScope PROFILE_NAME(__LINE__)(name)
+#define PROFILE_THREAD(name) profile_thread(name)
+// For spans that don't match a block
+#define PROFILE_MARK(var) uint64_t var = profile_now()
+#define PROFILE_SINCE(var, name) profile_record(profile_ring(), name, var, profile_now())
+
+// Called on the main thread; with a base name it also writes the trace and
+// the summary
+void profile_start(const char *base) {
+	profile_thread("main");
+	profiler.main = profile_ring();
+	if (!base) return;
+	profiler.trace = fopen((std::string(base) + ".json").c_str(), "w");
+	profiler.csv = fopen((std::string(base) + ".csv").c_str(), "w");
+	if (!profiler.trace || !profiler.csv) printf("Can't write the profile to %s.json and %s.csv\n", base, base);
+	if (profiler.trace) fprintf(profiler.trace, "{\"traceEvents\":[\n");
+	if (profiler.csv) fprintf(profiler.csv, "second,event,count,total_ms,max_ms\n");
+}
+
+void profile_flush_second() {
+	for (ProfileTotal &t : profiler.totals) {
+		if (!t.count) continue;
+		if (profiler.csv) fprintf(profiler.csv, "%llu,%s,%lu,%.3f,%.3f\n", (unsigned long long)profiler.second, t.name, t.count, t.total, t.max);
+		t.count = 0;
+		t.total = t.max = 0;
+	}
+}
+
+void profile_count(const ProfileEvent &e) {
+	// Rings are drained one after the other, so a late event counts in the
+	// second being summed
+	double ms = (e.end - e.start)*1e-6;
+	uint64_t second = e.start / 1000000000;
+	if (second > profiler.second) {
+		profile_flush_second();
+		profiler.second = second;
+	}
+	ProfileTotal *total = nullptr;
+	for (ProfileTotal &t : profiler.totals) {
+		if (!strcmp(t.name, e.name)) total = &t;
+	}
+	if (!total) {
+		profiler.totals.push_back({ e.name, 0, 0, 0 });
+		total = &profiler.totals.back();
+	}
+	total->count++;
+	total->total += ms;
+	if (ms > total->max) total->max = ms;
+}
+
+// A "frame" event of the main thread closes the frame its stages were added
+// to. Events arrive as they end, so the ones nested in an event are already
+// marked and its own time is what they leave.
+void profile_frame_event(const ProfileEvent &e) {
+	int stage = -1;
+	for (int s = 0; s < PROFILE_STAGES; s++) {
+		if (!strcmp(e.name, profile_stage_names[s])) stage = s;
+	}
+	bool frame = !strcmp(e.name, "frame");
+	if (stage < 0 && !frame) return;
+	uint64_t own = e.end - e.start;
+	for (ProfileMark &m : profiler.marks) {
+		if (m.claimed || m.start < e.start || m.end > e.end) continue;
+		own -= m.end - m.start;
+		m.claimed = true;
+	}
+	ProfileFrame &f = profiler.frame;
+	if (frame) {
+		f.other = own*1e-6f;
+		profiler.frames[profiler.frame_count++ % PROFILE_FRAMES] = f;
+		f = {};
+		profiler.marks.clear();
+		return;
+	}
+	f.stages[stage] += own*1e-6f;
+	profiler.marks.push_back({ e.start, e.end, false });
+}
+
+// Drains every ring; called once per frame on the main thread
+void profile_frame() {
+	static std::vector<ProfileRing *> rings;
+	{
+		std::lock_guard<std::mutex> guard(profiler.lock);
+		rings.clear();
+		for (auto &ring : profiler.rings) rings.push_back(ring.get());
+	}
+	for (ProfileRing *ring : rings) {
+		uint64_t head = ring->head.load(std::memory_order_acquire);
+		uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+		for (; tail < head; tail++) {
+			const ProfileEvent &e = ring->events[tail % PROFILE_RING];
+			if (ring == profiler.main) profile_frame_event(e);
+			if (profiler.csv) profile_count(e);
+			if (profiler.trace) {
+				fprintf(profiler.trace, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+						profiler.traced ? ",\n" : "", e.name, ring->tid, e.start*1e-3, (e.end - e.start)*1e-3);
+				profiler.traced = true;
+			}
+		}
+		ring->tail.store(tail, std::memory_order_release);
+	}
+}
+
+// Last drain; closes the files with the thread names and what was dropped
+void profile_stop() {
+	profile_frame();
+	std::lock_guard<std::mutex> guard(profiler.lock);
+	unsigned long dropped = 0;
+	for (auto &ring : profiler.rings) {
+		dropped += ring->dropped;
+		if (!profiler.trace) continue;
+		fprintf(profiler.trace, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+				profiler.traced ? ",\n" : "", ring->tid, ring->name);
+		profiler.traced = true;
+	}
+	if (profiler.trace) {
+		fprintf(profiler.trace, "\n]}\n");
+		fclose(profiler.trace);
+		profiler.trace = NULL;
+	}
+	if (profiler.csv) {
+		profile_flush_second();
+		fclose(profiler.csv);
+		profiler.csv = NULL;
+	}
+	if (dropped) printf("[profile] %lu events dropped, the rings were full\n", dropped);
+}
+
+#else
+
+#define PROFILE_SCOPE(name)
+#define PROFILE_THREAD(name)
+#define PROFILE_MARK(var)
+#define PROFILE_SINCE(var, name)
+
+inline void profile_start(const char *base) {}
+inline void profile_frame() {}
+inline void profile_stop() {}
+
+#endif
+
+#endif
@@ -0,0 +1,255 @@
+#ifndef RESAMPLE_H
+#define RESAMPLE_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RESAMPLE_X86 1
+#endif
+
+// Row kernels for transforming an image: every output pixel samples the
+// source at a point that moves by a fixed step along the row, so any affine
+// transform is one call per destination row. Pixels are premultiplied RGBA8
+// and the source reads as transparent outside its bounds, which gives the
+// edges of a rotated image their coverage. Coordinates are fixed point with
+// RESAMPLE_SHIFT fractional bits, pixel centers at +0.5; filter weights are
+// 8-bit, and the SIMD versions round exactly like the scalar ones.
+
+#define RESAMPLE_SHIFT 14
+#define RESAMPLE_ONE (1 << RESAMPLE_SHIFT)
+#define RESAMPLE_MAX 16384 // side of a source, so coordinates and the madd indices fit
+
+enum ResampleFilter {
+	RESAMPLE_NEAREST,
+	RESAMPLE_BILINEAR,
+	RESAMPLE_BICUBIC, // Catmull-Rom
+	RESAMPLE_FILTERS
+};
+
+const char *resample_filter_names[RESAMPLE_FILTERS] = { "nearest", "bilinear", "bicubic" };
+
+// Source pixels a filter can reach past the sample point on each side
+const int resample_reach[RESAMPLE_FILTERS] = { 0, 1, 2 };
+
+struct ResampleSource {
+	const uint32_t *pixels; // bottom row first, width pixels apart
+	int width, height;
+};
+
+// Catmull-Rom weights of the 4 taps for every 8-bit fraction, summing to 256
+struct CubicWeights {
+	int16_t w[256][4];
+};
+
+CubicWeights make_cubic_weights() {
+	CubicWeights c;
+	for (int f = 0; f < 256; f++) {
+		double t = f / 256.0, t2 = t*t, t3 = t2*t;
+		double w[4] = { (-t3 + 2*t2 - t)/2, (3*t3 - 5*t2 + 2)/2, (-3*t3 + 4*t2 + t)/2, (t3 - t2)/2 };
+		int sum = 0;
+		for (int i = 0; i < 4; i++) sum += c.w[f][i] = (int16_t)lround(w[i]*256);
+		c.w[f][f < 128 ? 1 : 2] += 256 - sum; // the rounding goes to the nearest tap
+	}
+	return c;
+}
+
+const CubicWeights cubic_weights = make_cubic_weights();
+
+inline uint32_t resample_fetch(const ResampleSource &s, int x, int y) {
+	if (x < 0 || y < 0 || x >= s.width || y >= s.height) return 0;
+	return s.pixels[(size_t)y*s.width + x];
+}
+
+// Every channel interpolated across, then the two rows down, rounding each
+inline uint32_t bilinear_pixel(const ResampleSource &s, int32_t x, int32_t y) {
+	x -= RESAMPLE_ONE / 2;
+	y -= RESAMPLE_ONE / 2;
+	int x0 = x >> RESAMPLE_SHIFT, y0 = y >> RESAMPLE_SHIFT;
+	if (x0 < -1 || y0 < -1 || x0 >= s.width || y0 >= s.height) return 0;
+	unsigned fx = x >> (RESAMPLE_SHIFT - 8) & 255, fy = y >> (RESAMPLE_SHIFT - 8) & 255;
+	uint32_t a = resample_fetch(s, x0, y0), b = resample_fetch(s, x0 + 1, y0);
+	uint32_t c = resample_fetch(s, x0, y0 + 1), d = resample_fetch(s, x0 + 1, y0 + 1);
+	uint32_t out = 0;
+	for (int shift = 0; shift < 32; shift += 8) {
+		unsigned bottom = ((a >> shift & 255)*(256 - fx) + (b >> shift & 255)*fx + 128) >> 8;
+		unsigned top = ((c >> shift & 255)*(256 - fx) + (d >> shift & 255)*fx + 128) >> 8;
+		out |= (bottom*(256 - fy) + top*fy + 128) >> 8 << shift;
+	}
+	return out;
+}
+
+inline int clamp255(int v) {
+	return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+// 4x4 taps, rows first, each row rounded to 8 bits before the column. The
+// negative lobes can overshoot, so the result is clamped and its colors
+// kept within alpha to stay premultiplied.
+inline uint32_t bicubic_pixel(const ResampleSource &s, int32_t x, int32_t y) {
+	x -= RESAMPLE_ONE / 2;
+	y -= RESAMPLE_ONE / 2;
+	int x0 = (x >> RESAMPLE_SHIFT) - 1, y0 = (y >> RESAMPLE_SHIFT) - 1;
+	if (x0 < -3 || y0 < -3 || x0 >= s.width || y0 >= s.height) return 0;
+	const int16_t *wx = cubic_weights.w[x >> (RESAMPLE_SHIFT - 8) & 255];
+	const int16_t *wy = cubic_weights.w[y >> (RESAMPLE_SHIFT - 8) & 255];
+	int sum[4] = {};
+	for (int j = 0; j < 4; j++) {
+		int row[4] = {};
+		for (int i = 0; i < 4; i++) {
+			uint32_t p = resample_fetch(s, x0 + i, y0 + j);
+			for (int c = 0; c < 4; c++) row[c] += (int)(p >> 8*c & 255)*wx[i];
+		}
+		for (int c = 0; c < 4; c++) sum[c] += ((row[c] + 128) >> 8)*wy[j];
+	}
+	int alpha = clamp255((sum[3] + 128) >> 8);
+	uint32_t out = (uint32_t)alpha << 24;
+	for (int c = 0; c < 3; c++) out |= (uint32_t)std::min(clamp255((sum[c] + 128) >> 8), alpha) << 8*c;
+	return out;
+}
+
+// n pixels sampling the source at (x, y), (x + dx, y + dy)...
+void resample_nearest_scalar(uint32_t *dst, const ResampleSource &src, int32_t x, int32_t y, int32_t dx, int32_t dy, int n) {
+	for (int i = 0; i < n; i++, x += dx, y += dy) {
+		dst[i] = resample_fetch(src, x >> RESAMPLE_SHIFT, y >> RESAMPLE_SHIFT);
+	}
+}
+
+void resample_bilinear_scalar(uint32_t *dst, const ResampleSource &src, int32_t x, int32_t y, int32_t dx, int32_t dy, int n) {
+	for (int i = 0; i < n; i++, x += dx, y += dy) dst[i] = bilinear_pixel(src, x, y);
+}
+
+void resample_bicubic_scalar(uint32_t *dst, const ResampleSource &src, int32_t x, int32_t y, int32_t dx, int32_t dy, int n) {
+	for (int i = 0; i < n; i++, x += dx, y += dy) dst[i] = bicubic_pixel(src, x, y);
+}
+
+#ifdef RESAMPLE_X86
+
+// Nearest: 4 positions at a time, the bounds test and the index y*width + x
+// as one madd of the 16-bit halves (x, y) by (1, width). The loads stay
+// scalar; SSE2 has no gather.
+void resample_nearest_sse2(uint32_t *dst, const ResampleSource &src, int32_t x, int32_t y, int32_t dx, int32_t dy, int n) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i last_x = _mm_set1_epi32(src.width - 1), last_y = _mm_set1_epi32(src.height - 1);
+	const __m128i stride = _mm_set1_epi32(1 | src.width << 16);
+	__m128i px = _mm_add_epi32(_mm_set1_epi32(x), _mm_setr_epi32(0, dx, 2*dx, 3*dx));
+	__m128i py = _mm_add_epi32(_mm_set1_epi32(y), _mm_setr_epi32(0, dy, 2*dy, 3*dy));
+	const __m128i step_x = _mm_set1_epi32(4*dx), step_y = _mm_set1_epi32(4*dy);
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128i ix = _mm_srai_epi32(px, RESAMPLE_SHIFT), iy = _mm_srai_epi32(py, RESAMPLE_SHIFT);
+		__m128i out = _mm_or_si128(_mm_or_si128(_mm_cmplt_epi32(ix, zero), _mm_cmplt_epi32(iy, zero)),
+				_mm_or_si128(_mm_cmpgt_epi32(ix, last_x), _mm_cmpgt_epi32(iy, last_y)));
+		__m128i xy = _mm_andnot_si128(out, _mm_or_si128(ix, _mm_slli_epi32(iy, 16)));
+		alignas(16) int32_t index[4], skip[4];
+		_mm_store_si128((__m128i *)index, _mm_madd_epi16(xy, stride));
+		_mm_store_si128((__m128i *)skip, out);
+		for (int k = 0; k < 4; k++) dst[i + k] = skip[k] ? 0 : src.pixels[index[k]];
+		px = _mm_add_epi32(px, step_x);
+		py = _mm_add_epi32(py, step_y);
+	}
+	resample_nearest_scalar(dst + i, src, x + i*dx, y + i*dy, dx, dy, n - i);
+}
+
+// Bilinear, for a sample whose 2x2 taps are all inside: each row of taps is
+// one 64-bit load, both rows interpolated across in one register, then down.
+// Leaves the 4 channels in the low 16-bit lanes.
+inline __m128i bilinear_sse2(const uint32_t *bottom, const uint32_t *top, unsigned fx, unsigned fy) {
+	const __m128i zero = _mm_setzero_si128(), half = _mm_set1_epi16(128);
+	__m128i rows = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)bottom), _mm_loadl_epi64((const __m128i *)top));
+	__m128i wx = _mm_unpacklo_epi64(_mm_set1_epi16(256 - fx), _mm_set1_epi16(fx));
+	__m128i b = _mm_mullo_epi16(_mm_unpacklo_epi8(rows, zero), wx);
+	__m128i t = _mm_mullo_epi16(_mm_unpackhi_epi8(rows, zero), wx);
+	__m128i across = _mm_add_epi16(_mm_unpacklo_epi64(b, t), _mm_unpackhi_epi64(b, t));
+	across = _mm_srli_epi16(_mm_add_epi16(across, half), 8);
+	__m128i down = _mm_mullo_epi16(across, _mm_unpacklo_epi64(_mm_set1_epi16(256 - fy), _mm_set1_epi16(fy)));
+	down = _mm_add_epi16(down, _mm_srli_si128(down, 8));
+	return _mm_srli_epi16(_mm_add_epi16(down, half), 8);
+}
+
+// Pairs of samples share the final pack; ones near the edges of the source
+// go through the scalar pixel
+void resample_bilinear_sse2(uint32_t *dst, const ResampleSource &src, int32_t x, int32_t y, int32_t dx, int32_t dy, int n) {
+	__m128i pending = _mm_setzero_si128();
+	for (int i = 0; i < n; i++, x += dx, y += dy) {
+		int32_t sx = x - RESAMPLE_ONE / 2, sy = y - RESAMPLE_ONE / 2;
+		int x0 = sx >> RESAMPLE_SHIFT, y0 = sy >> RESAMPLE_SHIFT;
+		__m128i v;
+		if (x0 >= 0 && y0 >= 0 && x0 + 1 < src.width && y0 + 1 < src.height) {
+			const uint32_t *bottom = src.pixels + (size_t)y0*src.width + x0;
+			v = bilinear_sse2(bottom, bottom + src.width, sx >> (RESAMPLE_SHIFT - 8) & 255, sy >> (RESAMPLE_SHIFT - 8) & 255);
+		} else {
+			v = _mm_unpacklo_epi8(_mm_cvtsi32_si128(bilinear_pixel(src, x, y)), _mm_setzero_si128());
+		}
+		if (i % 2 == 0) {
+			pending = v;
+			if (i + 1 < n) continue;
+		}
+		__m128i packed = _mm_packus_epi16(_mm_unpacklo_epi64(pending, v), _mm_setzero_si128());
+		if (i % 2) _mm_storel_epi64((__m128i *)(dst + i - 1), packed);
+		else dst[i] = _mm_cvtsi128_si32(packed);
+	}
+}
+
+// Bicubic for a sample whose 4x4 taps are all inside. A row of taps is one
+// load; pairs of taps are interleaved per channel so madd multiplies and
+// adds them into 32-bit sums, and the rounded rows go through the same for
+// the column.
+inline uint32_t bicubic_sse2(const uint32_t *row, int stride, const int16_t *wx, const int16_t *wy) {
+	const __m128i zero = _mm_setzero_si128(), half = _mm_set1_epi32(128);
+	const __m128i w01 = _mm_set1_epi32((uint16_t)wx[0] | (uint32_t)(uint16_t)wx[1] << 16);
+	const __m128i w23 = _mm_set1_epi32((uint16_t)wx[2] | (uint32_t)(uint16_t)wx[3] << 16);
+	__m128i rows[4];
+	for (int j = 0; j < 4; j++, row += stride) {
+		__m128i p = _mm_loadu_si128((const __m128i *)row);
+		__m128i lo = _mm_unpacklo_epi8(p, zero), hi = _mm_unpackhi_epi8(p, zero);
+		__m128i sum = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(lo, _mm_srli_si128(lo, 8)), w01),
+				_mm_madd_epi16(_mm_unpacklo_epi16(hi, _mm_srli_si128(hi, 8)), w23));
+		rows[j] = _mm_srai_epi32(_mm_add_epi32(sum, half), 8);
+	}
+	const __m128i w01y = _mm_set1_epi32((uint16_t)wy[0] | (uint32_t)(uint16_t)wy[1] << 16);
+	const __m128i w23y = _mm_set1_epi32((uint16_t)wy[2] | (uint32_t)(uint16_t)wy[3] << 16);
+	__m128i r01 = _mm_packs_epi32(rows[0], rows[1]), r23 = _mm_packs_epi32(rows[2], rows[3]);
+	__m128i sum = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(r01, _mm_srli_si128(r01, 8)), w01y),
+			_mm_madd_epi16(_mm_unpacklo_epi16(r23, _mm_srli_si128(r23, 8)), w23y));
+	sum = _mm_srai_epi32(_mm_add_epi32(sum, half), 8);
+	__m128i packed = _mm_packus_epi16(_mm_packs_epi32(sum, zero), zero);
+	__m128i alpha = _mm_srli_epi32(packed, 24);
+	alpha = _mm_or_si128(alpha, _mm_slli_epi32(alpha, 8));
+	alpha = _mm_or_si128(alpha, _mm_slli_epi32(alpha, 16));
+	return _mm_cvtsi128_si32(_mm_min_epu8(packed, alpha));
+}
+
+void resample_bicubic_sse2(uint32_t *dst, const ResampleSource &src, int32_t x, int32_t y, int32_t dx, int32_t dy, int n) {
+	for (int i = 0; i < n; i++, x += dx, y += dy) {
+		int32_t sx = x - RESAMPLE_ONE / 2, sy = y - RESAMPLE_ONE / 2;
+		int x0 = (sx >> RESAMPLE_SHIFT) - 1, y0 = (sy >> RESAMPLE_SHIFT) - 1;
+		if (x0 >= 0 && y0 >= 0 && x0 + 3 < src.width && y0 + 3 < src.height) {
+			dst[i] = bicubic_sse2(src.pixels + (size_t)y0*src.width + x0, src.width,
+					cubic_weights.w[sx >> (RESAMPLE_SHIFT - 8) & 255], cubic_weights.w[sy >> (RESAMPLE_SHIFT - 8) & 255]);
+		} else {
+			dst[i] = bicubic_pixel(src, x, y);
+		}
+	}
+}
+
+#endif
+
+typedef void (*ResampleRow)(uint32_t *dst, const ResampleSource &src, int32_t x, int32_t y, int32_t dx, int32_t dy, int n);
+
+ResampleRow select_resample_row(int filter) {
+#ifdef RESAMPLE_X86
+	ResampleRow rows[RESAMPLE_FILTERS] = { resample_nearest_sse2, resample_bilinear_sse2, resample_bicubic_sse2 };
+#else
+	ResampleRow rows[RESAMPLE_FILTERS] = { resample_nearest_scalar, resample_bilinear_scalar, resample_bicubic_scalar };
+#endif
+	return rows[filter];
+}
+
+ResampleRow resample_row[RESAMPLE_FILTERS] = {
+	select_resample_row(RESAMPLE_NEAREST), select_resample_row(RESAMPLE_BILINEAR), select_resample_row(RESAMPLE_BICUBIC)
+};
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef RLE_H
+#define RLE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+// Run-length coding of 32-bit pixels. Every run starts with a header word:
+// with the top bit set it stands for (header & RLE_COUNT) copies of the word
+// that follows, clear for that many literal words. Painted tiles are mostly
+// flat color or transparent, so they shrink to a few words.
+
+#define RLE_RUN 0x80000000u
+#define RLE_COUNT 0x7fffffffu
+#define RLE_MIN_RUN 3 // shorter repeats stay in the literal run
+
+void rle_encode(const uint32_t *src, int n, std::vector<uint32_t> &out) {
+	out.clear();
+	int literals = 0; // start of the pending literal run, as a count back from i
+	for (int i = 0; i < n;) {
+		int run = 1;
+		while (i + run < n && src[i + run] == src[i]) run++;
+		if (run < RLE_MIN_RUN) {
+			literals += run;
+			i += run;
+			continue;
+		}
+		if (literals) {
+			out.push_back(literals);
+			out.insert(out.end(), src + i - literals, src + i);
+			literals = 0;
+		}
+		out.push_back(RLE_RUN | run);
+		out.push_back(src[i]);
+		i += run;
+	}
+	if (literals) {
+		out.push_back(literals);
+		out.insert(out.end(), src + n - literals, src + n);
+	}
+}
+
+// False if the data doesn't decode to exactly n words
+bool rle_decode(const uint32_t *src, size_t size, uint32_t *dst, int n) {
+	size_t p = 0;
+	int i = 0;
+	while (p < size) {
+		uint32_t header = src[p++];
+		int count = header & RLE_COUNT;
+		if (count > n - i) return false;
+		if (header & RLE_RUN) {
+			if (p >= size) return false;
+			uint32_t value = src[p++];
+			for (int k = 0; k < count; k++) dst[i + k] = value;
+		} else {
+			if ((size_t)count > size - p) return false;
+			for (int k = 0; k < count; k++) dst[i + k] = src[p + k];
+			p += count;
+		}
+		i += count;
+	}
+	return i == n;
+}
+
+#endif
@@ -0,0 +1,26 @@
+#version 330 core
+
+in vec2 local;
+
+out vec4 frag_color;
+
+uniform sampler2D pixels;
+uniform bool lifted; // pixels holds the floating selection; else only the outline
+uniform float handle; // half side of the corner handles, window pixels
+
+// Premultiplied floating pixels under a dashed outline and the corner
+// handles, which keep their size in window pixels at any zoom or scale
+void main() {
+	frag_color = vec4(0.0);
+	if (lifted && all(lessThanEqual(abs(local), vec2(1.0)))) frag_color = texture(pixels, local * 0.5 + 0.5);
+	// window pixels from each pair of edges, negative outside
+	vec2 per_pixel = vec2(length(vec2(dFdx(local.x), dFdy(local.x))), length(vec2(dFdx(local.y), dFdy(local.y))));
+	vec2 inside = (1.0 - abs(local)) / per_pixel;
+	float dash = mod(floor((gl_FragCoord.x + gl_FragCoord.y) / 4.0), 2.0);
+	if ((abs(inside.x) < 0.5 && inside.y > -0.5) || (abs(inside.y) < 0.5 && inside.x > -0.5)) {
+		frag_color = vec4(vec3(dash), 1.0);
+	}
+	if (abs(inside.x) <= handle && abs(inside.y) <= handle) {
+		frag_color = max(abs(inside.x), abs(inside.y)) > handle - 1.0 ? vec4(0.0, 0.0, 0.0, 1.0) : vec4(1.0);
+	}
+}
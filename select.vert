@@ -0,0 +1,22 @@
+#version 330 core
+
+// The rectangle of a selection as transformed, straight into the window
+// over the canvas, grown so the corner handles fit. local runs from -1 to 1
+// across the selection.
+
+out vec2 local;
+
+uniform mat4 projection;
+uniform vec2 canvas_origin; // window position of the canvas corner at row 0
+uniform vec2 canvas_scale;  // window pixels per canvas pixel
+uniform vec2 center;        // canvas pixels
+uniform vec2 axis_x, axis_y; // from the center to the middle of two edges
+uniform float grow;         // window pixels
+
+void main() {
+	vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1) * 2.0 - 1.0;
+	vec2 extent = vec2(length(axis_x * canvas_scale), length(axis_y * canvas_scale));
+	local = corner * (1.0 + grow / max(extent, 1e-3));
+	vec2 p = center + local.x * axis_x + local.y * axis_y;
+	gl_Position = projection * vec4(canvas_origin + p * canvas_scale, -1.0, 1.0);
+}
@@ -4,43 +4,131 @@
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
 
-#include <fstream>
-#include <sstream>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <string>
+#include <vector>
+#include <sys/stat.h>
 
-class Shader {
-	public:
-		unsigned int id;
+// Programs are built from the sources embedded in assets.h. The linked
+// binary is cached per user, under $XDG_CACHE_HOME/paint or ~/.cache/paint,
+// in a file named after the driver and the sources, so later launches skip
+// compiling; one the driver doesn't take any more is built again.
 
-		Shader(const char* vertex_shader_path, const char* fragment_shader_path) {
-			std::string vertex_code;
-			std::string fragment_code;
-			std::ifstream vertex_shader_file;
-			std::ifstream fragment_shader_file;
+struct ShaderStats {
+	int cached, compiled;
+	double seconds;
+};
 
-			vertex_shader_file.exceptions(std::ifstream::failbit | std::ifstream::badbit);
-			fragment_shader_file.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+ShaderStats shader_stats = {};
 
-			try {
-				vertex_shader_file.open(vertex_shader_path);
-				fragment_shader_file.open(fragment_shader_path);
+struct ProgramBinaryHeader {
+	char magic[4]; // "PGLB"
+	uint32_t format, length;
+};
 
-				std::stringstream vertex_shader_stream, fragment_shader_stream;
-				vertex_shader_stream << vertex_shader_file.rdbuf();
-				fragment_shader_stream << fragment_shader_file.rdbuf();
+// Empty when there is no cache: no home, or a driver without binaries
+std::string shader_cache_dir() {
+	static std::string dir;
+	static bool checked = false;
+	if (checked) return dir;
+	checked = true;
+	GLint formats = 0;
+	if (GLEW_VERSION_4_1 || GLEW_ARB_get_program_binary) glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+	if (formats <= 0) return dir;
+	if (const char *xdg = getenv("XDG_CACHE_HOME")) {
+		dir = std::string(xdg);
+	} else if (const char *home = getenv("HOME")) {
+		dir = std::string(home) + "/.cache";
+		mkdir(dir.c_str(), 0755);
+	} else {
+		return dir;
+	}
+	dir += "/paint";
+	mkdir(dir.c_str(), 0755);
+	return dir;
+}
+
+// FNV-1a over the driver strings and both sources
+std::string shader_cache_path(const char *name, const char *vertex_code, const char *fragment_code) {
+	std::string dir = shader_cache_dir();
+	if (dir.empty()) return dir;
+	uint64_t hash = 0xcbf29ce484222325ull;
+	const char *parts[] = {
+		(const char *)glGetString(GL_VENDOR), (const char *)glGetString(GL_RENDERER),
+		(const char *)glGetString(GL_VERSION), vertex_code, fragment_code,
+	};
+	for (const char *part : parts) {
+		for (const char *c = part ? part : ""; ; c++) {
+			hash = (hash ^ (unsigned char)*c) * 0x100000001b3ull;
+			if (!*c) break; // the terminator separates the parts
+		}
+	}
+	char key[17];
+	snprintf(key, sizeof(key), "%016llx", (unsigned long long)hash);
+	return dir + "/" + name + "-" + key + ".bin";
+}
 
-				vertex_shader_file.close();
-				fragment_shader_file.close();
+class Shader {
+	public:
+		unsigned int id;
 
-				vertex_code = vertex_shader_stream.str();
-				fragment_code = fragment_shader_stream.str();
+		// name tells the cached binaries apart
+		Shader(const char *name, const char *vertex_shader_code, const char *fragment_shader_code) {
+			double start = glfwGetTime();
+			std::string cache_path = shader_cache_path(name, vertex_shader_code, fragment_shader_code);
+			id = glCreateProgram();
+			if (!cache_path.empty() && load_binary(cache_path)) {
+				shader_stats.cached++;
+			} else {
+				glDeleteProgram(id);
+				id = glCreateProgram();
+				compile(vertex_shader_code, fragment_shader_code, !cache_path.empty());
+				if (!cache_path.empty()) save_binary(cache_path);
+				shader_stats.compiled++;
 			}
-			catch (std::ifstream::failure e) {
-				std::cout << "ERROR::SHADER::FILE_NOT_SUCCESSFULLY_READ\n";
+			shader_stats.seconds += glfwGetTime() - start;
+		}
+
+		bool load_binary(const std::string &path) {
+			FILE *file = fopen(path.c_str(), "rb");
+			if (!file) return false;
+			ProgramBinaryHeader header;
+			std::vector<char> binary;
+			bool ok = fread(&header, sizeof(header), 1, file) == 1 && !memcmp(header.magic, "PGLB", 4) && header.length <= 64 << 20;
+			if (ok) {
+				binary.resize(header.length);
+				ok = fread(binary.data(), 1, binary.size(), file) == binary.size();
 			}
-			const char* vertex_shader_code = vertex_code.c_str();
-			const char* fragment_shader_code = fragment_code.c_str();
+			fclose(file);
+			if (!ok) return false;
+			glProgramBinary(id, header.format, binary.data(), binary.size());
+			int success;
+			glGetProgramiv(id, GL_LINK_STATUS, &success);
+			return success;
+		}
+
+		// Written next to the final name first, so a crash leaves no torn binary
+		void save_binary(const std::string &path) {
+			int length = 0;
+			glGetProgramiv(id, GL_PROGRAM_BINARY_LENGTH, &length);
+			if (length <= 0) return;
+			ProgramBinaryHeader header = { { 'P', 'G', 'L', 'B' }, 0, 0 };
+			std::vector<char> binary(length);
+			GLsizei written = 0;
+			glGetProgramBinary(id, length, &written, &header.format, binary.data());
+			header.length = written;
+			std::string temporary = path + ".tmp";
+			FILE *file = fopen(temporary.c_str(), "wb");
+			if (!file) return;
+			bool ok = fwrite(&header, sizeof(header), 1, file) == 1 && fwrite(binary.data(), 1, written, file) == (size_t)written;
+			if (fclose(file) == 0 && ok) rename(temporary.c_str(), path.c_str());
+			else remove(temporary.c_str());
+		}
 
+		void compile(const char *vertex_shader_code, const char *fragment_shader_code, bool retrievable) {
 			unsigned int vertex, fragment;
 			int success;
 			char info_log[512];
@@ -52,7 +140,7 @@ class Shader {
 			glGetShaderiv(vertex, GL_COMPILE_STATUS, &success);
 			if (!success) {
 				glGetShaderInfoLog(vertex, 512, NULL, info_log);
-				std::cout << "ERROR::SHADER::VERTEX::COMPILATION_FAILED\n" << info_log << std::endl;
+				printf("ERROR::SHADER::VERTEX::COMPILATION_FAILED\n%s\n", info_log);
 			}
 
 			fragment = glCreateShader(GL_FRAGMENT_SHADER);
@@ -62,18 +150,18 @@ class Shader {
 			glGetShaderiv(fragment, GL_COMPILE_STATUS, &success);
 			if (!success) {
 				glGetShaderInfoLog(fragment, 512, NULL, info_log);
-				std::cout << "ERROR::SHADER::FRAGMENT::COMPILATION_FAILED\n" << info_log << std::endl;
+				printf("ERROR::SHADER::FRAGMENT::COMPILATION_FAILED\n%s\n", info_log);
 			}
 
-			id = glCreateProgram();
 			glAttachShader(id, vertex);
 			glAttachShader(id, fragment);
+			if (retrievable) glProgramParameteri(id, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
 			glLinkProgram(id);
 
 			glGetProgramiv(id, GL_LINK_STATUS, &success);
 			if (!success) {
 				glGetProgramInfoLog(id, 512, NULL, info_log);
-				std::cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << info_log << std::endl;
+				printf("ERROR::SHADER::PROGRAM::LINKING_FAILED\n%s\n", info_log);
 			}
 
 			glDeleteShader(vertex);
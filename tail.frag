@@ -0,0 +1,23 @@
+#version 330 core
+
+flat in vec4 tail_segment;
+flat in float tail_radius;
+flat in vec4 tail_color;
+in vec2 canvas_pixel;
+
+out vec4 frag_color;
+
+uniform bool antialias;
+
+// The coverage of brush.frag, per canvas pixel, so the tail looks like the
+// stroke that replaces it at any zoom
+void main() {
+	vec2 p = floor(canvas_pixel);
+	vec2 a = tail_segment.xy, d = tail_segment.zw - a;
+	float len2 = dot(d, d);
+	float t = len2 > 0.0 ? clamp(dot(p - a, d)/len2, 0.0, 1.0) : 0.0;
+	float coverage = tail_radius + 0.5 - length(p - (a + t*d));
+	if (coverage < 0.0) discard;
+	frag_color = tail_color;
+	if (antialias) frag_color.a *= min(coverage, 1.0);
+}
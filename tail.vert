@@ -0,0 +1,28 @@
+#version 330 core
+
+// One instance per piece of the predicted stroke tail, drawn as the quad
+// around its capsule straight into the window, over the canvas
+
+layout (location = 0) in vec4 segment; // a.xy, b.xy in canvas pixels
+layout (location = 1) in float radius;
+layout (location = 2) in vec4 color;
+
+flat out vec4 tail_segment;
+flat out float tail_radius;
+flat out vec4 tail_color;
+out vec2 canvas_pixel;
+
+uniform mat4 projection;
+uniform vec2 canvas_origin; // window position of the canvas corner at row 0
+uniform vec2 canvas_scale;  // window pixels per canvas pixel
+
+void main() {
+	vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1);
+	vec2 lo = min(segment.xy, segment.zw) - radius - 1.0;
+	vec2 hi = max(segment.xy, segment.zw) + radius + 2.0;
+	canvas_pixel = mix(lo, hi, corner);
+	gl_Position = projection * vec4(canvas_origin + canvas_pixel * canvas_scale, -1.0, 1.0);
+	tail_segment = segment;
+	tail_radius = radius;
+	tail_color = color;
+}